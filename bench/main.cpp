@@ -0,0 +1,415 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "gl4.h"
+
+#ifndef GIT_COMMIT
+#define GIT_COMMIT "unknown"
+#endif
+
+// Microbenchmarks for the gl4 math and buffer paths, in the style of Google
+// Benchmark. Each benchmark is a function that sets up its data and then does
+// its work in a while (bench.keepRunning()) loop, which is the only part that
+// is timed. The runner grows the iteration count until one run takes at least
+// --min-time seconds and reports the time per iteration from that run, plus
+// items and bytes per second if the benchmark says how many it handles per
+// iteration. Benchmarks registered with BENCHMARK_GL() need an OpenGL context
+// and run on a headless one.
+struct Bench {
+    long long iterations, done;
+    double items, bytes;
+    double start, seconds;
+
+    Bench() : iterations(), done(), items(), bytes(), start(), seconds() {}
+
+    // True until the loop has run iterations times
+    bool keepRunning() {
+        if (!done) start = currentTime();
+        if (done == iterations) {
+            seconds = currentTime() - start;
+            return false;
+        }
+        done++;
+        return true;
+    }
+};
+
+struct Benchmark {
+    const char *name;
+    void (*function)(Bench &bench);
+    bool needsGL;
+};
+
+static std::vector<Benchmark> &benchmarks() {
+    static std::vector<Benchmark> list;
+    return list;
+}
+
+struct RegisterBenchmark {
+    RegisterBenchmark(const char *name, void (*function)(Bench &bench), bool needsGL) {
+        Benchmark benchmark = { name, function, needsGL };
+        benchmarks().push_back(benchmark);
+    }
+};
+
+#define BENCHMARK(function) static RegisterBenchmark register_##function(#function, function, false)
+#define BENCHMARK_GL(function) static RegisterBenchmark register_##function(#function, function, true)
+
+// Keep the compiler from removing work whose result is never used
+template <typename T>
+inline void doNotOptimize(const T &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static float frand() {
+    return (float)rand() / RAND_MAX * 2 - 1;
+}
+
+static mat4 randomMatrix() {
+    mat4 matrix;
+    for (int i = 0; i < 16; i++) matrix.m[i] = frand();
+    return matrix;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Math
+////////////////////////////////////////////////////////////////////////////////
+
+static const int count = 4096;
+
+static void mat4_multiply(Bench &bench) {
+    mat4 a = randomMatrix(), b = randomMatrix();
+    while (bench.keepRunning()) {
+        a *= b;
+        doNotOptimize(a);
+    }
+    bench.items = 1;
+}
+BENCHMARK(mat4_multiply);
+
+static void mat4_multiply_batch(Bench &bench) {
+    std::vector<mat4> a(count), b(count), out(count);
+    for (int i = 0; i < count; i++) {
+        a[i] = randomMatrix();
+        b[i] = randomMatrix();
+    }
+    while (bench.keepRunning()) {
+        multiplyMatrices(a.data(), b.data(), out.data(), count);
+        doNotOptimize(out[0]);
+    }
+    bench.items = count;
+}
+BENCHMARK(mat4_multiply_batch);
+
+static void mat4_invert(Bench &bench) {
+    mat4 a = randomMatrix();
+    while (bench.keepRunning()) {
+        mat4 inverse = a;
+        inverse.invert();
+        doNotOptimize(inverse);
+    }
+    bench.items = 1;
+}
+BENCHMARK(mat4_invert);
+
+// The six rotations proj3_nbody's reset() does for every particle
+static void mat4_rotate_chain(Bench &bench) {
+    float t = 0;
+    while (bench.keepRunning()) {
+        mat4 matrix;
+        matrix.rotateX(t * 93).rotateY(t * 37).rotateZ(t * 17);
+        matrix.rotateX(t * 5).rotateY(t * 147).rotateZ(t * 71);
+        vec4 vertex = matrix * vec4(0, 0, 1, 0);
+        doNotOptimize(vertex);
+        t += 0.001f;
+    }
+    bench.items = 1;
+}
+BENCHMARK(mat4_rotate_chain);
+
+static void mat4_transform_points(Bench &bench) {
+    mat4 matrix = randomMatrix();
+    std::vector<vec3> points(count);
+    std::vector<vec4> out(count);
+    for (int i = 0; i < count; i++) points[i] = vec3(frand(), frand(), frand());
+    while (bench.keepRunning()) {
+        transformPoints(matrix, points.data(), out.data(), count);
+        doNotOptimize(out[0]);
+    }
+    bench.items = count;
+}
+BENCHMARK(mat4_transform_points);
+
+static void vec3_normalize(Bench &bench) {
+    std::vector<vec3> in(count), out(count);
+    for (int i = 0; i < count; i++) in[i] = vec3(frand(), frand(), frand());
+    while (bench.keepRunning()) {
+        for (int j = 0; j < count; j++) out[j] = normalized(in[j]);
+        doNotOptimize(out[0]);
+    }
+    bench.items = count;
+}
+BENCHMARK(vec3_normalize);
+
+static void vec3_cross(Bench &bench) {
+    std::vector<vec3> a(count), b(count), out(count);
+    for (int i = 0; i < count; i++) {
+        a[i] = vec3(frand(), frand(), frand());
+        b[i] = vec3(frand(), frand(), frand());
+    }
+    while (bench.keepRunning()) {
+        for (int j = 0; j < count; j++) out[j] = cross(a[j], b[j]);
+        doNotOptimize(out[0]);
+    }
+    bench.items = count;
+}
+BENCHMARK(vec3_cross);
+
+static void vec4_dot(Bench &bench) {
+    std::vector<vec4> a(count), b(count);
+    for (int i = 0; i < count; i++) {
+        a[i] = vec4(frand(), frand(), frand(), frand());
+        b[i] = vec4(frand(), frand(), frand(), frand());
+    }
+    while (bench.keepRunning()) {
+        float sum = 0;
+        for (int j = 0; j < count; j++) sum += dot(a[j], b[j]);
+        doNotOptimize(sum);
+    }
+    bench.items = count;
+}
+BENCHMARK(vec4_dot);
+
+////////////////////////////////////////////////////////////////////////////////
+// Buffers
+////////////////////////////////////////////////////////////////////////////////
+
+static const int bufferCount = 1 << 16;
+
+static void buffer_fill(Bench &bench) {
+    Buffer<vec3> buffer;
+    buffer.data.reserve(bufferCount);
+    while (bench.keepRunning()) {
+        buffer.clear();
+        for (int j = 0; j < bufferCount; j++) buffer << vec3(j, j, j);
+        doNotOptimize(buffer.data[0]);
+    }
+    bench.items = bufferCount;
+    bench.bytes = bufferCount * sizeof(vec3);
+}
+BENCHMARK(buffer_fill);
+
+// Enough data that the copy dominates the cost of the calls
+static const int transferCount = 1 << 20;
+
+static void buffer_upload(Bench &bench) {
+    Buffer<vec4> buffer;
+    buffer.data.resize(transferCount);
+    buffer.upload(GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+    while (bench.keepRunning()) {
+        buffer.markDirty(0, transferCount);
+        buffer.upload(GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW);
+        glFinish();
+    }
+    bench.bytes = transferCount * sizeof(vec4);
+}
+BENCHMARK_GL(buffer_upload);
+
+// The same data written into a persistently mapped StreamBuffer each frame,
+// which replaces the upload with a copy the CPU does itself
+static void buffer_stream(Bench &bench) {
+    StreamBuffer<vec4> buffer;
+    std::vector<vec4> data(transferCount);
+    buffer.create(transferCount);
+    while (bench.keepRunning()) {
+        std::copy(data.begin(), data.end(), buffer.begin());
+        buffer.end(transferCount);
+    }
+    bench.bytes = transferCount * sizeof(vec4);
+}
+BENCHMARK_GL(buffer_stream);
+
+static void buffer_readback(Bench &bench) {
+    Buffer<vec4> buffer;
+    buffer.data.resize(transferCount);
+    buffer.upload(GL_ARRAY_BUFFER, GL_DYNAMIC_READ);
+    std::vector<vec4> data(transferCount);
+    while (bench.keepRunning()) {
+        buffer.bind();
+        glGetBufferSubData(GL_ARRAY_BUFFER, 0, transferCount * sizeof(vec4), data.data());
+        buffer.unbind();
+    }
+    bench.bytes = transferCount * sizeof(vec4);
+}
+BENCHMARK_GL(buffer_readback);
+
+static const int textureSize = 1024;
+
+static void texture_upload(Bench &bench) {
+    Texture texture;
+    std::vector<unsigned char> pixels(textureSize * textureSize * 4);
+    texture.allocate(textureSize, textureSize, 1, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    while (bench.keepRunning()) {
+        texture.update(0, 0, 0, textureSize, textureSize, 1, pixels.data());
+        glFinish();
+    }
+    bench.bytes = pixels.size();
+}
+BENCHMARK_GL(texture_upload);
+
+static void texture_upload_async(Bench &bench) {
+    Texture texture;
+    std::vector<unsigned char> pixels(textureSize * textureSize * 4);
+    texture.allocate(textureSize, textureSize, 1, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    while (bench.keepRunning()) {
+        texture.uploadAsync(GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        glFinish();
+    }
+    bench.bytes = pixels.size();
+}
+BENCHMARK_GL(texture_upload_async);
+
+static void texture_readback(Bench &bench) {
+    Texture texture;
+    Readback readback;
+    std::vector<unsigned char> pixels(textureSize * textureSize * 4);
+    texture.allocate(textureSize, textureSize, 1, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST, GL_CLAMP_TO_EDGE, pixels.data());
+    while (bench.keepRunning()) {
+        texture.readbackAsync(readback, GL_RGBA, GL_UNSIGNED_BYTE);
+        readback.read(pixels.data());
+    }
+    bench.bytes = pixels.size();
+}
+BENCHMARK_GL(texture_readback);
+
+////////////////////////////////////////////////////////////////////////////////
+// Runner
+////////////////////////////////////////////////////////////////////////////////
+
+struct Result {
+    const char *name;
+    long long iterations;
+    double seconds;
+    double itemsPerSecond, bytesPerSecond;
+};
+
+// Double the iterations (or jump straight to the estimate) until a run takes
+// at least minTime seconds
+static Result run(const Benchmark &benchmark, double minTime) {
+    long long iterations = 1;
+    Bench bench;
+    while (true) {
+        bench = Bench();
+        bench.iterations = iterations;
+        benchmark.function(bench);
+        if (bench.seconds >= minTime || iterations >= 1000000000) break;
+        double estimate = bench.seconds > 0 ? iterations * minTime * 1.4 / bench.seconds : iterations * 10;
+        iterations = std::max(iterations * 2, std::min((long long)estimate, iterations * 100));
+    }
+
+    Result result = { benchmark.name, iterations, bench.seconds, 0, 0 };
+    result.itemsPerSecond = bench.items * iterations / bench.seconds;
+    result.bytesPerSecond = bench.bytes * iterations / bench.seconds;
+    return result;
+}
+
+static void writeJSON(const char *path, const std::vector<Result> &results, const char *renderer, const char *version) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        printf("couldn't write to %s\n", path);
+        exit(1);
+    }
+
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    time_t now = time(NULL);
+    char date[64];
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+
+    fprintf(file, "{\n  \"context\": {\n");
+    fprintf(file, "    \"date\": \"%s\",\n", date);
+    fprintf(file, "    \"host_name\": \"%s\",\n", host);
+    fprintf(file, "    \"commit\": \"%s\",\n", GIT_COMMIT);
+    fprintf(file, "    \"num_cpus\": %d,\n", threadCount());
+    fprintf(file, "    \"gl_renderer\": \"%s\",\n", renderer);
+    fprintf(file, "    \"gl_version\": \"%s\"\n", version);
+    fprintf(file, "  },\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &r = results[i];
+        fprintf(file, "    {\n");
+        fprintf(file, "      \"name\": \"%s\",\n", r.name);
+        fprintf(file, "      \"iterations\": %lld,\n", r.iterations);
+        fprintf(file, "      \"real_time\": %.6g,\n", r.seconds / r.iterations * 1e9);
+        fprintf(file, "      \"time_unit\": \"ns\"");
+        if (r.itemsPerSecond) fprintf(file, ",\n      \"items_per_second\": %.6g", r.itemsPerSecond);
+        if (r.bytesPerSecond) fprintf(file, ",\n      \"bytes_per_second\": %.6g", r.bytesPerSecond);
+        fprintf(file, "\n    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+}
+
+// Keep the strings from the driver out of the JSON escapes
+static std::string sanitize(const char *text) {
+    std::string result = text ? text : "";
+    for (size_t i = 0; i < result.size(); i++) {
+        if (result[i] == '"' || result[i] == '\\' || (unsigned char)result[i] < ' ') result[i] = ' ';
+    }
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *filter = NULL, *json = NULL;
+    double minTime = 0.5;
+    bool noGL = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--filter") && i + 1 < argc) filter = argv[++i];
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc) json = argv[++i];
+        else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) minTime = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--no-gl")) noGL = true;
+        else if (!strcmp(argv[i], "--list")) {
+            for (size_t j = 0; j < benchmarks().size(); j++) printf("%s\n", benchmarks()[j].name);
+            return 0;
+        } else {
+            printf("usage: %s [--filter <substring>] [--min-time <seconds>] [--json <file>] [--no-gl] [--list]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // Only create a context if a benchmark that is going to run needs one
+    std::vector<Benchmark> selected;
+    bool needsGL = false;
+    for (size_t i = 0; i < benchmarks().size(); i++) {
+        const Benchmark &benchmark = benchmarks()[i];
+        if (filter && !strstr(benchmark.name, filter)) continue;
+        if (noGL && benchmark.needsGL) continue;
+        selected.push_back(benchmark);
+        needsGL = needsGL || benchmark.needsGL;
+    }
+    HeadlessContext context;
+    std::string renderer, version;
+    if (needsGL) {
+        context.create(64, 64);
+        renderer = sanitize((const char *)glGetString(GL_RENDERER));
+        version = sanitize((const char *)glGetString(GL_VERSION));
+        printf("%s, OpenGL %s\n", renderer.c_str(), version.c_str());
+    }
+
+    printf("%-24s %14s %14s %14s\n", "Benchmark", "Time", "Iterations", "Throughput");
+    std::vector<Result> results;
+    for (size_t i = 0; i < selected.size(); i++) {
+        Result r = run(selected[i], minTime);
+        results.push_back(r);
+
+        char throughput[64] = "";
+        if (r.bytesPerSecond) snprintf(throughput, sizeof(throughput), "%.2f GB/s", r.bytesPerSecond / 1e9);
+        else if (r.itemsPerSecond) snprintf(throughput, sizeof(throughput), "%.1f M/s", r.itemsPerSecond / 1e6);
+        printf("%-24s %11.1f ns %14lld %14s\n", r.name, r.seconds / r.iterations * 1e9, r.iterations, throughput);
+        fflush(stdout);
+    }
+
+    if (json) writeJSON(json, results, renderer.c_str(), version.c_str());
+    return 0;
+}
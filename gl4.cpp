@@ -1,4 +1,20 @@
 #include "gl4.h"
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+double currentTime() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
 
 mat4 &mat4::transpose() {
     std::swap(m01, m10); std::swap(m02, m20); std::swap(m03, m30);
@@ -109,77 +125,126 @@ mat4 &mat4::perspective(float fov, float aspect, float near, float far) {
     return frustum(-x, x, -y, y, near, far);
 }
 
+// Four floats using GCC vector extensions, which become one SSE register on
+// x86 and one NEON register on ARM. Each lane does its multiplies and adds in
+// the same order as the scalar expressions in the comments, so the results
+// are identical to them.
+typedef float float4 __attribute__((vector_size(16)));
+
+// Pick lanes of one vector, or of two where lanes 4 to 7 are the second.
+// Clang and GCC 12 have __builtin_shufflevector, but older GCC only has
+// __builtin_shuffle, which takes the lanes as a vector.
+#ifdef __clang__
+#define shuffle(v, a, b, c, d) __builtin_shufflevector(v, v, a, b, c, d)
+#define shuffle2(v, w, a, b, c, d) __builtin_shufflevector(v, w, a, b, c, d)
+#else
+typedef int int4 __attribute__((vector_size(16)));
+#define shuffle(v, a, b, c, d) __builtin_shuffle(v, int4{ a, b, c, d })
+#define shuffle2(v, w, a, b, c, d) __builtin_shuffle(v, w, int4{ a, b, c, d })
+#endif
+
+static inline float4 row(const mat4 &t, int i) { return *(const float4 *)(t.m + i * 4); }
+static inline float4 load(const vec4 &v) { return *(const float4 *)v.xyzw; }
+static inline vec4 store(float4 v) { return vec4(v[0], v[1], v[2], v[3]); }
+
+static inline void transposed(const mat4 &t, float4 columns[4]) {
+    float4 r0 = row(t, 0), r1 = row(t, 1), r2 = row(t, 2), r3 = row(t, 3);
+    float4 lo01 = shuffle2(r0, r1, 0, 4, 1, 5), hi01 = shuffle2(r0, r1, 2, 6, 3, 7);
+    float4 lo23 = shuffle2(r2, r3, 0, 4, 1, 5), hi23 = shuffle2(r2, r3, 2, 6, 3, 7);
+    columns[0] = shuffle2(lo01, lo23, 0, 1, 4, 5);
+    columns[1] = shuffle2(lo01, lo23, 2, 3, 6, 7);
+    columns[2] = shuffle2(hi01, hi23, 0, 1, 4, 5);
+    columns[3] = shuffle2(hi01, hi23, 2, 3, 6, 7);
+}
+
+// Each element of the inverse is a cofactor, the 3x3 determinant of the rows
+// and columns not in its column and row (in that order, since the adjugate is
+// transposed):
+//
+//     m11*m22*m33 - m11*m32*m23 - m12*m21*m33 + m12*m31*m23 + m13*m21*m32 - m13*m31*m22
+//
+// One row of the inverse is computed at once, with the three remaining rows
+// for each lane gathered from the columns of the matrix.
 mat4 &mat4::invert() {
-    float t00 = m00, t01 = m01, t02 = m02, t03 = m03;
-    *this = mat4(
-        m11*m22*m33 - m11*m32*m23 - m12*m21*m33 + m12*m31*m23 + m13*m21*m32 - m13*m31*m22,
-        -m01*m22*m33 + m01*m32*m23 + m02*m21*m33 - m02*m31*m23 - m03*m21*m32 + m03*m31*m22,
-        m01*m12*m33 - m01*m32*m13 - m02*m11*m33 + m02*m31*m13 + m03*m11*m32 - m03*m31*m12,
-        -m01*m12*m23 + m01*m22*m13 + m02*m11*m23 - m02*m21*m13 - m03*m11*m22 + m03*m21*m12,
-
-        -m10*m22*m33 + m10*m32*m23 + m12*m20*m33 - m12*m30*m23 - m13*m20*m32 + m13*m30*m22,
-        m00*m22*m33 - m00*m32*m23 - m02*m20*m33 + m02*m30*m23 + m03*m20*m32 - m03*m30*m22,
-        -m00*m12*m33 + m00*m32*m13 + m02*m10*m33 - m02*m30*m13 - m03*m10*m32 + m03*m30*m12,
-        m00*m12*m23 - m00*m22*m13 - m02*m10*m23 + m02*m20*m13 + m03*m10*m22 - m03*m20*m12,
-
-        m10*m21*m33 - m10*m31*m23 - m11*m20*m33 + m11*m30*m23 + m13*m20*m31 - m13*m30*m21,
-        -m00*m21*m33 + m00*m31*m23 + m01*m20*m33 - m01*m30*m23 - m03*m20*m31 + m03*m30*m21,
-        m00*m11*m33 - m00*m31*m13 - m01*m10*m33 + m01*m30*m13 + m03*m10*m31 - m03*m30*m11,
-        -m00*m11*m23 + m00*m21*m13 + m01*m10*m23 - m01*m20*m13 - m03*m10*m21 + m03*m20*m11,
-
-        -m10*m21*m32 + m10*m31*m22 + m11*m20*m32 - m11*m30*m22 - m12*m20*m31 + m12*m30*m21,
-        m00*m21*m32 - m00*m31*m22 - m01*m20*m32 + m01*m30*m22 + m02*m20*m31 - m02*m30*m21,
-        -m00*m11*m32 + m00*m31*m12 + m01*m10*m32 - m01*m30*m12 - m02*m10*m31 + m02*m30*m11,
-        m00*m11*m22 - m00*m21*m12 - m01*m10*m22 + m01*m20*m12 + m02*m10*m21 - m02*m20*m11
-    );
-    float det = m00 * t00 + m10 * t01 + m20 * t02 + m30 * t03;
-    for (int i = 0; i < 16; i++) m[i] /= det;
+    float4 columns[4], a[4], b[4], c[4];
+    transposed(*this, columns);
+    for (int i = 0; i < 4; i++) {
+        a[i] = shuffle(columns[i], 1, 0, 0, 0);
+        b[i] = shuffle(columns[i], 2, 2, 1, 1);
+        c[i] = shuffle(columns[i], 3, 3, 3, 2);
+    }
+
+    static const int others[4][3] = { { 1, 2, 3 }, { 0, 2, 3 }, { 0, 1, 3 }, { 0, 1, 2 } };
+    float4 result[4];
+    for (int i = 0; i < 4; i++) {
+        int p = others[i][0], q = others[i][1], r = others[i][2];
+
+        // Negate the first factor of each term rather than the sum, which
+        // gives the same signed zeros as the scalar expressions
+        float4 sign = i & 1 ? (float4){ -1, 1, -1, 1 } : (float4){ 1, -1, 1, -1 };
+        float4 ap = a[p] * sign, aq = a[q] * sign, ar = a[r] * sign;
+        result[i] = ap * b[q] * c[r] - ap * c[q] * b[r] - aq * b[p] * c[r] + aq * c[p] * b[r] + ar * b[p] * c[q] - ar * c[p] * b[q];
+    }
+
+    float det = result[0][0] * m00 + result[1][0] * m01 + result[2][0] * m02 + result[3][0] * m03;
+    for (int i = 0; i < 4; i++) *(float4 *)(m + i * 4) = result[i] / det;
     return *this;
 }
 
+// Row i of the product is m[i][0] * t.row(0) + ... + m[i][3] * t.row(3)
 mat4 &mat4::operator *= (const mat4 &t) {
-    *this = mat4(
-        m00*t.m00 + m01*t.m10 + m02*t.m20 + m03*t.m30,
-        m00*t.m01 + m01*t.m11 + m02*t.m21 + m03*t.m31,
-        m00*t.m02 + m01*t.m12 + m02*t.m22 + m03*t.m32,
-        m00*t.m03 + m01*t.m13 + m02*t.m23 + m03*t.m33,
-
-        m10*t.m00 + m11*t.m10 + m12*t.m20 + m13*t.m30,
-        m10*t.m01 + m11*t.m11 + m12*t.m21 + m13*t.m31,
-        m10*t.m02 + m11*t.m12 + m12*t.m22 + m13*t.m32,
-        m10*t.m03 + m11*t.m13 + m12*t.m23 + m13*t.m33,
-
-        m20*t.m00 + m21*t.m10 + m22*t.m20 + m23*t.m30,
-        m20*t.m01 + m21*t.m11 + m22*t.m21 + m23*t.m31,
-        m20*t.m02 + m21*t.m12 + m22*t.m22 + m23*t.m32,
-        m20*t.m03 + m21*t.m13 + m22*t.m23 + m23*t.m33,
-
-        m30*t.m00 + m31*t.m10 + m32*t.m20 + m33*t.m30,
-        m30*t.m01 + m31*t.m11 + m32*t.m21 + m33*t.m31,
-        m30*t.m02 + m31*t.m12 + m32*t.m22 + m33*t.m32,
-        m30*t.m03 + m31*t.m13 + m32*t.m23 + m33*t.m33
-    );
+    float4 t0 = row(t, 0), t1 = row(t, 1), t2 = row(t, 2), t3 = row(t, 3);
+    for (int i = 0; i < 4; i++) {
+        const float *r = m + i * 4;
+        *(float4 *)r = r[0] * t0 + r[1] * t1 + r[2] * t2 + r[3] * t3;
+    }
     return *this;
 }
 
-vec4 mat4::operator * (const vec4 &v) {
-    return vec4(
-        m00*v.x + m01*v.y + m02*v.z + m03*v.w,
-        m10*v.x + m11*v.y + m12*v.z + m13*v.w,
-        m20*v.x + m21*v.y + m22*v.z + m23*v.w,
-        m30*v.x + m31*v.y + m32*v.z + m33*v.w
-    );
+// m00*v.x + m01*v.y + m02*v.z + m03*v.w in each lane, using the columns
+vec4 mat4::operator * (const vec4 &v) const {
+    float4 columns[4];
+    transposed(*this, columns);
+    return store(columns[0] * v.x + columns[1] * v.y + columns[2] * v.z + columns[3] * v.w);
 }
 
 vec4 operator * (const vec4 &v, const mat4 &t) {
-    return vec4(
-        t.m00*v.x + t.m10*v.y + t.m20*v.z + t.m30*v.w,
-        t.m01*v.x + t.m11*v.y + t.m21*v.z + t.m31*v.w,
-        t.m02*v.x + t.m12*v.y + t.m22*v.z + t.m32*v.w,
-        t.m03*v.x + t.m13*v.y + t.m23*v.z + t.m33*v.w
-    );
+    return store(row(t, 0) * v.x + row(t, 1) * v.y + row(t, 2) * v.z + row(t, 3) * v.w);
+}
+
+void transformPoints(const mat4 &t, const vec3 *in, vec4 *out, size_t n) {
+    float4 columns[4];
+    transposed(t, columns);
+    for (size_t i = 0; i < n; i++) {
+        // The w column times 1 is just the w column
+        *(float4 *)out[i].xyzw = columns[0] * in[i].x + columns[1] * in[i].y + columns[2] * in[i].z + columns[3];
+    }
 }
 
+void transformVectors(const mat4 &t, const vec4 *in, vec4 *out, size_t n) {
+    float4 columns[4];
+    transposed(t, columns);
+    for (size_t i = 0; i < n; i++) {
+        float4 v = load(in[i]);
+        *(float4 *)out[i].xyzw = columns[0] * v[0] + columns[1] * v[1] + columns[2] * v[2] + columns[3] * v[3];
+    }
+}
+
+void multiplyMatrices(const mat4 *a, const mat4 *b, mat4 *out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        float4 t0 = row(b[i], 0), t1 = row(b[i], 1), t2 = row(b[i], 2), t3 = row(b[i], 3);
+        float4 rows[4];
+        for (int j = 0; j < 4; j++) {
+            const float *r = a[i].m + j * 4;
+            rows[j] = r[0] * t0 + r[1] * t1 + r[2] * t2 + r[3] * t3;
+        }
+        for (int j = 0; j < 4; j++) *(float4 *)(out[i].m + j * 4) = rows[j];
+    }
+}
+
+#undef shuffle
+#undef shuffle2
+
 std::ostream &operator << (std::ostream &out, const mat4 &t) {
     return out << "mat4("
         << t.m00 << ", " << t.m01 << ", " << t.m02 << ", " << t.m03 << ",\n     "
@@ -188,11 +253,283 @@ std::ostream &operator << (std::ostream &out, const mat4 &t) {
         << t.m30 << ", " << t.m31 << ", " << t.m32 << ", " << t.m33 << ")";
 }
 
+State glState;
+
+void State::useProgram(unsigned int id) {
+    if (enabled && program == id) { elided++; return; }
+    glUseProgram(program = id);
+    issued++;
+}
+
+void State::bindVertexArray(unsigned int id) {
+    if (enabled && vertexArray == id) { elided++; return; }
+    glBindVertexArray(vertexArray = id);
+    issued++;
+}
+
+void State::bindFramebuffer(unsigned int id) {
+    if (enabled && framebuffer == id) { elided++; return; }
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer = id);
+    issued++;
+}
+
+void State::bindTexture(int unit, int target, unsigned int id) {
+    unsigned int *binding =
+        target == GL_TEXTURE_2D ? &textures2D[unit] :
+        target == GL_TEXTURE_3D ? &textures3D[unit] : NULL;
+    if (enabled && activeUnit == unit) elided++;
+    else { glActiveTexture(GL_TEXTURE0 + (activeUnit = unit)); issued++; }
+    if (enabled && binding && *binding == id) { elided++; return; }
+    if (binding) *binding = id;
+    glBindTexture(target, id);
+    issued++;
+}
+
+void State::bindBuffer(int target, unsigned int id) {
+    // GL_ELEMENT_ARRAY_BUFFER is part of the VAO state so it isn't tracked
+    int slot = -1;
+    if (target != GL_ELEMENT_ARRAY_BUFFER) {
+        for (int i = 0; i < MaxBufferTargets && slot < 0; i++) {
+            if (bufferTargets[i] == target || !bufferTargets[i]) slot = i;
+        }
+    }
+    if (slot >= 0) {
+        if (enabled && bufferTargets[slot] == target && buffers[slot] == id) { elided++; return; }
+        bufferTargets[slot] = target;
+        buffers[slot] = id;
+    }
+    glBindBuffer(target, id);
+    issued++;
+}
+
+void State::bindBufferBase(int target, int index, unsigned int id) {
+    // Indexed binding points aren't tracked but this also changes the generic
+    // binding for target
+    for (int i = 0; i < MaxBufferTargets; i++) {
+        if (bufferTargets[i] == target || !bufferTargets[i]) {
+            bufferTargets[i] = target;
+            buffers[i] = id;
+            break;
+        }
+    }
+    glBindBufferBase(target, index, id);
+    issued++;
+}
+
+void State::setViewport(int x, int y, int width, int height) {
+    if (enabled && viewportKnown && viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height) {
+        elided++;
+        return;
+    }
+    viewport[0] = x;
+    viewport[1] = y;
+    viewport[2] = width;
+    viewport[3] = height;
+    viewportKnown = true;
+    glViewport(x, y, width, height);
+    issued++;
+}
+
+void State::getViewport(int *result) {
+    // Avoid a round trip to the driver when the viewport is already known
+    if (!enabled || !viewportKnown) {
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        viewportKnown = true;
+    }
+    for (int i = 0; i < 4; i++) result[i] = viewport[i];
+}
+
+void State::forgetProgram(unsigned int id) {
+    if (program == id) program = 0;
+}
+
+void State::forgetVertexArray(unsigned int id) {
+    if (vertexArray == id) vertexArray = 0;
+}
+
+void State::forgetFramebuffer(unsigned int id) {
+    if (framebuffer == id) framebuffer = 0;
+}
+
+void State::forgetTexture(unsigned int id) {
+    for (int i = 0; i < MaxTextureUnits; i++) {
+        if (textures2D[i] == id) textures2D[i] = 0;
+        if (textures3D[i] == id) textures3D[i] = 0;
+    }
+}
+
+void State::forgetBuffer(unsigned int id) {
+    for (int i = 0; i < MaxBufferTargets; i++) {
+        if (buffers[i] == id) buffers[i] = 0;
+    }
+}
+
+void State::invalidate() {
+    program = vertexArray = framebuffer = 0;
+    activeUnit = 0;
+    for (int i = 0; i < MaxTextureUnits; i++) textures2D[i] = textures3D[i] = 0;
+    for (int i = 0; i < MaxBufferTargets; i++) bufferTargets[i] = buffers[i] = 0;
+    viewportKnown = false;
+}
+
+Profiler glProfiler;
+
+Profiler::~Profiler() {
+    for (int i = 0; i < Frames; i++) {
+        if (!frames[i].queries.empty()) glDeleteQueries(frames[i].queries.size(), frames[i].queries.data());
+    }
+}
+
+void Profiler::beginFrame() {
+    if (!enabled) return;
+    Frame &frame = current();
+
+    // Normally already done by endFrame() one frame ago, this only waits if
+    // the GPU is more than a frame behind
+    resolve(frame, true);
+    frame.number = frameNumber;
+    frame.scopes.clear();
+    frame.lastQuery = -1;
+    frame.resolved = false;
+    inFrame = true;
+    stack.clear();
+
+    if (cpuOrigin < 0) {
+        GLint64 timestamp;
+        glGetInteger64v(GL_TIMESTAMP, &timestamp);
+        cpuOrigin = currentTime();
+        gpuOrigin = timestamp * 1.0e-9;
+    }
+}
+
+void Profiler::endFrame() {
+    if (!enabled) return;
+    while (!stack.empty()) end();
+    inFrame = false;
+    frameNumber++;
+    resolve(frames[frameNumber % Frames], false);
+}
+
+void Profiler::flush() {
+    resolve(frames[frameNumber % Frames], true);
+    resolve(frames[(frameNumber + 1) % Frames], true);
+}
+
+void Profiler::begin(const char *name) {
+    if (!inFrame) return;
+    Frame &frame = current();
+    size_t index = frame.scopes.size();
+    if (frame.queries.size() < 2 * (index + 1)) {
+        size_t old = frame.queries.size();
+        frame.queries.resize(2 * (index + 1) * 2);
+        glGenQueries(frame.queries.size() - old, &frame.queries[old]);
+    }
+
+    Scope scope = { name, (int)stack.size(), currentTime(), 0, 0, 0 };
+    frame.scopes.push_back(scope);
+    stack.push_back(index);
+    glQueryCounter(frame.queries[2 * index], GL_TIMESTAMP);
+    frame.lastQuery = 2 * index;
+}
+
+void Profiler::end() {
+    if (stack.empty()) return;
+    Frame &frame = current();
+    int index = stack.back();
+    stack.pop_back();
+    glQueryCounter(frame.queries[2 * index + 1], GL_TIMESTAMP);
+    frame.lastQuery = 2 * index + 1;
+    frame.scopes[index].cpuEnd = currentTime();
+}
+
+void Profiler::resolve(Frame &frame, bool wait) {
+    if (frame.resolved) return;
+    if (!wait && frame.lastQuery >= 0) {
+        GLint available = 0;
+        glGetQueryObjectiv(frame.queries[frame.lastQuery], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+    }
+
+    for (size_t i = 0; i < frame.scopes.size(); i++) {
+        Scope &scope = frame.scopes[i];
+        GLuint64 begin, end;
+        glGetQueryObjectui64v(frame.queries[2 * i], GL_QUERY_RESULT, &begin);
+        glGetQueryObjectui64v(frame.queries[2 * i + 1], GL_QUERY_RESULT, &end);
+        scope.gpuBegin = begin * 1.0e-9 - gpuOrigin;
+        scope.gpuEnd = end * 1.0e-9 - gpuOrigin;
+        scope.cpuBegin -= cpuOrigin;
+        scope.cpuEnd -= cpuOrigin;
+    }
+    frame.resolved = true;
+    lastFrame = frame.scopes;
+    if (tracing) trace.insert(trace.end(), frame.scopes.begin(), frame.scopes.end());
+}
+
+void Profiler::report() const {
+    printf("%-32s %10s %10s\n", "scope", "cpu ms", "gpu ms");
+    for (size_t i = 0; i < lastFrame.size(); i++) {
+        const Scope &scope = lastFrame[i];
+        std::string name(scope.depth * 2, ' ');
+        name += scope.name;
+        printf("%-32s %10.3f %10.3f\n", name.c_str(), (scope.cpuEnd - scope.cpuBegin) * 1000, (scope.gpuEnd - scope.gpuBegin) * 1000);
+    }
+}
+
+void Profiler::writeTrace(const char *path) const {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        printf("error: could not write trace to %s\n", path);
+        return;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+    for (size_t i = 0; i < trace.size(); i++) {
+        const Scope &scope = trace[i];
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f}",
+            scope.name, scope.cpuBegin * 1.0e6, (scope.cpuEnd - scope.cpuBegin) * 1.0e6);
+        fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f}",
+            scope.name, scope.gpuBegin * 1.0e6, (scope.gpuEnd - scope.gpuBegin) * 1.0e6);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+}
+
+bool hasVersion(int major, int minor) {
+    int actualMajor = 0, actualMinor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &actualMajor);
+    glGetIntegerv(GL_MINOR_VERSION, &actualMinor);
+    return actualMajor > major || (actualMajor == major && actualMinor >= minor);
+}
+
+bool hasExtension(const char *name) {
+    int count = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+    for (int i = 0; i < count; i++) {
+        if (!strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name)) return true;
+    }
+    return false;
+}
+
+// Immutable storage can't be respecified so a new texture name is needed
+static void releaseImmutable(Texture &texture) {
+    if (!texture.immutable) return;
+    FBO::forgetTexture(texture.id);
+    glState.forgetTexture(texture.id);
+    glDeleteTextures(1, &texture.id);
+    texture.id = 0;
+    texture.immutable = false;
+}
+
 Texture &Texture::create(int w, int h, int d, int internalFormat, int format, int type, int filter, int wrap, void *data) {
+    releaseImmutable(*this);
     target = (d == 1) ? GL_TEXTURE_2D : GL_TEXTURE_3D;
     width = w;
     height = h;
     depth = d;
+    this->internalFormat = internalFormat;
+    this->format = format;
+    this->type = type;
     if (!id) glGenTextures(1, &id);
     bind();
     glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
@@ -210,77 +547,367 @@ Texture &Texture::create(int w, int h, int d, int internalFormat, int format, in
     return *this;
 }
 
+bool Readback::ready() {
+    if (fence && glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0) != GL_TIMEOUT_EXPIRED) {
+        glDeleteSync(fence);
+        fence = 0;
+        done = true;
+    }
+    return done;
+}
+
+void Readback::read(void *data) {
+    if (fence) {
+        glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, id);
+    glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, bytes, data);
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    done = false;
+}
+
+// Bytes per pixel for the format and type arguments of glGetTexImage() and
+// glTexSubImage*(). Packed types hold a whole pixel in one value. Pairs that
+// aren't listed exit instead of guessing a size that copies could overrun.
+static int pixelSize(int format, int type) {
+    int components = 0;
+    switch (format) {
+        case GL_RED: case GL_GREEN: case GL_BLUE: case GL_ALPHA: case GL_DEPTH_COMPONENT: case GL_STENCIL_INDEX:
+        case GL_RED_INTEGER: case GL_GREEN_INTEGER: case GL_BLUE_INTEGER: components = 1; break;
+        case GL_RG: case GL_RG_INTEGER: components = 2; break;
+        case GL_RGB: case GL_BGR: case GL_RGB_INTEGER: case GL_BGR_INTEGER: components = 3; break;
+        case GL_RGBA: case GL_BGRA: case GL_RGBA_INTEGER: case GL_BGRA_INTEGER: components = 4; break;
+    }
+    switch (type) {
+        case GL_BYTE: case GL_UNSIGNED_BYTE: if (components) return components; break;
+        case GL_SHORT: case GL_UNSIGNED_SHORT: case GL_HALF_FLOAT: if (components) return components * 2; break;
+        case GL_INT: case GL_UNSIGNED_INT: case GL_FLOAT: if (components) return components * 4; break;
+        case GL_UNSIGNED_BYTE_3_3_2: case GL_UNSIGNED_BYTE_2_3_3_REV: if (components == 3) return 1; break;
+        case GL_UNSIGNED_SHORT_5_6_5: case GL_UNSIGNED_SHORT_5_6_5_REV: if (components == 3) return 2; break;
+        case GL_UNSIGNED_SHORT_4_4_4_4: case GL_UNSIGNED_SHORT_4_4_4_4_REV:
+        case GL_UNSIGNED_SHORT_5_5_5_1: case GL_UNSIGNED_SHORT_1_5_5_5_REV: if (components == 4) return 2; break;
+        case GL_UNSIGNED_INT_8_8_8_8: case GL_UNSIGNED_INT_8_8_8_8_REV:
+        case GL_UNSIGNED_INT_10_10_10_2: case GL_UNSIGNED_INT_2_10_10_10_REV: if (components == 4) return 4; break;
+        case GL_UNSIGNED_INT_10F_11F_11F_REV: case GL_UNSIGNED_INT_5_9_9_9_REV: if (components == 3) return 4; break;
+        case GL_UNSIGNED_INT_24_8: if (format == GL_DEPTH_STENCIL) return 4; break;
+        case GL_FLOAT_32_UNSIGNED_INT_24_8_REV: if (format == GL_DEPTH_STENCIL) return 8; break;
+    }
+    printf("unsupported pixel format 0x%04X with type 0x%04X\n", format, type);
+    exit(0);
+}
+
+Readback &Texture::readbackAsync(Readback &readback, int format, int type) const {
+    unsigned int bytes = width * height * depth * pixelSize(format, type);
+    if (!readback.id) glGenBuffers(1, &readback.id);
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, readback.id);
+    if (readback.bytes != bytes) {
+        readback.bytes = bytes;
+        glBufferData(GL_PIXEL_PACK_BUFFER, bytes, NULL, GL_STREAM_READ);
+    }
+
+    // With a pixel pack buffer bound the "pointer" is an offset into it
+    bind();
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(target, 0, format, type, NULL);
+    unbind();
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    glDeleteSync(readback.fence);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.done = false;
+    return readback;
+}
+
+Texture &Texture::uploadAsync(int format, int type, const void *data) {
+    // Respecifying the whole buffer orphans storage the GPU may still be reading
+    if (!uploadBuffer) glGenBuffers(1, &uploadBuffer);
+    glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadBuffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, width * height * depth * pixelSize(format, type), data, GL_STREAM_DRAW);
+
+    bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (target == GL_TEXTURE_2D) {
+        glTexSubImage2D(target, 0, 0, 0, width, height, format, type, NULL);
+    } else {
+        glTexSubImage3D(target, 0, 0, 0, 0, width, height, depth, format, type, NULL);
+    }
+    unbind();
+    glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return *this;
+}
+
+static int sizedFormat(int internalFormat) {
+    switch (internalFormat) {
+        case GL_RED: return GL_R8;
+        case GL_RG: return GL_RG8;
+        case GL_RGB: return GL_RGB8;
+        case GL_RGBA: return GL_RGBA8;
+    }
+    return internalFormat;
+}
+
+Texture &Texture::allocate(int w, int h, int d, int internalFormat, int format, int type, int filter, int wrap, const void *data) {
+    int newTarget = (d == 1) ? GL_TEXTURE_2D : GL_TEXTURE_3D;
+    internalFormat = sizedFormat(internalFormat);
+    bool reuse = immutable && target == newTarget && width == w && height == h && depth == d && this->internalFormat == internalFormat;
+
+    if (!reuse) {
+        target = newTarget;
+        width = w;
+        height = h;
+        depth = d;
+        this->internalFormat = internalFormat;
+        FBO::forgetTexture(id);
+        glState.forgetTexture(id);
+        glDeleteTextures(1, &id);
+        glGenTextures(1, &id);
+        immutable = true;
+    }
+    this->format = format;
+    this->type = type;
+
+    bind();
+    glTexParameteri(target, GL_TEXTURE_MAG_FILTER, filter);
+    glTexParameteri(target, GL_TEXTURE_MIN_FILTER, filter);
+    glTexParameteri(target, GL_TEXTURE_WRAP_S, wrap);
+    glTexParameteri(target, GL_TEXTURE_WRAP_T, wrap);
+    if (!reuse) {
+        if (target == GL_TEXTURE_2D) {
+            glTexStorage2D(target, 1, internalFormat, w, h);
+        } else {
+            glTexParameteri(target, GL_TEXTURE_WRAP_R, wrap);
+            glTexStorage3D(target, 1, internalFormat, w, h, d);
+        }
+    } else if (target == GL_TEXTURE_3D) {
+        glTexParameteri(target, GL_TEXTURE_WRAP_R, wrap);
+    }
+    unbind();
+
+    if (data) update(0, 0, 0, w, h, d, data);
+    return *this;
+}
+
+Texture &Texture::update(int x, int y, int z, int w, int h, int d, const void *data) {
+    bind();
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (target == GL_TEXTURE_2D) {
+        glTexSubImage2D(target, 0, x, y, w, h, format, type, data);
+    } else {
+        glTexSubImage3D(target, 0, x, y, z, w, h, d, format, type, data);
+    }
+    unbind();
+    return *this;
+}
+
 void Texture::swapWith(Texture &other) {
     std::swap(id, other.id);
     std::swap(target, other.target);
     std::swap(width, other.width);
     std::swap(height, other.height);
     std::swap(depth, other.depth);
+    std::swap(internalFormat, other.internalFormat);
+    std::swap(format, other.format);
+    std::swap(type, other.type);
+    std::swap(immutable, other.immutable);
+}
+
+Texture::~Texture() {
+    FBO::forgetTexture(id);
+    glState.forgetTexture(id);
+    glDeleteTextures(1, &id);
+    glState.forgetBuffer(uploadBuffer);
+    glDeleteBuffers(1, &uploadBuffer);
+}
+
+unsigned int FBO::screen = 0;
+
+// Every FBO that exists, for forgetTexture(). This is never freed so FBOs
+// and textures destroyed at exit can still use it.
+static std::vector<FBO *> &allFBOs() {
+    static std::vector<FBO *> *fbos = new std::vector<FBO *>();
+    return *fbos;
+}
+
+FBO::FBO(bool autoDepth, bool resizeViewport) : id(), autoDepth(autoDepth),
+        resizeViewport(resizeViewport), newViewport(), oldViewport(), current(-1), useCount(), profiling() {
+    allFBOs().push_back(this);
+}
+
+FBO::~FBO() {
+    std::vector<FBO *> &fbos = allFBOs();
+    fbos.erase(std::remove(fbos.begin(), fbos.end(), this), fbos.end());
+    for (size_t i = 0; i < framebuffers.size(); i++) {
+        glState.forgetFramebuffer(framebuffers[i].id);
+        glDeleteFramebuffers(1, &framebuffers[i].id);
+        glDeleteRenderbuffers(1, &framebuffers[i].renderbuffer);
+    }
+}
+
+void FBO::forgetTexture(unsigned int texture) {
+    if (!texture) return;
+    std::vector<FBO *> &fbos = allFBOs();
+    for (size_t f = 0; f < fbos.size(); f++) {
+        FBO &fbo = *fbos[f];
+        for (size_t i = fbo.framebuffers.size(); i-- > 0;) {
+            Framebuffer &framebuffer = fbo.framebuffers[i];
+            bool drawsToTexture = false;
+            for (size_t j = 0; j < framebuffer.attachments.size(); j++) {
+                if (framebuffer.attachments[j].texture == texture) drawsToTexture = true;
+            }
+            if (!drawsToTexture) continue;
+            glState.forgetFramebuffer(framebuffer.id);
+            glDeleteFramebuffers(1, &framebuffer.id);
+            glDeleteRenderbuffers(1, &framebuffer.renderbuffer);
+            fbo.framebuffers.erase(fbo.framebuffers.begin() + i);
+            fbo.current = -1;
+        }
+    }
 }
 
 void FBO::bind() {
-    glBindFramebuffer(GL_FRAMEBUFFER, id);
+    profiling = glProfiler.enabled && glProfiler.autoScopes;
+    if (profiling) glProfiler.begin("fbo");
+    resolve();
+    glState.bindFramebuffer(id);
     if (resizeViewport) {
-        glGetIntegerv(GL_VIEWPORT, oldViewport);
-        glViewport(newViewport[0], newViewport[1], newViewport[2], newViewport[3]);
+        glState.getViewport(oldViewport);
+        glState.setViewport(newViewport[0], newViewport[1], newViewport[2], newViewport[3]);
     }
 }
 
 void FBO::unbind() {
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glState.bindFramebuffer(screen);
     if (resizeViewport) {
-        glViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
+        glState.setViewport(oldViewport[0], oldViewport[1], oldViewport[2], oldViewport[3]);
     }
+    if (profiling) glProfiler.end();
+    profiling = false;
 }
 
 FBO &FBO::attachColor(const Texture &texture, unsigned int attachment, unsigned int layer) {
+    return attach(texture, attachment, (texture.target == GL_TEXTURE_2D) ? 0 : layer);
+}
+
+FBO &FBO::attachLayered(const Texture &texture, unsigned int attachment) {
+    return attach(texture, attachment, -1);
+}
+
+FBO &FBO::attach(const Texture &texture, unsigned int attachment, int layer) {
     newViewport[2] = texture.width;
     newViewport[3] = texture.height;
-    if (!id) glGenFramebuffers(1, &id);
-    bind();
 
-    // Bind a 2D texture (using a 2D layer of a 3D texture)
-    if (texture.target == GL_TEXTURE_2D) {
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + attachment, texture.target, texture.id, 0);
-    } else {
-        glFramebufferTexture3D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + attachment, texture.target, texture.id, 0, layer);
+    // Only record the attachment, resolve() sets up the framebuffer later
+    Attachment a;
+    a.texture = texture.id;
+    a.target = texture.target;
+    a.layer = layer;
+    a.width = texture.width;
+    a.height = texture.height;
+    a.depth = texture.depth;
+    if (attachment >= attachments.size()) attachments.resize(attachment + 1);
+    if (attachments[attachment] != a) {
+        attachments[attachment] = a;
+        current = -1;
     }
-
-    // Need to call glDrawBuffers() for OpenGL to draw to multiple attachments
-    if (attachment >= drawBuffers.size()) drawBuffers.resize(attachment + 1, GL_NONE);
-    drawBuffers[attachment] = GL_COLOR_ATTACHMENT0 + attachment;
-    glDrawBuffers(drawBuffers.size(), drawBuffers.data());
-
-    unbind();
     return *this;
 }
 
 FBO &FBO::detachColor(unsigned int attachment) {
-    bind();
-
-    // Update the draw buffers
-    if (attachment < drawBuffers.size()) {
-        drawBuffers[attachment] = GL_NONE;
-        glDrawBuffers(drawBuffers.size(), drawBuffers.data());
+    if (attachment < attachments.size() && attachments[attachment].texture) {
+        attachments[attachment] = Attachment();
+        current = -1;
     }
 
-    unbind();
+    // Trailing empty attachments don't change anything
+    while (!attachments.empty() && !attachments.back().texture) attachments.pop_back();
     return *this;
 }
 
-FBO &FBO::check() {
-    bind();
-    if (autoDepth) {
-        if (renderbufferWidth != newViewport[2] || renderbufferHeight != newViewport[3]) {
-            renderbufferWidth = newViewport[2];
-            renderbufferHeight = newViewport[3];
-            if (!renderbuffer) glGenRenderbuffers(1, &renderbuffer);
-            glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
-            glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32, renderbufferWidth, renderbufferHeight);
-            glBindRenderbuffer(GL_RENDERBUFFER, 0);
+void FBO::resolve() {
+    if (current >= 0) {
+        framebuffers[current].lastUsed = ++useCount;
+        return;
+    }
+
+    // Reuse the framebuffer that was already set up for these attachments
+    for (size_t i = 0; i < framebuffers.size(); i++) {
+        if (framebuffers[i].attachments == attachments) {
+            current = i;
+            id = framebuffers[i].id;
+            framebuffers[i].lastUsed = ++useCount;
+            return;
+        }
+    }
+
+    // Otherwise set up a new one, recycling the least recently used one
+    if (framebuffers.size() < MaxFramebuffers) {
+        current = framebuffers.size();
+        framebuffers.push_back(Framebuffer());
+    } else {
+        current = 0;
+        for (size_t i = 1; i < framebuffers.size(); i++) {
+            if (framebuffers[i].lastUsed < framebuffers[current].lastUsed) current = i;
+        }
+    }
+    Framebuffer &framebuffer = framebuffers[current];
+    if (!framebuffer.id) glGenFramebuffers(1, &framebuffer.id);
+    id = framebuffer.id;
+    framebuffer.lastUsed = ++useCount;
+    framebuffer.checked = false;
+    unsigned int previous = glState.framebuffer;
+    glState.bindFramebuffer(id);
+
+    // Bind 2D textures (using a 2D layer of a 3D texture, or all of them),
+    // detaching anything left over from a recycled framebuffer
+    size_t count = std::max(attachments.size(), framebuffer.attachments.size());
+    bool layered = false;
+    for (size_t i = 0; i < count; i++) {
+        Attachment a = (i < attachments.size()) ? attachments[i] : Attachment();
+        if (a.layer == -1) layered = true;
+        if (i < framebuffer.attachments.size() && framebuffer.attachments[i] == a) continue;
+        if (a.layer == -1) {
+            glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, a.texture, 0);
+        } else if (a.target == GL_TEXTURE_3D) {
+            glFramebufferTexture3D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, a.target, a.texture, 0, a.layer);
+        } else {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, a.texture, 0);
         }
-        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffer);
     }
+    framebuffer.attachments = attachments;
+
+    // Need to call glDrawBuffers() for OpenGL to draw to multiple attachments
+    std::vector<unsigned int> drawBuffers(std::max<size_t>(attachments.size(), 1), GL_NONE);
+    for (size_t i = 0; i < attachments.size(); i++) {
+        if (attachments[i].texture) drawBuffers[i] = GL_COLOR_ATTACHMENT0 + i;
+    }
+    glDrawBuffers(drawBuffers.size(), drawBuffers.data());
+
+    // A renderbuffer isn't layered, so the framebuffer would be incomplete
+    if (layered && framebuffer.renderbufferWidth) {
+        framebuffer.renderbufferWidth = framebuffer.renderbufferHeight = 0;
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, 0);
+    }
+
+    if (autoDepth && !layered && (framebuffer.renderbufferWidth != newViewport[2] || framebuffer.renderbufferHeight != newViewport[3])) {
+        framebuffer.renderbufferWidth = newViewport[2];
+        framebuffer.renderbufferHeight = newViewport[3];
+        if (!framebuffer.renderbuffer) glGenRenderbuffers(1, &framebuffer.renderbuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, framebuffer.renderbuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT32, framebuffer.renderbufferWidth, framebuffer.renderbufferHeight);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, framebuffer.renderbuffer);
+    }
+
+    glState.bindFramebuffer(previous);
+}
+
+FBO &FBO::check() {
+    resolve();
+    if (framebuffers[current].checked) return *this;
+    unsigned int previous = glState.framebuffer;
+    glState.bindFramebuffer(id);
     switch (glCheckFramebufferStatus(GL_FRAMEBUFFER)) {
         case GL_FRAMEBUFFER_COMPLETE: break;
         case GL_FRAMEBUFFER_UNDEFINED: printf("GL_FRAMEBUFFER_UNDEFINED\n"); exit(0);
@@ -295,11 +922,49 @@ FBO &FBO::check() {
         case GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT: printf("GL_FRAMEBUFFER_INCOMPLETE_MISSING_ATTACHMENT\n"); exit(0);
         default: printf("Unknown glCheckFramebufferStatus error"); exit(0);
     }
-    unbind();
+    glState.bindFramebuffer(previous);
+    framebuffers[current].checked = true;
     return *this;
 }
 
+// FNV-1a
+static unsigned int hashName(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name) hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+const LocationCache::Entry *LocationCache::find(const char *name) const {
+    if (entries.empty()) return NULL;
+    unsigned int hash = hashName(name), mask = entries.size() - 1;
+    for (unsigned int i = hash & mask; !entries[i].name.empty(); i = (i + 1) & mask) {
+        if (entries[i].hash == hash && entries[i].name == name) return &entries[i];
+    }
+    return NULL;
+}
+
+void LocationCache::insert(const char *name, int location) {
+    // Keep the table at most half full so probe sequences stay short
+    if ((count + 1) * 2 > entries.size()) {
+        std::vector<Entry> old;
+        old.swap(entries);
+        entries.resize(old.empty() ? 16 : old.size() * 2);
+        count = 0;
+        for (size_t i = 0; i < old.size(); i++) {
+            if (!old[i].name.empty()) insert(old[i].name.c_str(), old[i].location);
+        }
+    }
+
+    unsigned int hash = hashName(name), mask = entries.size() - 1, i = hash & mask;
+    while (!entries[i].name.empty() && !(entries[i].hash == hash && entries[i].name == name)) i = (i + 1) & mask;
+    if (entries[i].name.empty()) count++;
+    entries[i].hash = hash;
+    entries[i].location = location;
+    entries[i].name = name;
+}
+
 Shader::~Shader() {
+    glState.forgetProgram(id);
     glDeleteProgram(id);
     for (size_t i = 0; i < stages.size(); i++) {
         glDeleteShader(stages[i]);
@@ -317,35 +982,220 @@ static void error(const char *type, const char *error, const char *source = NULL
 }
 
 Shader &Shader::shader(int type, const char *source) {
-    // Compile shader
-    unsigned int shader = glCreateShader(type);
-    glShaderSource(shader, 1, &source, NULL);
-    glCompileShader(shader);
-    stages.push_back(shader);
-
-    // Check for errors
-    char buffer[512];
-    int length;
-    glGetShaderInfoLog(shader, sizeof(buffer), &length, buffer);
-    if (length) error("compile error", buffer, source);
+    // Compiling waits until link() so a cached binary can skip it
+    sources.push_back(std::make_pair(type, std::string(source)));
 
     // Allow chaining
     return *this;
 }
 
+const char *Shader::cacheDirectory = NULL;
+
+static unsigned long long hashBytes(unsigned long long hash, const char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    return hash;
+}
+
+static unsigned long long hashString(unsigned long long hash, const char *text) {
+    // Include the terminator so "ab" + "c" and "a" + "bc" hash differently
+    return hashBytes(hash, text ? text : "", text ? strlen(text) + 1 : 1);
+}
+
+// The file for a program with these stages on this driver, or "" if program
+// binaries can't be cached
+static std::string binaryPath(const std::vector<std::pair<int, std::string> > &sources) {
+    if (!Shader::cacheDirectory || !hasVersion(4, 1)) return "";
+    int formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    if (!formats) return "";
+
+    unsigned long long hash = 14695981039346656037ull;
+    hash = hashString(hash, (const char *)glGetString(GL_VENDOR));
+    hash = hashString(hash, (const char *)glGetString(GL_RENDERER));
+    hash = hashString(hash, (const char *)glGetString(GL_VERSION));
+    for (size_t i = 0; i < sources.size(); i++) {
+        hash = hashBytes(hash, (const char *)&sources[i].first, sizeof(int));
+        hash = hashString(hash, sources[i].second.c_str());
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", hash);
+    return Shader::cacheDirectory + std::string(name);
+}
+
+// Files are a GLenum binary format followed by the binary itself
+static bool loadBinary(unsigned int program, const std::string &path) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+    std::vector<char> data;
+    char buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) data.insert(data.end(), buffer, buffer + count);
+    fclose(file);
+    if (data.size() <= sizeof(GLenum)) return false;
+
+    // The driver can still reject a binary, i.e. after an update that kept
+    // the version string the same
+    GLenum format;
+    memcpy(&format, data.data(), sizeof(format));
+    glProgramBinary(program, format, data.data() + sizeof(format), data.size() - sizeof(format));
+    int linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    return linked;
+}
+
+static void saveBinary(unsigned int program, const std::string &path) {
+    int length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (!length) return;
+    std::vector<char> data(sizeof(GLenum) + length);
+    GLenum format;
+    glGetProgramBinary(program, length, &length, &format, data.data() + sizeof(format));
+    memcpy(data.data(), &format, sizeof(format));
+
+    // Write to a temporary file first so other processes never load half of one
+    mkdir(Shader::cacheDirectory, 0755);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+    std::string temporary = path + suffix;
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (!file) return;
+    bool written = fwrite(data.data(), 1, sizeof(format) + length, file) == sizeof(format) + length;
+    if (fclose(file) || !written || rename(temporary.c_str(), path.c_str())) remove(temporary.c_str());
+}
+
+// Checked once since it's asked every frame by isReady()
+static bool hasParallelCompile() {
+    static int supported = -1;
+    if (supported < 0) {
+        supported = hasExtension("GL_KHR_parallel_shader_compile");
+
+        // Let the driver pick how many threads to use
+        if (supported) glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    }
+    return supported;
+}
+
 void Shader::link() {
-    // Create and link program
+    linkAsync();
+    finish();
+}
+
+void Shader::linkAsync() {
     if (!id) id = glCreateProgram();
+    hasParallelCompile();
+    linking = true;
+    binaryFile = binaryPath(sources);
+    if (!binaryFile.empty() && loadBinary(id, binaryFile)) {
+        binaryFile.clear();
+        return;
+    }
+
+    // Compile any stages added since the last link. Nothing here asks for a
+    // result, so the driver is free to work on them in the background.
+    for (size_t i = stages.size(); i < sources.size(); i++) {
+        const char *source = sources[i].second.c_str();
+        unsigned int shader = glCreateShader(sources[i].first);
+        glShaderSource(shader, 1, &source, NULL);
+        glCompileShader(shader);
+        stages.push_back(shader);
+    }
+
+    // Link program
     for (size_t i = 0; i < stages.size(); i++) {
         glAttachShader(id, stages[i]);
     }
+    if (!binaryFile.empty()) glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
     glLinkProgram(id);
+}
 
-    // Check for errors
+bool Shader::isReady() const {
+    if (!linking || !hasParallelCompile()) return true;
+    int done = 0;
+    glGetProgramiv(id, GL_COMPLETION_STATUS_KHR, &done);
+    return done;
+}
+
+void Shader::finish() const {
+    linking = false;
+
+    // Check for errors, which waits for the driver
     char buffer[512];
     int length;
+    for (size_t i = 0; i < stages.size(); i++) {
+        glGetShaderInfoLog(stages[i], sizeof(buffer), &length, buffer);
+        if (length) error("compile error", buffer, sources[i].second.c_str());
+    }
     glGetProgramInfoLog(id, sizeof(buffer), &length, buffer);
     if (length) error("link error", buffer);
+
+    if (!binaryFile.empty()) saveBinary(id, binaryFile);
+
+    // Cache the locations of all active uniforms and attributes
+    uniforms.clear();
+    attributes.clear();
+    int count, maxLength;
+    glGetProgramiv(id, GL_ACTIVE_UNIFORMS, &count);
+    glGetProgramiv(id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+    std::vector<char> name(maxLength + 1);
+    for (int i = 0; i < count; i++) {
+        int size;
+        unsigned int type;
+        glGetActiveUniform(id, i, name.size(), &length, &size, &type, name.data());
+        int location = glGetUniformLocation(id, name.data());
+        uniforms.insert(name.data(), location);
+
+        // Arrays are reported as "name[0]" but can also be set using "name"
+        if (length > 3 && !strcmp(name.data() + length - 3, "[0]")) {
+            name[length - 3] = '\0';
+            uniforms.insert(name.data(), location);
+        }
+    }
+    glGetProgramiv(id, GL_ACTIVE_ATTRIBUTES, &count);
+    glGetProgramiv(id, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &maxLength);
+    name.resize(maxLength + 1);
+    for (int i = 0; i < count; i++) {
+        int size;
+        unsigned int type;
+        glGetActiveAttrib(id, i, name.size(), &length, &size, &type, name.data());
+        attributes.insert(name.data(), glGetAttribLocation(id, name.data()));
+    }
+}
+
+unsigned int Shader::uniform(const char *name) const {
+    if (linking) finish();
+    const LocationCache::Entry *entry = uniforms.find(name);
+    if (entry) return entry->location;
+    int location = glGetUniformLocation(id, name);
+    uniforms.insert(name, location);
+    return location;
+}
+
+unsigned int Shader::attribute(const char *name) const {
+    if (linking) finish();
+    const LocationCache::Entry *entry = attributes.find(name);
+    if (entry) return entry->location;
+    int location = glGetAttribLocation(id, name);
+    attributes.insert(name, location);
+    return location;
+}
+
+void Shader::uniformBlock(const char *name, int index, int size) const {
+    if (linking) finish();
+    unsigned int block = glGetUniformBlockIndex(id, name);
+    if (block == GL_INVALID_INDEX) {
+        printf("uniform block %s isn't active\n", name);
+        exit(0);
+    }
+
+    // The driver may leave off padding after the last member
+    int blockSize = 0;
+    glGetActiveUniformBlockiv(id, block, GL_UNIFORM_BLOCK_DATA_SIZE, &blockSize);
+    if ((blockSize + 15) / 16 * 16 != size) {
+        printf("expected uniform block %s to be %d bytes like its struct, got %d bytes\n", name, size, blockSize);
+        exit(0);
+    }
+    glUniformBlockBinding(id, block, index);
 }
 
 void VAO::check() {
@@ -362,3 +1212,165 @@ void VAO::check() {
         exit(0);
     }
 }
+
+HeadlessContext::~HeadlessContext() {
+    if (!context) return;
+    glState.forgetFramebuffer(framebuffer);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteRenderbuffers(1, &colorbuffer);
+    glDeleteRenderbuffers(1, &depthbuffer);
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+    eglTerminate(display);
+}
+
+void HeadlessContext::create(int w, int h, int major, int minor) {
+    width = w;
+    height = h;
+
+    // Prefer the surfaceless platform since it works without any display server
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (!display || !eglInitialize(display, NULL, NULL)) {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (!eglInitialize(display, NULL, NULL)) error("headless error", "could not initialize EGL");
+    }
+
+    // The context never has a surface so it doesn't need a config either
+    EGLint attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, major,
+        EGL_CONTEXT_MINOR_VERSION, minor,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+        EGL_NONE
+    };
+    eglBindAPI(EGL_OPENGL_API);
+    context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+    if (!context) error("headless error", "could not create an OpenGL context");
+    if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) error("headless error", "could not make the context current");
+
+    // Stand in for the window's framebuffer
+    glGenRenderbuffers(1, &colorbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, colorbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &depthbuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, depthbuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glGenFramebuffers(1, &framebuffer);
+    glState.invalidate();
+    glState.bindFramebuffer(framebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorbuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthbuffer);
+    glState.setViewport(0, 0, width, height);
+    FBO::screen = framebuffer;
+}
+
+// The pool runs one batch of tasks at a time. Workers sleep until a batch is
+// posted, then everyone (including the posting thread) claims task indices
+// from a shared counter until they run out. Every worker checks in after each
+// batch so none can still be looking at a batch when the next is posted.
+static struct ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    void (*task)(void *, int);
+    void *context;
+    int tasks;
+    std::atomic<int> next;
+    unsigned int batch;
+    int checkedIn;
+    int requested;
+    bool running, stopping;
+
+    ThreadPool() : task(), context(), tasks(), next(), batch(), checkedIn(), requested(), running(), stopping() {}
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+    }
+
+    int size() {
+        if (requested > 0) return requested;
+        return std::max(1, (int)std::thread::hardware_concurrency());
+    }
+
+    void start() {
+        for (int i = 1; i < size(); i++) workers.push_back(std::thread(&ThreadPool::work, this));
+    }
+
+    void work();
+
+    void runTasks() {
+        int index;
+        while ((index = next++) < tasks) {
+            task(context, index);
+        }
+    }
+} pool;
+
+static thread_local bool insideParallelRun = false;
+
+void ThreadPool::work() {
+    insideParallelRun = true;
+    unsigned int seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || batch != seen; });
+        if (stopping) return;
+        seen = batch;
+        lock.unlock();
+        runTasks();
+        lock.lock();
+        if (++checkedIn == (int)workers.size()) done.notify_all();
+    }
+}
+
+int threadCount() {
+    return pool.size();
+}
+
+void setThreadCount(int count) {
+    pool.requested = count;
+}
+
+void parallelRun(int tasks, void (*task)(void *context, int index), void *context) {
+    // Run small batches, nested calls, and single-threaded pools in place
+    if (tasks == 1 || insideParallelRun || pool.size() == 1) {
+        for (int i = 0; i < tasks; i++) task(context, i);
+        return;
+    }
+    if (!pool.running) {
+        pool.start();
+        pool.running = true;
+    }
+
+    insideParallelRun = true;
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.task = task;
+        pool.context = context;
+        pool.tasks = tasks;
+        pool.next = 0;
+        pool.checkedIn = 0;
+        pool.batch++;
+    }
+    pool.wake.notify_all();
+    pool.runTasks();
+
+    // Wait for the workers still running tasks from this batch
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&] { return pool.checkedIn == (int)pool.workers.size(); });
+    insideParallelRun = false;
+}
+
+double HeadlessContext::run(void (*update)(), int steps) {
+    double start = currentTime();
+    for (int i = 0; i < steps; i++) update();
+    glFinish();
+    return currentTime() - start;
+}
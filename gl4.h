@@ -12,7 +12,10 @@
 #include <GL/glu.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <algorithm>
 #include <ostream>
+#include <string>
 #include <vector>
 #include <math.h>
 
@@ -25,6 +28,59 @@
 #define GL_PATCH_VERTICES 0x8E72
 #define GL_TESS_CONTROL_SHADER 0x8E88
 #define GL_TESS_EVALUATION_SHADER 0x8E87
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define GL_STREAM_READ 0x88E1
+#define GL_TIMEOUT_IGNORED 0xFFFFFFFFFFFFFFFFull
+#define GL_RG 0x8227
+#define GL_HALF_FLOAT 0x140B
+#define GL_R8 0x8229
+#define GL_TIMESTAMP 0x8E28
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#define GL_MAJOR_VERSION 0x821B
+#define GL_MINOR_VERSION 0x821C
+#define GL_COMPUTE_SHADER 0x91B9
+#define GL_SHADER_STORAGE_BUFFER 0x90D2
+#define GL_SHADER_STORAGE_BARRIER_BIT 0x00002000
+#define GL_PIXEL_BUFFER_BARRIER_BIT 0x00000080
+#define GL_TEXTURE_FETCH_BARRIER_BIT 0x00000008
+#define GL_SHADER_IMAGE_ACCESS_BARRIER_BIT 0x00000020
+#define GL_READ_ONLY 0x88B8
+#define GL_WRITE_ONLY 0x88B9
+#define GL_READ_WRITE 0x88BA
+#define GL_R32I 0x8235
+#define GL_RED_INTEGER 0x8D94
+#define GL_GREEN_INTEGER 0x8D95
+#define GL_BLUE_INTEGER 0x8D96
+#define GL_RG_INTEGER 0x8228
+#define GL_RGB_INTEGER 0x8D98
+#define GL_RGBA_INTEGER 0x8D99
+#define GL_BGR_INTEGER 0x8D9A
+#define GL_BGRA_INTEGER 0x8D9B
+#define GL_DEPTH_STENCIL 0x84F9
+#define GL_UNSIGNED_INT_24_8 0x84FA
+#define GL_FLOAT_32_UNSIGNED_INT_24_8_REV 0x8DAD
+#define GL_UNSIGNED_INT_10F_11F_11F_REV 0x8C3B
+#define GL_UNSIGNED_INT_5_9_9_9_REV 0x8C3E
+#define GL_TEXTURE_UPDATE_BARRIER_BIT 0x00000100
+#define GL_BUFFER_UPDATE_BARRIER_BIT 0x00000200
+#define GL_RG8 0x822B
+#define GL_DRAW_INDIRECT_BUFFER 0x8F3F
+#define GL_DISPATCH_INDIRECT_BUFFER 0x90EE
+#define GL_COMMAND_BARRIER_BIT 0x00000040
+#define GL_ELEMENT_ARRAY_BARRIER_BIT 0x00000002
+#define GL_LINK_STATUS 0x8B82
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#define GL_NUM_EXTENSIONS 0x821D
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#define GL_UNIFORM_BUFFER 0x8A11
+#define GL_UNIFORM_BLOCK_DATA_SIZE 0x8A40
+#define GL_INVALID_INDEX 0xFFFFFFFFu
 
 // Forward declarations for new functions in case they aren't defined.
 extern "C" {
@@ -37,6 +93,7 @@ extern "C" {
     void glFramebufferRenderbuffer(GLenum target, GLenum attachment, GLenum renderbuffertarget, GLuint renderbuffer);
     void glFramebufferTexture2D(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level);
     void glFramebufferTexture3D(GLenum target, GLenum attachment, GLenum textarget, GLuint texture, GLint level, GLint layer);
+    void glFramebufferTexture(GLenum target, GLenum attachment, GLuint texture, GLint level);
     void glDeleteProgram(GLuint program);
     void glDeleteShader(GLuint shader);
     void glShaderSource(GLuint shader, GLsizei count, const GLchar **string, const GLint *length);
@@ -45,15 +102,54 @@ extern "C" {
     void glCompileShader(GLuint shader);
     void glGetShaderInfoLog(GLuint shader, GLsizei maxLength, GLsizei *length, GLchar *infoLog);
     void glGetProgramInfoLog(GLuint program, GLsizei maxLength, GLsizei *length, GLchar *infoLog);
+    void glGetProgramiv(GLuint program, GLenum pname, GLint *params);
+    void glGetProgramBinary(GLuint program, GLsizei bufSize, GLsizei *length, GLenum *binaryFormat, void *binary);
+    void glProgramBinary(GLuint program, GLenum binaryFormat, const void *binary, GLsizei length);
+    void glProgramParameteri(GLuint program, GLenum pname, GLint value);
+    void glMaxShaderCompilerThreadsKHR(GLuint count);
+    const GLubyte *glGetStringi(GLenum name, GLuint index);
+    void glGetActiveUniform(GLuint program, GLuint index, GLsizei bufSize, GLsizei *length, GLint *size, GLenum *type, GLchar *name);
+    void glGetActiveAttrib(GLuint program, GLuint index, GLsizei bufSize, GLsizei *length, GLint *size, GLenum *type, GLchar *name);
     void glGenBuffers(GLsizei n, GLuint *buffers);
     void glDeleteBuffers(GLsizei n, const GLuint *buffers);
     void glBindBuffer(GLenum target, GLuint buffer);
     void glBufferData(GLenum target, GLsizeiptr size, const GLvoid *data, GLenum usage);
+    void glBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, const void *data);
+    void glBufferStorage(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+    void *glMapBufferRange(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access);
+    GLboolean glUnmapBuffer(GLenum target);
+    GLsync glFenceSync(GLenum condition, GLbitfield flags);
+    GLenum glClientWaitSync(GLsync sync, GLbitfield flags, GLuint64 timeout);
+    void glDeleteSync(GLsync sync);
+    void glGetBufferSubData(GLenum target, GLintptr offset, GLsizeiptr size, void *data);
+    void glGenQueries(GLsizei n, GLuint *ids);
+    void glDeleteQueries(GLsizei n, const GLuint *ids);
+    void glQueryCounter(GLuint id, GLenum target);
+    void glGetQueryObjectiv(GLuint id, GLenum pname, GLint *params);
+    void glGetQueryObjectui64v(GLuint id, GLenum pname, GLuint64 *params);
+    void glGetInteger64v(GLenum pname, GLint64 *data);
+    void glBindBufferBase(GLenum target, GLuint index, GLuint buffer);
+    GLuint glGetUniformBlockIndex(GLuint program, const GLchar *uniformBlockName);
+    void glGetActiveUniformBlockiv(GLuint program, GLuint uniformBlockIndex, GLenum pname, GLint *params);
+    void glUniformBlockBinding(GLuint program, GLuint uniformBlockIndex, GLuint uniformBlockBinding);
+    void glDispatchCompute(GLuint num_groups_x, GLuint num_groups_y, GLuint num_groups_z);
+    void glDispatchComputeIndirect(GLintptr indirect);
+    void glDrawArraysIndirect(GLenum mode, const void *indirect);
+    void glDrawElementsIndirect(GLenum mode, GLenum type, const void *indirect);
+    void glMultiDrawArraysIndirect(GLenum mode, const void *indirect, GLsizei drawcount, GLsizei stride);
+    void glMultiDrawElementsIndirect(GLenum mode, GLenum type, const void *indirect, GLsizei drawcount, GLsizei stride);
+    void glMemoryBarrier(GLbitfield barriers);
+    void glBindImageTexture(GLuint unit, GLuint texture, GLint level, GLboolean layered, GLint layer, GLenum access, GLenum format);
+    void glClearBufferData(GLenum target, GLenum internalformat, GLenum format, GLenum type, const void *data);
+    void glTexStorage2D(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+    void glTexStorage3D(GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height, GLsizei depth);
     void glGenVertexArrays(GLsizei n, GLuint *arrays);
     void glDeleteVertexArrays(GLsizei n, const GLuint *arrays);
     void glBindVertexArray(GLuint array);
     void glDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei primcount);
     void glDrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, const void *indices, GLsizei primcount);
+    void glDrawArraysInstancedBaseInstance(GLenum mode, GLint first, GLsizei count, GLsizei instancecount, GLuint baseinstance);
+    void glVertexAttribDivisor(GLuint index, GLuint divisor);
     void glEnableVertexAttribArray(GLuint index);
     void glDisableVertexAttribArray(GLuint index);
     void glBindAttribLocation(GLuint program, GLuint index, const GLchar *name);
@@ -212,7 +308,8 @@ struct vec3 {
     }
 };
 
-struct vec4 {
+// Aligned to 16 bytes so the SIMD math in gl4.cpp can load it in one go
+struct alignas(16) vec4 {
     union {
         struct { float x, y, z, w; };
         struct { float s, t, p, q; };
@@ -263,7 +360,7 @@ struct vec4 {
     bool operator != (const vec4 &vec) const { return x != vec.x || y != vec.y || z != vec.z || w != vec.w; }
 
     friend float length(const vec4 &v) { return sqrtf(v.x * v.x + v.y * v.y + v.z * v.z + v.w * v.w); }
-    friend float dot(const vec4 &a, const vec4 &b) { return a.x * b.x + a.y * b.y + a.z * b.z + a.w * a.w; }
+    friend float dot(const vec4 &a, const vec4 &b) { return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w; }
     friend float max(const vec4 &v) { return fmaxf(fmaxf(v.x, v.y), fmaxf(v.z, v.w)); }
     friend float min(const vec4 &v) { return fminf(fminf(v.x, v.y), fminf(v.z, v.w)); }
     friend vec4 max(const vec4 &a, const vec4 &b) { return vec4(fmaxf(a.x, b.x), fmaxf(a.y, b.y), fmaxf(a.z, b.z), fmaxf(a.w, b.w)); }
@@ -279,7 +376,10 @@ struct vec4 {
     }
 };
 
-struct mat4 {
+// A row-major 4x4 matrix. Multiplication and inversion use four-float SIMD
+// vectors (SSE on x86 and NEON on ARM) and give the same results, bit for
+// bit, as the equivalent scalar expressions.
+struct alignas(16) mat4 {
     union {
         struct {
             float m00, m01, m02, m03;
@@ -326,28 +426,260 @@ struct mat4 {
     mat4 &invert();
 
     mat4 &operator *= (const mat4 &t);
-    vec4 operator * (const vec4 &v);
+    mat4 operator * (const mat4 &t) const { return mat4(*this) *= t; }
+    vec4 operator * (const vec4 &v) const;
     friend vec4 operator * (const vec4 &v, const mat4 &t);
     friend std::ostream &operator << (std::ostream &out, const mat4 &t);
 };
 
+// Batch versions of the mat4 math for CPU work on many points or matrices at
+// once (culling, skinning), which only set up the matrix once:
+//
+//     transformPoints(t, in, out, n);   // out[i] = t * vec4(in[i], 1)
+//     transformVectors(t, in, out, n);  // out[i] = t * in[i]
+//     multiplyMatrices(a, b, out, n);   // out[i] = a[i] * b[i]
+//
+// The input and output arrays may be the same for multiplyMatrices().
+void transformPoints(const mat4 &t, const vec3 *in, vec4 *out, size_t n);
+void transformVectors(const mat4 &t, const vec4 *in, vec4 *out, size_t n);
+void multiplyMatrices(const mat4 *a, const mat4 *b, mat4 *out, size_t n);
+
+// Shadows the OpenGL bindings that the wrappers below change (current program,
+// vertex array, framebuffer, viewport, buffers, and the textures bound to each
+// texture unit) so calls that wouldn't change anything can be skipped. All
+// wrappers go through the global glState, so call glState.invalidate() after
+// changing any of these bindings with raw OpenGL calls.
+//
+// Setting glState.skipUnbinds makes unbind() and unuse() do nothing, leaving
+// objects bound until something else is bound in their place. FBO::unbind()
+// still switches back to the screen since that changes where draws go.
+//
+// The issued and elided counters count the calls that were made and skipped:
+//
+//     glState.resetCounters();
+//     draw();
+//     printf("%u issued, %u elided\n", glState.issued, glState.elided);
+//
+struct State {
+    enum { MaxTextureUnits = 32, MaxBufferTargets = 8 };
+
+    bool enabled;
+    bool skipUnbinds;
+    unsigned int issued, elided;
+
+    // Shadow copy of the bindings, only valid for the current context
+    unsigned int program, vertexArray, framebuffer;
+    int activeUnit;
+    unsigned int textures2D[MaxTextureUnits], textures3D[MaxTextureUnits];
+    int bufferTargets[MaxBufferTargets];
+    unsigned int buffers[MaxBufferTargets];
+    int viewport[4];
+    bool viewportKnown;
+
+    State() : enabled(true), skipUnbinds(), issued(), elided() { invalidate(); }
+
+    void useProgram(unsigned int id);
+    void bindVertexArray(unsigned int id);
+    void bindFramebuffer(unsigned int id);
+    void bindTexture(int unit, int target, unsigned int id);
+    void bindBuffer(int target, unsigned int id);
+    void bindBufferBase(int target, int index, unsigned int id);
+    void setViewport(int x, int y, int width, int height);
+    void getViewport(int *viewport);
+
+    // Forget a deleted object so a new object that reuses its name will still
+    // be bound
+    void forgetProgram(unsigned int id);
+    void forgetVertexArray(unsigned int id);
+    void forgetFramebuffer(unsigned int id);
+    void forgetTexture(unsigned int id);
+    void forgetBuffer(unsigned int id);
+
+    // Reset the shadow copy to the default OpenGL state. Call this after
+    // creating a context or after changing bindings directly.
+    void invalidate();
+    void resetCounters() { issued = elided = 0; }
+};
+
+extern State glState;
+
+// Measures CPU and GPU time for named scopes. The GPU side uses pairs of
+// GL_TIMESTAMP queries (GL_TIME_ELAPSED queries can't be nested) taken from a
+// pool per frame. Two pools alternate so a frame's results are read while the
+// next frame is recorded and are normally available without waiting.
+//
+// Usage:
+//
+//     glProfiler.enabled = true;
+//
+//     void frame() {
+//         glProfiler.beginFrame();
+//         {
+//             GL4_PROFILE("ssao");
+//             // draw stuff
+//         }
+//         glProfiler.endFrame();
+//     }
+//
+//     glProfiler.flush();
+//     glProfiler.report(); // hierarchy of the last finished frame
+//     glProfiler.writeTrace("trace.json"); // for chrome://tracing
+//
+// Setting autoScopes adds a scope around each VAO draw call and each FBO
+// bind() / unbind() pair.
+struct Profiler {
+    enum { Frames = 2 };
+
+    struct Scope {
+        const char *name;
+        int depth;
+        double cpuBegin, cpuEnd;
+        double gpuBegin, gpuEnd;
+    };
+
+    struct Frame {
+        int number;
+        std::vector<Scope> scopes;
+        std::vector<unsigned int> queries;
+        int lastQuery;
+        bool resolved;
+
+        // Timestamps finish in the order they were issued, so the frame's
+        // results are ready once lastQuery is (an outer scope ends last)
+        Frame() : number(-1), lastQuery(-1), resolved(true) {}
+    };
+
+    bool enabled;
+    bool autoScopes;
+    bool tracing;
+    bool inFrame;
+    int frameNumber;
+    Frame frames[Frames];
+    std::vector<int> stack;
+    std::vector<Scope> lastFrame;
+    std::vector<Scope> trace;
+    double cpuOrigin, gpuOrigin;
+
+    Profiler() : enabled(), autoScopes(), tracing(), inFrame(), frameNumber(), cpuOrigin(-1), gpuOrigin() {}
+    ~Profiler();
+
+    // Scopes are only recorded between beginFrame() and endFrame(), and
+    // begin() calls outside of a frame are ignored
+    void beginFrame();
+    void endFrame();
+
+    // Wait for the results of the frames that haven't been read yet
+    void flush();
+
+    void begin(const char *name);
+    void end();
+
+    // Print the scopes of the last finished frame with CPU and GPU times
+    void report() const;
+
+    // Write every finished scope since tracing was enabled in the Chrome trace
+    // event format, with CPU and GPU times on separate tracks
+    void writeTrace(const char *path) const;
+
+    Frame &current() { return frames[frameNumber % Frames]; }
+    void resolve(Frame &frame, bool wait);
+};
+
+extern Profiler glProfiler;
+
+// Starts a scope that ends at the end of the enclosing C++ block. A NULL name
+// is ignored, which is how the optional auto-scopes are switched off.
+struct ProfileScope {
+    bool active;
+
+    ProfileScope(const char *name) : active(name && glProfiler.enabled) { if (active) glProfiler.begin(name); }
+    ~ProfileScope() { if (active) glProfiler.end(); }
+};
+
+#define GL4_PROFILE_JOIN2(a, b) a##b
+#define GL4_PROFILE_JOIN(a, b) GL4_PROFILE_JOIN2(a, b)
+#define GL4_PROFILE(name) ProfileScope GL4_PROFILE_JOIN(profileScope, __LINE__)(name)
+
+// The result of an asynchronous readback started with Texture::readbackAsync().
+// The copy into a pixel buffer object happens on the GPU and a fence tracks
+// when it is done, so polling ready() never stalls the pipeline. The buffer
+// object is reused by later readbacks of the same size.
+//
+// Usage:
+//
+//     Readback readback;
+//
+//     texture.readbackAsync(readback, GL_RGBA, GL_FLOAT);
+//     // a few frames later
+//     if (readback.ready()) readback.read(data);
+//
+struct Readback {
+    unsigned int id;
+    unsigned int bytes;
+    GLsync fence;
+    bool done;
+
+    Readback() : id(), bytes(), fence(), done() {}
+    ~Readback() { glDeleteSync(fence); glState.forgetBuffer(id); glDeleteBuffers(1, &id); }
+
+    // True if a readback was started and hasn't been read yet
+    bool pending() const { return fence || done; }
+
+    // True once the data has arrived, without waiting for it
+    bool ready();
+
+    // Copy the data into memory, waiting for it to arrive if needed
+    void read(void *data);
+    template <typename T>
+    void read(std::vector<T> &data) { data.resize(bytes / sizeof(T)); read(data.data()); }
+};
+
 // Supports both 2D and 3D textures (2D textures are just textures with a depth
 // of 1). When rendering back and forth between two textures (ping-ponging), it
 // is easiest to just call swapWith() after rendering.
 struct Texture {
     unsigned int id;
     int target, width, height, depth;
+    int internalFormat, format, type;
+    bool immutable;
+    unsigned int uploadBuffer;
+
+    Texture() : id(), target(), width(), height(), depth(), internalFormat(), format(), type(), immutable(), uploadBuffer() {}
+    ~Texture();
 
-    Texture() : id(), target(), width(), height(), depth() {}
-    ~Texture() { glDeleteTextures(1, &id); }
+    void bind(int unit = 0) const { glState.bindTexture(unit, target, id); }
+    void unbind(int unit = 0) const { if (!glState.skipUnbinds) glState.bindTexture(unit, target, 0); }
 
-    void bind(int unit = 0) const { glActiveTexture(GL_TEXTURE0 + unit); glBindTexture(target, id); }
-    void unbind(int unit = 0) const { glActiveTexture(GL_TEXTURE0 + unit); glBindTexture(target, 0); }
+    // Bind to an image unit for imageLoad() and imageStore() in shaders. The
+    // access is GL_READ_ONLY, GL_WRITE_ONLY, or GL_READ_WRITE. All layers of
+    // a 3D texture are bound.
+    void bindImage(int unit, int access) const { glBindImageTexture(unit, id, 0, target == GL_TEXTURE_3D, 0, access, internalFormat); }
 
     // Create a new texture. GL_TEXTURE_2D is used if depth == 1, otherwise
     // GL_TEXTURE_3D is used.
     Texture &create(int width, int height, int depth, int internalFormat, int format, int type, int filter, int wrap, void *data = NULL);
 
+    // Like create() but uses immutable storage. Calling this again with the
+    // same size and internal format keeps the existing storage and only
+    // uploads data (if any), so it's cheap to call every time the contents
+    // are reset. Unsized internal formats like GL_RGBA are mapped to their
+    // 8-bit sized equivalents.
+    Texture &allocate(int width, int height, int depth, int internalFormat, int format, int type, int filter, int wrap, const void *data = NULL);
+
+    // Replace a region of the texture. The data uses the format and type
+    // passed to create() or allocate(). For 2D textures z must be 0 and d must
+    // be 1.
+    Texture &update(int x, int y, int z, int w, int h, int d, const void *data);
+
+    // Start copying the whole texture into readback without waiting for it.
+    // The format and type are the ones glGetTexImage() takes.
+    Readback &readbackAsync(Readback &readback, int format, int type) const;
+
+    // Replace the contents of the whole texture (which must already exist)
+    // with data. The data is staged in a pixel buffer object so the driver can
+    // transfer it to the texture in the background.
+    Texture &uploadAsync(int format, int type, const void *data);
+
     // Swap the members of this texture with the members of other.
     void swapWith(Texture &other);
 };
@@ -363,18 +695,71 @@ struct Texture {
 //     // draw stuff
 //     fbo.unbind();
 //
+// Attaching only records the requested attachments. Each distinct set of
+// attachments gets its own OpenGL framebuffer object that is configured and
+// validated the first time it's used and reused after that, so calling
+// attachColor() and check() every frame (even when ping-ponging between
+// textures) costs nothing but a bind. Deleting a texture drops the
+// framebuffers that draw to it, since OpenGL reuses texture names.
+//
+// A whole 3D texture can be attached with attachLayered() to draw to all of
+// its slices in one pass. Each primitive goes to the slice a geometry shader
+// writes to gl_Layer, i.e. one instance per slice:
+//
+//     fbo.attachLayered(texture3D).check().bind();
+//     quadLayout.drawInstanced(texture3D.depth, GL_TRIANGLE_STRIP);
+//     fbo.unbind();
+//
 struct FBO {
+    enum { MaxFramebuffers = 32 };
+
+    // A layer of -1 means all layers
+    struct Attachment {
+        unsigned int texture;
+        int target, layer, width, height, depth;
+
+        Attachment() : texture(), target(), layer(), width(), height(), depth() {}
+        bool operator == (const Attachment &a) const {
+            return texture == a.texture && target == a.target && layer == a.layer &&
+                width == a.width && height == a.height && depth == a.depth;
+        }
+        bool operator != (const Attachment &a) const { return !(*this == a); }
+    };
+
+    // A configured framebuffer object with its own depth renderbuffer
+    struct Framebuffer {
+        unsigned int id;
+        unsigned int renderbuffer;
+        int renderbufferWidth, renderbufferHeight;
+        std::vector<Attachment> attachments;
+        bool checked;
+        unsigned int lastUsed;
+
+        Framebuffer() : id(), renderbuffer(), renderbufferWidth(), renderbufferHeight(), checked(), lastUsed() {}
+    };
+
     unsigned int id;
-    unsigned int renderbuffer;
     bool autoDepth;
     bool resizeViewport;
     int newViewport[4], oldViewport[4];
-    int renderbufferWidth, renderbufferHeight;
-    std::vector<unsigned int> drawBuffers;
+    std::vector<Attachment> attachments;
+    std::vector<Framebuffer> framebuffers;
+    int current;
+    unsigned int useCount;
+    bool profiling;
+
+    // The framebuffer that unbind() returns to. This is 0 (the window) unless
+    // a HeadlessContext has replaced it with its own offscreen framebuffer.
+    static unsigned int screen;
+
+    FBO(bool autoDepth = true, bool resizeViewport = true);
+    ~FBO();
 
-    FBO(bool autoDepth = true, bool resizeViewport = true) : id(), renderbuffer(), autoDepth(autoDepth),
-        resizeViewport(resizeViewport), newViewport(), oldViewport(), renderbufferWidth(), renderbufferHeight() {}
-    ~FBO() { glDeleteFramebuffers(1, &id); glDeleteRenderbuffers(1, &renderbuffer); }
+    // Drop the framebuffers of every FBO that draw to this texture name. This
+    // is called whenever a texture name is deleted, since a new texture that
+    // gets the same name would otherwise match a framebuffer that still draws
+    // to the old one.
+    static void forgetTexture(unsigned int texture);
 
     // Draw calls between these will be drawn to attachments. If resizeViewport
     // is true this will automatically resize the viewport to the size of the
@@ -386,16 +771,72 @@ struct FBO {
     // a 3D texture).
     FBO &attachColor(const Texture &texture, unsigned int attachment = 0, unsigned int layer = 0);
 
+    // Draw to every layer of a 3D texture in the indicated attachment
+    // location, picked by gl_Layer. Layered attachments don't get a depth
+    // buffer even if autoDepth is set, since a renderbuffer only has one layer.
+    FBO &attachLayered(const Texture &texture, unsigned int attachment = 0);
+
     // Stop drawing to the indicated color attachment
     FBO &detachColor(unsigned int attachment = 0);
 
-    // Call after all attachColor() calls, validates attachments.
+    // Call after all attachColor() calls, validates attachments. This only
+    // does work the first time a set of attachments is seen.
     FBO &check();
+
+    // Select (or create) the framebuffer object for the current attachments
+    void resolve();
+
+    // Record an attachment for attachColor() and attachLayered()
+    FBO &attach(const Texture &texture, unsigned int attachment, int layer);
+};
+
+// A small open-addressing hash table from variable names to locations. Shader
+// uses one for uniforms and one for attributes so that setting a uniform by
+// name doesn't need to ask the driver every time.
+struct LocationCache {
+    struct Entry {
+        unsigned int hash;
+        int location;
+        std::string name;
+
+        Entry() : hash(), location(-1) {}
+    };
+
+    std::vector<Entry> entries;
+    unsigned int count;
+
+    LocationCache() : count() {}
+
+    void clear() { entries.clear(); count = 0; }
+
+    // Returns the entry for name or NULL if it isn't cached
+    const Entry *find(const char *name) const;
+
+    // Add or replace the cached location for name
+    void insert(const char *name, int location);
 };
 
 // Use this macro to pass raw GLSL to Shader::shader()
 #define glsl(x) "#version 400\n" #x
 
+// Like glsl() but for compute shaders and shader storage blocks, which need
+// GLSL 4.30
+#define glsl430(x) "#version 430\n" #x
+
+// Like glsl() but without the #version line, for code that is pasted into
+// several shaders
+#define glslSource(x) #x
+
+// True if the current context is at least the given OpenGL version
+bool hasVersion(int major, int minor);
+
+// True if the current context supports the named extension
+bool hasExtension(const char *name);
+
+// Make writes from shaders (i.e. to shader storage buffers) visible to the
+// kinds of reads given by barriers, like GL_SHADER_STORAGE_BARRIER_BIT
+inline void memoryBarrier(unsigned int barriers) { glMemoryBarrier(barriers); }
+
 // Wraps a GLSL shader program and all attached shader stages. Meant to be used
 // with the glsl() macro.
 //
@@ -420,11 +861,48 @@ struct FBO {
 //     // Draw stuff
 //     shader.unuse();
 //
+// Uniform and attribute locations are cached when the program is linked, so
+// setting uniforms by name is just a hash lookup. A Uniform handle from
+// uniformHandle() skips even that for uniforms set every frame.
+//
+// Stages are compiled by link(), not when they are added. If cacheDirectory
+// is set (and OpenGL 4.1 is available), link() first looks there for a
+// program binary saved by an earlier run with the same stage sources and the
+// same driver, and only compiles if there isn't one or the driver rejects it:
+//
+//     Shader::cacheDirectory = "shadercache";
+//
+// link() waits for the driver to finish before returning. Programs that are
+// all needed at startup can instead each be started with linkAsync(), which
+// lets the driver compile them at the same time when it supports
+// GL_KHR_parallel_shader_compile. Errors are then checked the first time a
+// program is used, and isReady() says whether that would still wait:
+//
+//     terrain.vertexShader(...).linkAsync();
+//     sky.vertexShader(...).linkAsync();
+//
+//     // Rendering
+//     if (!terrain.isReady()) return; // Show a loading frame instead
+//     terrain.use();
 struct Shader {
+    // A pre-resolved uniform location
+    struct Uniform {
+        int location;
+
+        explicit Uniform(int location = -1) : location(location) {}
+    };
+
     unsigned int id;
     std::vector<unsigned int> stages;
+    std::vector<std::pair<int, std::string> > sources;
+    std::string binaryFile; // Where finish() saves the linked program binary
+    mutable bool linking;
+    mutable LocationCache uniforms, attributes;
 
-    Shader() : id() {}
+    // Where link() saves and loads program binaries, or NULL to always compile
+    static const char *cacheDirectory;
+
+    Shader() : id(), linking() {}
     ~Shader();
 
     Shader &shader(int type, const char *source);
@@ -433,13 +911,47 @@ struct Shader {
     Shader &geometryShader(const char *source) { return shader(GL_GEOMETRY_SHADER, source); }
     Shader &tessControlShader(const char *source) { return shader(GL_TESS_CONTROL_SHADER, source); }
     Shader &tessEvalShader(const char *source) { return shader(GL_TESS_EVALUATION_SHADER, source); }
+    Shader &computeShader(const char *source) { return shader(GL_COMPUTE_SHADER, source); }
 
+    // Compile and link the program, stopping with an error if either fails
     void link();
-    void use() const { glUseProgram(id); }
-    void unuse() const { glUseProgram(0); }
 
-    unsigned int attribute(const char *name) const { return glGetAttribLocation(id, name); }
-    unsigned int uniform(const char *name) const { return glGetUniformLocation(id, name); }
+    // Like link() but returns without waiting for the driver. The program is
+    // finished by the first use() or location lookup.
+    void linkAsync();
+
+    // True unless a program from linkAsync() is still compiling. Drivers
+    // without GL_KHR_parallel_shader_compile always say it is ready.
+    bool isReady() const;
+
+    // Wait for linkAsync() and check the results
+    void finish() const;
+
+    void use() const { if (linking) finish(); glState.useProgram(id); }
+    void unuse() const { if (!glState.skipUnbinds) glState.useProgram(0); }
+
+    // Run a program with a compute shader on a grid of work groups. The
+    // program must be in use. Call memoryBarrier() before reading the results.
+    void dispatch(int x, int y = 1, int z = 1) const { glDispatchCompute(x, y, z); }
+
+    // Like dispatch() but reads the three work group counts from a buffer at
+    // offset bytes, i.e. ones written by another compute shader. Call
+    // memoryBarrier(GL_COMMAND_BARRIER_BIT) after writing them.
+    void dispatchIndirect(unsigned int buffer, int offset = 0) const {
+        glState.bindBuffer(GL_DISPATCH_INDIRECT_BUFFER, buffer);
+        glDispatchComputeIndirect(offset);
+    }
+
+    // Look up locations in the cache filled by link(). Names that aren't
+    // active (i.e. elements of a uniform array) are only asked of the driver
+    // the first time.
+    unsigned int attribute(const char *name) const;
+    unsigned int uniform(const char *name) const;
+    Uniform uniformHandle(const char *name) const { return Uniform(uniform(name)); }
+
+    // Read the uniform block called name from binding point index, stopping
+    // with an error if the block doesn't take up size bytes
+    void uniformBlock(const char *name, int index, int size) const;
 
     void uniformInt(const char *name, int i) const { glUniform1i(uniform(name), i); }
     void uniformFloat(const char *name, float f) const { glUniform1f(uniform(name), f); }
@@ -447,6 +959,13 @@ struct Shader {
     void uniform(const char *name, const vec3 &v) const { glUniform3fv(uniform(name), 1, v.xyz); }
     void uniform(const char *name, const vec4 &v) const { glUniform4fv(uniform(name), 1, v.xyzw); }
     void uniform(const char *name, const mat4 &m) const { glUniformMatrix4fv(uniform(name), 1, true, m.m); }
+
+    void uniformInt(Uniform u, int i) const { glUniform1i(u.location, i); }
+    void uniformFloat(Uniform u, float f) const { glUniform1f(u.location, f); }
+    void uniform(Uniform u, const vec2 &v) const { glUniform2fv(u.location, 1, v.xy); }
+    void uniform(Uniform u, const vec3 &v) const { glUniform3fv(u.location, 1, v.xyz); }
+    void uniform(Uniform u, const vec4 &v) const { glUniform4fv(u.location, 1, v.xyzw); }
+    void uniform(Uniform u, const mat4 &m) const { glUniformMatrix4fv(u.location, 1, true, m.m); }
 };
 
 // A vertex buffer containing a certain type. For example, the simplest vertex
@@ -467,30 +986,272 @@ struct Shader {
 //     indices << 0 << 1 << 2;
 //     indices.upload(GL_ELEMENT_ARRAY_BUFFER);
 //
+// Elements added with << or written with [] are tracked, and upload() only
+// sends that dirty range (plus any elements added since the last upload)
+// once storage has been allocated. Storage grows with some headroom and is
+// kept when the data shrinks, so it is only reallocated when the data
+// outgrows it. If you change data directly, call markDirty() or
+// uploadRange() yourself, and use clear() to start over instead of
+// data.clear(). If the size changed and nothing was marked, upload() assumes
+// data was changed directly and sends all of it. Set orphan to true for
+// buffers that are completely rewritten every time, which lets the driver hand out fresh storage instead
+// of waiting for draws that still use the old contents.
 template <typename T>
 struct Buffer {
     std::vector<T> data;
     unsigned int id;
     int currentTarget;
+    int usage;
+    unsigned int capacity;
+    unsigned int uploadedSize;
+    unsigned int dirtyBegin, dirtyEnd;
+    bool orphan;
 
-    Buffer() : id(), currentTarget() {}
+    Buffer() : id(), currentTarget(), usage(), capacity(), uploadedSize(), dirtyBegin(), dirtyEnd(), orphan() {}
     ~Buffer() {
+        glState.forgetBuffer(id);
         glDeleteBuffers(1, &id);
     }
 
-    void bind() const { glBindBuffer(currentTarget, id); }
-    void unbind() const { glBindBuffer(currentTarget, 0); }
+    void bind() const { glState.bindBuffer(currentTarget, id); }
+    void unbind() const { if (!glState.skipUnbinds) glState.bindBuffer(currentTarget, 0); }
+
+    // Bind to an indexed binding point, i.e. a shader storage block declared
+    // with layout(binding = index). Upload with GL_SHADER_STORAGE_BUFFER first.
+    void bindBase(int index) const { glState.bindBufferBase(currentTarget, index, id); }
 
     void upload(int target = GL_ARRAY_BUFFER, int usage = GL_STATIC_DRAW) {
         if (!id) glGenBuffers(1, &id);
         currentTarget = target;
+
+        // The index buffer binding is part of the bound VAO, so make sure not to
+        // change it for whatever VAO was left bound
+        if (target == GL_ELEMENT_ARRAY_BUFFER) glState.bindVertexArray(0);
+        bind();
+        if (!capacity || data.size() > capacity || usage != this->usage) {
+            // Leave room to grow unless this is the first upload
+            unsigned int grown = capacity ? capacity + capacity / 2 : 0;
+            capacity = std::max((unsigned int)data.size(), grown);
+            this->usage = usage;
+            glBufferData(currentTarget, capacity * sizeof(T), NULL, usage);
+            glBufferSubData(currentTarget, 0, data.size() * sizeof(T), data.data());
+        } else if (orphan) {
+            glBufferData(currentTarget, capacity * sizeof(T), NULL, usage);
+            glBufferSubData(currentTarget, 0, data.size() * sizeof(T), data.data());
+        } else if (data.size() != uploadedSize && dirtyBegin >= dirtyEnd) {
+            glBufferSubData(currentTarget, 0, data.size() * sizeof(T), data.data());
+        } else {
+            // Elements added since the last upload are sent even if they
+            // weren't marked, and elements past the end may have been marked
+            // before the data shrank
+            unsigned int begin = dirtyBegin, end = std::min(dirtyEnd, (unsigned int)data.size());
+            if (data.size() > uploadedSize) {
+                begin = std::min(begin, uploadedSize);
+                end = data.size();
+            }
+            if (begin < end) glBufferSubData(currentTarget, begin * sizeof(T), (end - begin) * sizeof(T), data.data() + begin);
+        }
+        uploadedSize = data.size();
+        dirtyBegin = dirtyEnd = 0;
+        unbind();
+    }
+
+    // Upload just count elements starting at first, stopping at the end of
+    // data. Falls back to upload() if storage hasn't been allocated or is too
+    // small, or if the number of elements changed since the last upload.
+    void uploadRange(unsigned int first, unsigned int count) {
+        if (first >= data.size()) return;
+        count = std::min(count, (unsigned int)data.size() - first);
+        if (first + count > capacity || data.size() != uploadedSize) {
+            markDirty(first, count);
+            upload(currentTarget ? currentTarget : GL_ARRAY_BUFFER, usage ? usage : GL_STATIC_DRAW);
+            return;
+        }
+        if (currentTarget == GL_ELEMENT_ARRAY_BUFFER) glState.bindVertexArray(0);
         bind();
-        glBufferData(currentTarget, data.size() * sizeof(T), data.data(), usage);
+        glBufferSubData(currentTarget, first * sizeof(T), count * sizeof(T), data.data() + first);
         unbind();
     }
 
+    // Include elements first to first + count in the next upload()
+    void markDirty(unsigned int first, unsigned int count) {
+        if (!count) return;
+        if (dirtyBegin >= dirtyEnd) {
+            dirtyBegin = first;
+            dirtyEnd = first + count;
+        } else {
+            dirtyBegin = std::min(dirtyBegin, first);
+            dirtyEnd = std::max(dirtyEnd, first + count);
+        }
+    }
+
+    // Remove every element, keeping the storage for the next upload()
+    void clear() {
+        data.clear();
+        dirtyBegin = dirtyEnd = 0;
+    }
+
     unsigned int size() const { return data.size(); }
-    Buffer<T> &operator << (const T &t) { data.push_back(t); return *this; }
+    Buffer<T> &operator << (const T &t) { markDirty(data.size(), 1); data.push_back(t); return *this; }
+    T &operator [] (unsigned int i) { markDirty(i, 1); return data[i]; }
+    const T &operator [] (unsigned int i) const { return data[i]; }
+};
+
+// A vertex buffer for data that is rewritten every frame (particles, instance
+// transforms). Storage for Regions copies of the data is allocated once with
+// glBufferStorage and stays mapped, so callers write straight into memory the
+// GPU draws from. Each frame writes the next region and a fence placed after
+// the previous region's draws keeps the CPU from overwriting a region the GPU
+// may still be reading. With three regions that wait almost never blocks.
+//
+// Usage:
+//
+//     // Initialization
+//     StreamBuffer<vec3> particles;
+//     particles.create(maxParticles);
+//     vao.create(shader, particles).attribute<float>("vertex", 3).check();
+//
+//     // Every frame
+//     vec3 *data = particles.begin();
+//     for (int i = 0; i < count; i++) data[i] = positions[i];
+//     particles.end(count);
+//     vao.draw(GL_POINTS);
+//
+// For per-instance data, declare the attributes with instanceAttribute() and
+// draw with drawPerInstance(), which starts at the right region.
+//
+template <typename T>
+struct StreamBuffer {
+    enum { Regions = 3 };
+
+    unsigned int id;
+    int currentTarget;
+    unsigned int capacity, count, region;
+    T *memory;
+    GLsync fences[Regions];
+
+    StreamBuffer() : id(), currentTarget(), capacity(), count(), region(), memory(), fences() {}
+    ~StreamBuffer() {
+        for (int i = 0; i < Regions; i++) glDeleteSync(fences[i]);
+        glState.forgetBuffer(id);
+        glDeleteBuffers(1, &id);
+    }
+
+    void bind() const { glState.bindBuffer(currentTarget, id); }
+    void unbind() const { if (!glState.skipUnbinds) glState.bindBuffer(currentTarget, 0); }
+
+    // Allocate and map storage for up to capacity elements per frame
+    void create(unsigned int capacity, int target = GL_ARRAY_BUFFER) {
+        const int flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        this->capacity = capacity;
+        currentTarget = target;
+        count = region = 0;
+        if (id) {
+            glState.forgetBuffer(id);
+            glDeleteBuffers(1, &id);
+        }
+        glGenBuffers(1, &id);
+        bind();
+        glBufferStorage(currentTarget, Regions * capacity * sizeof(T), NULL, flags);
+        memory = (T *)glMapBufferRange(currentTarget, 0, Regions * capacity * sizeof(T), flags);
+        unbind();
+    }
+
+    // Move on to the next region and return where to write its elements. This
+    // only blocks if the GPU hasn't finished drawing from that region yet.
+    T *begin() {
+        glDeleteSync(fences[region]);
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        region = (region + 1) % Regions;
+        if (fences[region]) {
+            while (glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(fences[region]);
+            fences[region] = 0;
+        }
+        count = 0;
+        return memory + first();
+    }
+
+    // Call after writing count elements to the pointer returned by begin(),
+    // which must be at most the capacity passed to create()
+    void end(unsigned int count) {
+        if (count > capacity) {
+            printf("StreamBuffer::end() got %u elements but the capacity is %u\n", count, capacity);
+            exit(0);
+        }
+        this->count = count;
+    }
+
+    // The range of elements to draw from
+    unsigned int first() const { return region * capacity; }
+    unsigned int size() const { return count; }
+};
+
+// Check at compile time that a member of a struct for a UniformBlock is where
+// std140 layout puts it. Scalars are aligned to 4 bytes, vec2 to 8, and vec3,
+// vec4, and mat4 to 16, so a vec3 must be followed by a float or padding.
+#define std140Offset(type, member, offset) \
+    static_assert(offsetof(type, member) == offset, #type "::" #member " must be at byte " #offset " for std140")
+
+// A uniform buffer holding one T, for constants that several programs share
+// (i.e. the camera). The data is uploaded once and read by every program
+// attached to the same binding point, instead of being set in each program.
+// T must match a block declared with layout(std140, row_major), since mat4 is
+// stored by rows. Check the layout with std140Offset() next to the struct.
+//
+// Usage:
+//
+//     // Initialization
+//     struct Camera {
+//         mat4 matrix;
+//         vec3 eye;
+//         float padding;
+//     };
+//     std140Offset(Camera, eye, 64);
+//
+//     UniformBlock<Camera> camera;
+//     shader.vertexShader(glsl(
+//         layout(std140, row_major) uniform Camera {
+//             mat4 matrix;
+//             vec3 eye;
+//         };
+//         ...
+//     )).link();
+//     camera.attach(shader, "Camera");
+//
+//     // Every frame
+//     camera.data.matrix = ...;
+//     camera.upload();
+//
+template <typename T>
+struct UniformBlock {
+    static_assert(sizeof(T) % 16 == 0, "std140 blocks are a whole number of vec4s, so pad the end of the struct");
+
+    T data;
+    unsigned int id;
+    int binding;
+
+    UniformBlock(int binding = 0) : data(), id(), binding(binding) {}
+    ~UniformBlock() {
+        glState.forgetBuffer(id);
+        glDeleteBuffers(1, &id);
+    }
+
+    // Make the block called name in shader read from this buffer
+    void attach(const Shader &shader, const char *name) const { shader.uniformBlock(name, binding, sizeof(T)); }
+
+    // Send data and bind it for every attached program
+    void upload() {
+        if (!id) {
+            glGenBuffers(1, &id);
+            glState.bindBuffer(GL_UNIFORM_BUFFER, id);
+            glBufferData(GL_UNIFORM_BUFFER, sizeof(T), &data, GL_DYNAMIC_DRAW);
+        } else {
+            glState.bindBuffer(GL_UNIFORM_BUFFER, id);
+            glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(T), &data);
+        }
+        glState.bindBufferBase(GL_UNIFORM_BUFFER, binding, id);
+    }
 };
 
 // Convert a C++ type to an OpenGL type enum using TypeToOpenGL<T>::value
@@ -524,6 +1285,7 @@ struct VAO {
     struct BufferHolder {
         virtual int currentTarget() const = 0;
         virtual unsigned int size() const = 0;
+        virtual unsigned int first() const { return 0; }
     };
     template <typename T>
     struct BufferHolderImpl : BufferHolder {
@@ -532,6 +1294,14 @@ struct VAO {
         int currentTarget() const { return buffer.currentTarget; }
         unsigned int size() const { return buffer.size(); }
     };
+    template <typename T>
+    struct StreamBufferHolderImpl : BufferHolder {
+        const StreamBuffer<T> &buffer;
+        StreamBufferHolderImpl(const StreamBuffer<T> &buffer) : buffer(buffer) {}
+        int currentTarget() const { return buffer.currentTarget; }
+        unsigned int size() const { return buffer.size(); }
+        unsigned int first() const { return buffer.first(); }
+    };
 
     // You should not need to access these
     unsigned int id;
@@ -541,11 +1311,11 @@ struct VAO {
     const BufferHolder *indices;
 
     VAO() : id(), stride(), offset(), indexType(), shader(), vertices(), indices() {}
-    ~VAO() { glDeleteVertexArrays(1, &id); delete vertices; delete indices; }
+    ~VAO() { glState.forgetVertexArray(id); glDeleteVertexArrays(1, &id); delete vertices; delete indices; }
 
     // You should not need to bind a VAO directly
-    void bind() const { glBindVertexArray(id); }
-    void unbind() const { glBindVertexArray(0); }
+    void bind() const { glState.bindVertexArray(id); }
+    void unbind() const { if (!glState.skipUnbinds) glState.bindVertexArray(0); }
 
     // Create a vertex array object referencing a shader and a vertex buffer.
     // The shader is used to query the location of attributes in attribute()
@@ -570,6 +1340,27 @@ struct VAO {
         return *this;
     }
 
+    // Create a vertex array object referencing a shader and a stream buffer.
+    // Draws use the region of the stream buffer that was written last.
+    template <typename Vertex>
+    VAO &create(const Shader &shader, const StreamBuffer<Vertex> &vbo) {
+        delete vertices;
+        delete indices;
+
+        this->shader = &shader;
+        vertices = new StreamBufferHolderImpl<Vertex>(vbo);
+        indices = NULL;
+        stride = sizeof(Vertex);
+        indexType = GL_INVALID_ENUM;
+
+        if (!id) glGenVertexArrays(1, &id);
+        bind();
+        vbo.bind();
+        unbind();
+
+        return *this;
+    }
+
     // Create a vertex array object referencing a shader, a vertex buffer, and
     // an index buffer. The shader is used to query the location of attributes
     // in attribute() and the index buffer is used to determine the number of
@@ -612,24 +1403,151 @@ struct VAO {
         return *this;
     }
 
+    // Like attribute() but the attribute advances once per instance instead of
+    // once per vertex (i.e. a position or transform for each instance). Draw
+    // with drawPerInstance() so there is one instance per element of the
+    // vertex buffer.
+    template <typename T>
+    VAO &instanceAttribute(const char *name, int count, bool normalized = false) {
+        int location = shader->attribute(name);
+        attribute<T>(name, count, normalized);
+        bind();
+        glVertexAttribDivisor(location, 1);
+        unbind();
+        return *this;
+    }
+
     // Validate VBO modes and attribute byte sizes
     void check();
 
     // Draw the attached VBOs
     void draw(int mode = GL_TRIANGLES) const {
+        ProfileScope scope(glProfiler.autoScopes ? "draw" : NULL);
         bind();
         if (indices) glDrawElements(mode, indices->size(), indexType, NULL);
-        else glDrawArrays(mode, 0, vertices->size());
+        else glDrawArrays(mode, vertices->first(), vertices->size());
         unbind();
     }
 
-    // Draw the attached VBOs using instancing
+    // Draw the attached VBOs using instancing. The attributes still advance
+    // per vertex, so use instanceAttribute() and drawPerInstance() for data
+    // that changes per instance.
     void drawInstanced(int instances, int mode = GL_TRIANGLES) const {
+        ProfileScope scope(glProfiler.autoScopes ? "drawInstanced" : NULL);
         bind();
         if (indices) glDrawElementsInstanced(mode, indices->size(), indexType, NULL, instances);
-        else glDrawArraysInstanced(mode, 0, vertices->size(), instances);
+        else glDrawArraysInstanced(mode, vertices->first(), vertices->size(), instances);
         unbind();
     }
+
+    // Draw count vertices for each element of the vertex buffer, which the
+    // attributes from instanceAttribute() read one at a time. Instanced
+    // attributes don't start at the first vertex, so the elements a
+    // StreamBuffer wrote last are found using the base instance instead.
+    // The vertices themselves only have gl_VertexID to go on.
+    void drawPerInstance(int count, int mode = GL_TRIANGLES) const {
+        ProfileScope scope(glProfiler.autoScopes ? "drawPerInstance" : NULL);
+        bind();
+        glDrawArraysInstancedBaseInstance(mode, 0, count, vertices->size(), vertices->first());
+        unbind();
+    }
+
+    // Draw with the arguments read from a buffer at offset bytes instead of
+    // from the attached VBOs, i.e. ones written by a compute shader. The
+    // layout is { count, instanceCount, first, baseInstance } without an
+    // index buffer and { count, instanceCount, firstIndex, baseVertex,
+    // baseInstance } with one. Call memoryBarrier(GL_COMMAND_BARRIER_BIT)
+    // after writing them.
+    void drawIndirect(unsigned int buffer, int offset = 0, int mode = GL_TRIANGLES) const {
+        ProfileScope scope(glProfiler.autoScopes ? "drawIndirect" : NULL);
+        bind();
+        glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+        if (indices) glDrawElementsIndirect(mode, indexType, (char *)NULL + offset);
+        else glDrawArraysIndirect(mode, (char *)NULL + offset);
+        unbind();
+    }
+
+    // Like drawIndirect() but with count tightly packed commands in one call,
+    // i.e. one per chunk of a mesh that is rebuilt in pieces. A vertex shader
+    // that reads its vertices from a shader storage buffer using gl_VertexID
+    // can draw this without any attributes.
+    void multiDrawIndirect(unsigned int buffer, int count, int offset = 0, int mode = GL_TRIANGLES) const {
+        ProfileScope scope(glProfiler.autoScopes ? "multiDrawIndirect" : NULL);
+        bind();
+        glState.bindBuffer(GL_DRAW_INDIRECT_BUFFER, buffer);
+        if (indices) glMultiDrawElementsIndirect(mode, indexType, (char *)NULL + offset, count, 0);
+        else glMultiDrawArraysIndirect(mode, (char *)NULL + offset, count, 0);
+        unbind();
+    }
+};
+
+// Seconds on a monotonic clock, for timing things
+double currentTime();
+
+// Splits CPU work across a pool of worker threads that is started the first
+// time it's needed. The calling thread works too, so with one core this just
+// runs everything in order. Call setThreadCount() before the first use to
+// override the default of one thread per core.
+//
+// Usage:
+//
+//     parallelFor(0, count, 1024, [&](int begin, int end) {
+//         for (int i = begin; i < end; i++) results[i] = work(i);
+//     });
+//
+// The function is called with chunks of at most grain items and must be safe
+// to call from several threads at once. parallelFor() returns when every
+// chunk is done. Nested calls run on the calling thread.
+int threadCount();
+void setThreadCount(int count);
+void parallelRun(int tasks, void (*task)(void *context, int index), void *context);
+
+template <typename Function>
+void parallelFor(int begin, int end, int grain, const Function &function) {
+    struct Chunks {
+        int begin, end, grain;
+        const Function *function;
+
+        static void run(void *context, int index) {
+            Chunks *chunks = (Chunks *)context;
+            int first = chunks->begin + index * chunks->grain;
+            (*chunks->function)(first, std::min(first + chunks->grain, chunks->end));
+        }
+    };
+    if (end <= begin) return;
+    grain = std::max(grain, 1);
+    Chunks chunks = { begin, end, grain, &function };
+    parallelRun((end - begin + grain - 1) / grain, Chunks::run, &chunks);
+}
+
+// An OpenGL context that doesn't need a window or a display, for running the
+// same setup() and update() code on machines without one (i.e. Mesa's llvmpipe
+// on a render farm node). This uses EGL on the surfaceless platform when it is
+// available and draws to an offscreen framebuffer which FBO::unbind() returns
+// to instead of the window. There is no vsync or buffer swap to wait on.
+//
+// Usage:
+//
+//     HeadlessContext context;
+//     context.create(800, 600);
+//     setup();
+//     double seconds = context.run(update, 1000);
+//
+struct HeadlessContext {
+    void *display, *context;
+    unsigned int framebuffer, colorbuffer, depthbuffer;
+    int width, height;
+
+    HeadlessContext() : display(), context(), framebuffer(), colorbuffer(), depthbuffer(), width(), height() {}
+    ~HeadlessContext();
+
+    // Create an OpenGL context (compatibility profile) of at least the given
+    // version and make it current. Exits with an error message on failure.
+    void create(int width, int height, int major = 4, int minor = 0);
+
+    // Call update() the given number of times and return the elapsed time in
+    // seconds. This waits for the GPU to finish so all work is counted.
+    double run(void (*update)(), int steps);
 };
 
 #endif // GL4_H
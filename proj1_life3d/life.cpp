@@ -0,0 +1,216 @@
+#include "life.h"
+#include <string.h>
+
+const LifeRule cloudRule = { "clouds", 14, 19, 13, 26, 127 };
+const LifeRule repeatingRule = { "repeating", 5, 5, 5, 7, 13 };
+
+typedef Life::Word Word;
+
+// Four words of cells handled at once using GCC vector extensions, which
+// become one AVX2 register, two SSE registers, or four plain words depending
+// on the target. The reduced alignment lets them load from any row.
+typedef Word Lanes __attribute__((vector_size(32), aligned(8)));
+static const int LaneWords = 4;
+
+// Compile the step for each instruction set and pick one when the program
+// loads (needs the GNU ifunc support in glibc)
+#if defined(__x86_64__) && defined(__linux__)
+#define LIFE_TARGETS __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define LIFE_TARGETS
+#endif
+
+static inline __attribute__((always_inline)) void fullAdd(const Lanes &a, const Lanes &b, const Lanes &c, Lanes &sum, Lanes &carry) {
+    Lanes t = a ^ b;
+    sum = t ^ c;
+    carry = (a & b) | (t & c);
+}
+
+// Set result to all ones in the lanes where the 5-bit count in bits is at
+// least k. These return through a reference since returning a vector by
+// value from a function that isn't compiled for AVX changes the ABI.
+static inline __attribute__((always_inline)) void atLeast(const Lanes bits[5], int k, Lanes &result) {
+    Lanes zero = {}, greater = zero, equal = ~zero;
+    if (k <= 0 || k >= 32) {
+        result = k <= 0 ? equal : zero;
+        return;
+    }
+    for (int i = 4; i >= 0; i--) {
+        if (k >> i & 1) {
+            equal &= bits[i];
+        } else {
+            greater |= equal & bits[i];
+            equal &= ~bits[i];
+        }
+    }
+    result = greater | equal;
+}
+
+static inline __attribute__((always_inline)) void inRange(const Lanes bits[5], int low, int high, Lanes &result) {
+    Lanes above;
+    atLeast(bits, low, result);
+    atLeast(bits, high + 1, above);
+    result &= ~above;
+}
+
+// Sum each cell and its two neighbors along x into a 2-bit count, h0 + 2 * h1
+static void sumRow(const Word *row, int size, int words, Word *h0, Word *h1) {
+    Word first = row[0] & 1;
+    Word last = row[(size - 1) >> 6] >> ((size - 1) & 63) & 1;
+    for (int w = 0; w < words; w++) {
+        Word center = row[w];
+        Word left = center << 1 | (w > 0 ? row[w - 1] >> 63 : last);
+        Word right = center >> 1 | (w + 1 < words ? row[w + 1] << 63 : first << ((size - 1) & 63));
+        Word t = left ^ center;
+        h0[w] = t ^ right;
+        h1[w] = (left & center) | (t & right);
+    }
+}
+
+// Sum the row sums of a slice along y into a 4-bit count (at most 9) for
+// each cell. Each of h and v holds one slice per bit.
+LIFE_TARGETS
+static void sumSlice(const Word *slice, int size, int rowWords, Word *h, Word *v) {
+    int sliceWords = size * rowWords;
+    int words = (size + 63) >> 6;
+    for (int y = 0; y < size; y++) {
+        sumRow(slice + y * rowWords, size, words, h + y * rowWords, h + sliceWords + y * rowWords);
+    }
+
+    for (int y = 0; y < size; y++) {
+        int above = (y + size - 1) % size * rowWords, row = y * rowWords, below = (y + 1) % size * rowWords;
+        for (int w = 0; w < rowWords; w += LaneWords) {
+            const Lanes &a0 = *(const Lanes *)(h + above + w), &a1 = *(const Lanes *)(h + sliceWords + above + w);
+            const Lanes &b0 = *(const Lanes *)(h + row + w), &b1 = *(const Lanes *)(h + sliceWords + row + w);
+            const Lanes &c0 = *(const Lanes *)(h + below + w), &c1 = *(const Lanes *)(h + sliceWords + below + w);
+            Lanes s0, k0, s1, k1;
+            fullAdd(a0, b0, c0, s0, k0);
+            fullAdd(a1, b1, c1, s1, k1);
+            *(Lanes *)(v + row + w) = s0;
+            *(Lanes *)(v + sliceWords + row + w) = s1 ^ k0;
+            *(Lanes *)(v + 2 * sliceWords + row + w) = k1 ^ (s1 & k0);
+            *(Lanes *)(v + 3 * sliceWords + row + w) = k1 & s1 & k0;
+        }
+    }
+}
+
+// Step the slices [begin, end). The 4-bit y sums of three consecutive
+// slices are kept in a ring so each slice is only summed once per slab.
+LIFE_TARGETS
+static void stepSlab(Life &life, int begin, int end) {
+    int size = life.size, rowWords = life.rowWords;
+    int sliceWords = size * rowWords;
+    std::vector<Word> h(2 * sliceWords), v(3 * 4 * sliceWords);
+    Word *ring[3];
+    for (int i = 0; i < 3; i++) {
+        ring[i] = v.data() + i * 4 * sliceWords;
+        sumSlice(life.cells.data() + life.index(0, (begin + i - 1 + size) % size), size, rowWords, h.data(), ring[i]);
+    }
+
+    // Cells past the end of each row must stay dead
+    Word tail = size & 63 ? (1ULL << (size & 63)) - 1 : ~0ULL;
+    int lastWord = (size - 1) >> 6;
+    const LifeRule &rule = life.rule;
+
+    for (int z = begin; z < end; z++) {
+        if (z > begin) {
+            Word *oldest = ring[0];
+            ring[0] = ring[1];
+            ring[1] = ring[2];
+            ring[2] = oldest;
+            sumSlice(life.cells.data() + life.index(0, (z + 1) % size), size, rowWords, h.data(), oldest);
+        }
+
+        for (int i = 0; i < sliceWords; i += LaneWords) {
+            Lanes a[4], b[4], c[4], bits[5];
+            for (int k = 0; k < 4; k++) {
+                a[k] = *(const Lanes *)(ring[0] + k * sliceWords + i);
+                b[k] = *(const Lanes *)(ring[1] + k * sliceWords + i);
+                c[k] = *(const Lanes *)(ring[2] + k * sliceWords + i);
+            }
+
+            // Add the three 4-bit sums into a 5-bit count of all 27 cells
+            // in the neighborhood (at most 27, so there is no carry out)
+            Lanes k1, k2a, k2b, k3a, k3b, k4a, k4b, s;
+            fullAdd(a[0], b[0], c[0], bits[0], k1);
+            fullAdd(a[1], b[1], c[1], s, k2a);
+            bits[1] = s ^ k1;
+            k2b = s & k1;
+            fullAdd(a[2], b[2], c[2], s, k3a);
+            fullAdd(s, k2a, k2b, bits[2], k3b);
+            fullAdd(a[3], b[3], c[3], s, k4a);
+            fullAdd(s, k3a, k3b, bits[3], k4b);
+            bits[4] = k4a | k4b;
+
+            // The count includes the cell itself, which is one more than
+            // the neighbor count for live cells
+            const Lanes &alive = *(const Lanes *)(life.cells.data() + life.index(0, z) + i);
+            Lanes birth, survive;
+            inRange(bits, rule.birthMin, rule.birthMax, birth);
+            inRange(bits, rule.surviveMin + 1, rule.surviveMax + 1, survive);
+            *(Lanes *)(life.next.data() + life.index(0, z) + i) = (alive & survive) | (~alive & birth);
+        }
+
+        for (int y = 0; y < size; y++) {
+            Word *row = life.next.data() + life.index(y, z);
+            row[lastWord] &= tail;
+            for (int w = lastWord + 1; w < rowWords; w++) row[w] = 0;
+        }
+    }
+}
+
+void Life::resize(int size) {
+    this->size = size;
+    rowWords = ((size + 63) / 64 + LaneWords - 1) / LaneWords * LaneWords;
+    cells.assign((size_t)size * size * rowWords, 0);
+    next.assign(cells.size(), 0);
+}
+
+void Life::randomize() {
+    for (int z = 0; z < size; z++) {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) set(x, y, z, (rand() & 0xFF) < rule.seed);
+        }
+    }
+}
+
+void Life::set(int x, int y, int z, bool alive) {
+    Word &word = cells[index(y, z) + (x >> 6)];
+    Word bit = 1ULL << (x & 63);
+    word = alive ? word | bit : word & ~bit;
+}
+
+void Life::load(const unsigned char *data, int stride) {
+    for (int z = 0; z < size; z++) {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) set(x, y, z, data[((z * size + y) * size + x) * stride] > 127);
+        }
+    }
+}
+
+void Life::store(unsigned char *data, int stride) const {
+    for (int z = 0; z < size; z++) {
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) data[((z * size + y) * size + x) * stride] = get(x, y, z) ? 0xFF : 0;
+        }
+    }
+}
+
+long long Life::population() const {
+    long long count = 0;
+    for (size_t i = 0; i < cells.size(); i++) count += __builtin_popcountll(cells[i]);
+    return count;
+}
+
+void Life::step() {
+    double start = currentTime();
+
+    // Several slabs per thread balances the load, but each slab also sums
+    // the two slices around it again
+    int slab = std::max(4, size / (threadCount() * 4));
+    parallelFor(0, size, slab, [&](int begin, int end) {
+        stepSlab(*this, begin, end);
+    });
+    cells.swap(next);
+    seconds = currentTime() - start;
+}
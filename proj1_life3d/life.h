@@ -0,0 +1,72 @@
+#ifndef LIFE_H
+#define LIFE_H
+
+#include "gl4.h"
+
+// A rule set for 3D life. A dead cell comes alive if its number of live
+// neighbors (out of 26) is in [birthMin, birthMax] and a live cell stays
+// alive if it is in [surviveMin, surviveMax]. New grids start with each cell
+// alive if a random byte is less than seed.
+struct LifeRule {
+    const char *name;
+    int birthMin, birthMax;
+    int surviveMin, surviveMax;
+    int seed;
+};
+
+// B14-19/S13+, shrinks to stable 3D cloud structures from a 50% seed
+extern const LifeRule cloudRule;
+
+// B5/S5-7, grows repeating patterns from a 5% seed
+extern const LifeRule repeatingRule;
+
+// A CPU version of the update shader for grids that are too big for the GPU
+// one, or for checking it. Cells are packed 64 to a word along x, and each
+// step counts the neighbors of every cell in a word at once using bitwise
+// adders: each bit of the count is a separate word, so adding two counts is
+// a few ANDs and XORs no matter how many cells they hold. Rows are padded to
+// a multiple of four words so the adders work on 256 cells at a time, and
+// the grid wraps around in all three directions like GL_REPEAT.
+//
+// Usage:
+//
+//     Life life;
+//     life.resize(512);
+//     life.randomize();
+//     life.step();
+//
+// Work is spread over threads using parallelFor(), one slab of z slices each.
+struct Life {
+    typedef unsigned long long Word;
+
+    int size;
+    int rowWords;
+    LifeRule rule;
+    std::vector<Word> cells, next;
+    double seconds;
+
+    Life() : size(), rowWords(), rule(cloudRule), seconds() {}
+
+    // Clear the grid and make it size cells on each side
+    void resize(int size);
+
+    // Set every cell using rule.seed
+    void randomize();
+
+    bool get(int x, int y, int z) const { return cells[index(y, z) + (x >> 6)] >> (x & 63) & 1; }
+    void set(int x, int y, int z, bool alive);
+
+    // Read or write the red channel of GL_RG GL_UNSIGNED_BYTE texture data,
+    // like the update shader uses, where any value over 127 is alive
+    void load(const unsigned char *data, int stride);
+    void store(unsigned char *data, int stride) const;
+
+    long long population() const;
+
+    // Advance every cell by one step
+    void step();
+
+    int index(int y, int z) const { return (z * size + y) * rowWords; }
+};
+
+#endif // LIFE_H
@@ -1,5 +1,9 @@
 #include <GL/glut.h>
+#include <string.h>
 #include "gl4.h"
+#include "life.h"
+
+HeadlessContext headless;
 
 float width = 0, height = 0;
 
@@ -12,9 +16,41 @@ float cameraTransition = 0;
 float angleX = 0, angleY = 0;
 vec3 eye = vec3(0.5);
 
+enum Update {
+    FragmentUpdate,
+    BrickUpdate,
+    CPUUpdate
+};
+
 Shader updateShader, displayShader;
 Texture textureA, textureB;
 FBO fbo(false);
+Update updateMode = FragmentUpdate;
+
+// The brick update splits the grid into bricks of 8x8x8 cells and only
+// updates the bricks next to one that changed last step, so the cost follows
+// the activity instead of the volume
+const int brickSize = 8;
+bool bricksSupported = false;
+Shader brickUpdateShader, brickListShader;
+Buffer<unsigned int> activeBricks;
+Buffer<unsigned int> changedBricks;
+
+// With OpenGL 4.3 the cells are drawn from a mesh of just the faces of live
+// cells next to dead ones. Each brick has a fixed range of the face buffer
+// and a draw command for it, so a brick's faces can be rebuilt without
+// touching the rest. A row of 8 cells has at most 4 live cells followed by
+// a dead one in each direction, so a brick has at most 6 * 4 * 64 faces.
+const int maxBrickFaces = 6 * 4 * 64;
+bool rebuildWholeMesh = true;
+Shader meshBuildShader, meshDisplayShader;
+Buffer<unsigned int> meshFaces;
+Buffer<unsigned int> meshCommands;
+VAO meshLayout;
+
+// The update on the CPU keeps its own copy of the texture data
+Life life;
+std::vector<unsigned char> cpuData;
 
 Buffer<vec2> quadVertices;
 VAO quadLayout;
@@ -23,61 +59,337 @@ Buffer<vec3> cubeVertices;
 Buffer<unsigned char> cubeIndices;
 VAO cubeLayout;
 
+// Make the next brick update update every brick, for when the cells were
+// changed some other way. The active list starts with the arguments for
+// dispatchIndirect().
+void resetBricks() {
+    int bricks = textureA.width / brickSize;
+    int count = bricks * bricks * bricks;
+    activeBricks.data.resize(3 + count);
+    activeBricks.data[0] = count;
+    activeBricks.data[1] = activeBricks.data[2] = 1;
+    for (int i = 0; i < count; i++) activeBricks.data[3 + i] = i;
+    activeBricks.markDirty(0, activeBricks.size());
+    activeBricks.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+
+    changedBricks.data.assign(count, 0);
+    changedBricks.markDirty(0, count);
+    changedBricks.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+}
+
 void randomizeTextures() {
     const int size = 96;
-    char data[size * size * size * 2];
-    for (size_t i = 0; i < sizeof(data); i++) data[i] = (i & 1) ? 0x1F : 0xFF * ((rand() & 0xFF) < 127);
-    textureA.create(size, size, size, GL_RG, GL_RG, GL_UNSIGNED_BYTE, GL_LINEAR, GL_REPEAT, data);
-    textureB.create(size, size, size, GL_RG, GL_RG, GL_UNSIGNED_BYTE, GL_LINEAR, GL_REPEAT);
+    std::vector<unsigned char> data(size * size * size * 2);
+    for (size_t i = 0; i < data.size(); i++) data[i] = (i & 1) ? 0x1F : 0xFF * ((rand() & 0xFF) < life.rule.seed);
+    textureA.allocate(size, size, size, GL_RG8, GL_RG, GL_UNSIGNED_BYTE, GL_LINEAR, GL_REPEAT, data.data());
+    textureB.allocate(size, size, size, GL_RG8, GL_RG, GL_UNSIGNED_BYTE, GL_LINEAR, GL_REPEAT);
+
+    if (updateMode == CPUUpdate) {
+        cpuData.swap(data);
+        life.load(cpuData.data(), 2);
+    }
+    if (updateMode == BrickUpdate) resetBricks();
+    rebuildWholeMesh = true;
+}
+
+void setRule(const LifeRule &rule) {
+    life.rule = rule;
+    updateShader.use();
+    updateShader.uniformFloat("birthMin", rule.birthMin);
+    updateShader.uniformFloat("birthMax", rule.birthMax);
+    updateShader.uniformFloat("surviveMin", rule.surviveMin);
+    updateShader.uniformFloat("surviveMax", rule.surviveMax);
+    updateShader.unuse();
+
+    if (bricksSupported) {
+        brickUpdateShader.use();
+        brickUpdateShader.uniformFloat("birthMin", rule.birthMin);
+        brickUpdateShader.uniformFloat("birthMax", rule.birthMax);
+        brickUpdateShader.uniformFloat("surviveMin", rule.surviveMin);
+        brickUpdateShader.uniformFloat("surviveMax", rule.surviveMax);
+        brickUpdateShader.unuse();
+    }
+}
+
+// Copy the cells out of the texture when switching to the CPU, since the GPU
+// updates only keep them there
+void setUpdateMode(Update mode) {
+    if (mode == BrickUpdate && !bricksSupported) {
+        printf("the brick update needs OpenGL 4.3\n");
+        return;
+    }
+    if (mode == BrickUpdate && updateMode != BrickUpdate) resetBricks();
+    if (mode == CPUUpdate && updateMode != CPUUpdate) {
+        cpuData.resize(textureA.width * textureA.height * textureA.depth * 2);
+        textureA.bind();
+        glGetTexImage(GL_TEXTURE_3D, 0, GL_RG, GL_UNSIGNED_BYTE, cpuData.data());
+        textureA.unbind();
+        life.resize(textureA.width);
+        life.load(cpuData.data(), 2);
+    }
+    updateMode = mode;
+}
+
+// Shared by the per-cell and mesh display shaders
+const char *displayFragmentSource = glsl(
+    uniform sampler3D data;
+    in vec3 position;
+    in vec3 coord;
+    out vec4 color;
+    void main() {
+        // Calculate surface normal
+        vec3 normal = normalize(cross(dFdx(position), dFdy(position)));
+
+        // Calculate ambient occlusion
+        vec2 value = texture(data, coord).rg;
+        float smallScale = clamp(1.5 - value.r, 0.0, 1.0);
+        float largeScale = clamp(1.5 - 3.0 * value.g, 0.0, 1.0);
+        color = vec4(smallScale * largeScale);
+
+        // No ambient occlusion on boundary fragments
+        vec3 boundary = coord + normal * 0.001;
+        if (boundary != clamp(boundary, 0.0, 1.0)) color = vec4(1.0);
+
+        // Add some color
+        vec3 light = normalize(vec3(1.0, 3.0, 2.0));
+        color *= mix(vec4(0.4, 0.5, 0.6, 0.0), vec4(0.6, 0.65, 0.7, 0.0), 0.5 + 0.5 * dot(light, normal));
+    }
+);
+
+void setupBricks() {
+    // One work group per active brick. The same neighbor sum as the update
+    // shader, but a brick also notes whether any of its cells changed (in
+    // either channel, since the green one feeds back into itself).
+    brickUpdateShader.computeShader(glsl430(
+        layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+        layout(std430, binding = 0) readonly buffer ActiveBricks { uint activeCount; uint groupsY; uint groupsZ; uint activeList[]; };
+        layout(std430, binding = 1) writeonly buffer ChangedBricks { uint changed[]; };
+        layout(rg8, binding = 0) writeonly uniform image3D nextData;
+        uniform sampler3D data;
+        uniform float birthMin;
+        uniform float birthMax;
+        uniform float surviveMin;
+        uniform float surviveMax;
+        shared uint anyChanged;
+        void main() {
+            int size = textureSize(data, 0).x;
+            int bricks = size / 8;
+            int brick = int(activeList[gl_WorkGroupID.x]);
+            ivec3 cell = ivec3(brick % bricks, brick / bricks % bricks, brick / (bricks * bricks)) * 8 + ivec3(gl_LocalInvocationID);
+            if (gl_LocalInvocationIndex == 0) anyChanged = 0;
+            barrier();
+
+            // Count active neighbors, wrapping around like GL_REPEAT
+            vec2 neighbors = vec2(0.0);
+            for (int z = -1; z <= 1; z++)
+                for (int y = -1; y <= 1; y++)
+                    for (int x = -1; x <= 1; x++)
+                        neighbors += texelFetch(data, (cell + ivec3(x, y, z) + size) % size, 0).rg;
+            vec2 self = texelFetch(data, cell, 0).rg;
+            neighbors.r -= self.r;
+
+            // Apply the rule set (see LifeRule in life.h)
+            float next = mix(float(neighbors.r >= birthMin && neighbors.r <= birthMax), float(neighbors.r >= surviveMin && neighbors.r <= surviveMax), self.r);
+            vec2 color = vec2(next, mix(neighbors.r, neighbors.g, 0.99) / 27.0);
+            imageStore(nextData, cell, vec4(color, 0.0, 0.0));
+
+            // Count a value that lands halfway between two bytes as a change,
+            // since it could round either way when stored
+            if (any(greaterThanEqual(abs(color * 255.0 - round(self * 255.0)), vec2(0.5)))) atomicOr(anyChanged, 1);
+            barrier();
+            if (gl_LocalInvocationIndex == 0) changed[brick] = anyChanged;
+        }
+    )).linkAsync();
+
+    // One invocation per brick. A brick needs updating next step if any
+    // brick around it changed. The count must be zero beforehand.
+    brickListShader.computeShader(glsl430(
+        layout(local_size_x = 64) in;
+        layout(std430, binding = 0) buffer ActiveBricks { uint activeCount; uint groupsY; uint groupsZ; uint activeList[]; };
+        layout(std430, binding = 1) readonly buffer ChangedBricks { uint changed[]; };
+        uniform int bricks;
+        void main() {
+            int brick = int(gl_GlobalInvocationID.x);
+            if (brick >= bricks * bricks * bricks) return;
+            ivec3 center = ivec3(brick % bricks, brick / bricks % bricks, brick / (bricks * bricks));
+
+            bool near = false;
+            for (int z = -1; z <= 1; z++) {
+                for (int y = -1; y <= 1; y++) {
+                    for (int x = -1; x <= 1; x++) {
+                        ivec3 other = (center + ivec3(x, y, z) + bricks) % bricks;
+                        if (changed[(other.z * bricks + other.y) * bricks + other.x] != 0) near = true;
+                    }
+                }
+            }
+
+            if (near) activeList[atomicAdd(activeCount, 1)] = brick;
+        }
+    )).linkAsync();
+}
+
+void setupMesh() {
+    // One work group per brick and one invocation per cell. Each cell counts
+    // its faces that need drawing, and a prefix sum over the brick writes
+    // them out in cell order so the mesh is the same every time.
+    meshBuildShader.computeShader(glsl430(
+        layout(local_size_x = 8, local_size_y = 8, local_size_z = 8) in;
+        layout(std430, binding = 0) readonly buffer ActiveBricks { uint activeCount; uint groupsY; uint groupsZ; uint activeList[]; };
+        layout(std430, binding = 1) writeonly buffer MeshFaces { uint faces[]; };
+        layout(std430, binding = 2) writeonly buffer MeshCommands { uint commands[]; };
+        uniform sampler3D data;
+        uniform bool allBricks;
+        uniform int maxFaces;
+        shared uint offsets[512];
+        void main() {
+            const ivec3 directions[6] = ivec3[6](ivec3(0, 0, -1), ivec3(0, 0, 1), ivec3(0, -1, 0), ivec3(0, 1, 0), ivec3(-1, 0, 0), ivec3(1, 0, 0));
+            int size = textureSize(data, 0).x;
+            int bricks = size / 8;
+            int brick = allBricks ? int(gl_WorkGroupID.x) : int(activeList[gl_WorkGroupID.x]);
+            ivec3 cell = ivec3(brick % bricks, brick / bricks % bricks, brick / (bricks * bricks)) * 8 + ivec3(gl_LocalInvocationID);
+            uint index = gl_LocalInvocationIndex;
+
+            // Draw the faces of live cells that don't touch another live
+            // cell. Unlike the update this doesn't wrap around, so faces on
+            // the edge of the grid are always drawn.
+            uint exposed = 0;
+            uint count = 0;
+            if (texelFetch(data, cell, 0).r > 0.5) {
+                for (int i = 0; i < 6; i++) {
+                    ivec3 other = cell + directions[i];
+                    if (any(lessThan(other, ivec3(0))) || any(greaterThanEqual(other, ivec3(size))) || texelFetch(data, other, 0).r <= 0.5) {
+                        exposed |= 1u << i;
+                        count++;
+                    }
+                }
+            }
+
+            // Inclusive prefix sum of the counts
+            offsets[index] = count;
+            barrier();
+            for (uint stride = 1; stride < 512; stride *= 2) {
+                uint before = index >= stride ? offsets[index - stride] : 0;
+                barrier();
+                offsets[index] += before;
+                barrier();
+            }
+
+            uint face = brick * maxFaces + offsets[index] - count;
+            uint id = (cell.z * size + cell.y) * size + cell.x;
+            for (int i = 0; i < 6; i++) {
+                if ((exposed & (1u << i)) != 0) faces[face++] = id * 6 + i;
+            }
+            if (index == 511) commands[brick * 4] = offsets[511] * 4;
+        }
+    )).linkAsync();
+
+    // Each face is a cell index times 6 plus a face of the cube, and each
+    // vertex is one of the four corners of that face in cubeIndices
+    meshDisplayShader.vertexShader(glsl430(
+        layout(std430, binding = 1) readonly buffer MeshFaces { uint faces[]; };
+        uniform mat4 matrix;
+        out vec3 position;
+        out vec3 coord;
+        void main() {
+            const int corners[24] = int[24](0, 2, 3, 1, 4, 5, 7, 6, 0, 1, 5, 4, 2, 6, 7, 3, 0, 4, 6, 2, 1, 3, 7, 5);
+            const int size = 96;
+            uint face = faces[gl_VertexID / 4];
+            int cell = int(face / 6);
+            vec3 offset = vec3(cell % size, (cell / size) % size, cell / (size * size));
+            int corner = corners[int(face % 6) * 4 + gl_VertexID % 4];
+            vec3 vertex = vec3(corner & 1, (corner >> 1) & 1, corner >> 2);
+            gl_Position = matrix * vec4((vertex + offset) / size, 1.0);
+            position = vertex;
+
+            // 3D Texture coordinate
+            coord = (offset + vertex) / size;
+        }
+    )).fragmentShader(displayFragmentSource).linkAsync();
+
+    // The draw command of each brick is { vertex count, 1 instance, first
+    // vertex of its range, base instance }, where the build shader only
+    // writes the count
+    int bricks = textureA.width / brickSize;
+    meshFaces.data.assign(bricks * bricks * bricks * maxBrickFaces, 0);
+    meshFaces.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+    for (int i = 0; i < bricks * bricks * bricks; i++) meshCommands << 0 << 1 << i * maxBrickFaces * 4 << 0;
+    meshCommands.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+
+    // The vertex shader reads the faces itself, so there are no attributes
+    meshLayout.create(meshDisplayShader, meshFaces);
+
+    meshBuildShader.use();
+    meshBuildShader.uniformInt("maxFaces", maxBrickFaces);
+    meshBuildShader.unuse();
 }
 
 void setup() {
+    bricksSupported = hasVersion(4, 3);
+    life.resize(96);
     randomizeTextures();
 
     glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
 
-    // Update shader
+    // Update shader, which draws one instance of a full-screen quad per slice
+    // and sends each one to its slice of the layered framebuffer
     updateShader.vertexShader(glsl(
         in vec2 vertex;
-        out vec2 coord;
+        out vec2 vertexCoord;
+        flat out int vertexLayer;
         void main() {
-            coord = vertex;
+            vertexCoord = vertex;
+            vertexLayer = gl_InstanceID;
             gl_Position = vec4(vertex * 2.0 - 1.0, 0.0, 1.0);
         }
+    )).geometryShader(glsl(
+        layout(triangles) in;
+        layout(triangle_strip, max_vertices = 3) out;
+        in vec2 vertexCoord[];
+        flat in int vertexLayer[];
+        out vec2 coord;
+        flat out int layer;
+        void main() {
+            for (int i = 0; i < 3; i++) {
+                coord = vertexCoord[i];
+                layer = vertexLayer[i];
+                gl_Layer = vertexLayer[i];
+                gl_Position = gl_in[i].gl_Position;
+                EmitVertex();
+            }
+            EndPrimitive();
+        }
     )).fragmentShader(glsl(
         uniform sampler3D data;
-        uniform float startZ;
         uniform float depth;
+        uniform float birthMin;
+        uniform float birthMax;
+        uniform float surviveMin;
+        uniform float surviveMax;
         in vec2 coord;
-        out vec4 colors[8];
+        flat in int layer;
+        out vec4 color;
         void main() {
-            // For each of the 8 slices we are doing this pass
-            for (int i = 0; i < 8; i++) {
-                // Find the 3D texture coordinate
-                vec3 pos = vec3(coord, (startZ + i + 0.5) / depth);
-                vec3 delta = vec3(1.0 / depth);
-
-                // Count active neighbors
-                vec2 neighbors = vec2(0.0);
-                for (int z = -1; z <= 1; z++)
-                    for (int y = -1; y <= 1; y++)
-                        for (int x = -1; x <= 1; x++)
-                            neighbors += texture(data, pos + delta * vec3(x, y, z)).rg;
-                vec2 self = texture(data, pos).rg;
-                neighbors.r -= self.r;
-
-                // Nice repeating structures (seed is randByte() < 13)
-//                float next = mix(float(neighbors.r == 5.0), float(neighbors.r >= 5.0 && neighbors.r <= 7.0), self.r);
-
-                // Generates 3D cloud structure (seed is randByte() < 127)
-                float next = mix(float(neighbors.r >= 14.0 && neighbors.r <= 19.0), float(neighbors.r >= 13.0), self.r);
-
-                // Calculate ambient occlusion by blurring the 3D buffer value using averaging over time
-                colors[i] = vec4(next, mix(neighbors.r, neighbors.g, 0.99) / 27.0, 0.0, 0.0);
-            }
+            // Find the 3D texture coordinate
+            vec3 pos = vec3(coord, (layer + 0.5) / depth);
+            vec3 delta = vec3(1.0 / depth);
+
+            // Count active neighbors
+            vec2 neighbors = vec2(0.0);
+            for (int z = -1; z <= 1; z++)
+                for (int y = -1; y <= 1; y++)
+                    for (int x = -1; x <= 1; x++)
+                        neighbors += texture(data, pos + delta * vec3(x, y, z)).rg;
+            vec2 self = texture(data, pos).rg;
+            neighbors.r -= self.r;
+
+            // Apply the rule set (see LifeRule in life.h)
+            float next = mix(float(neighbors.r >= birthMin && neighbors.r <= birthMax), float(neighbors.r >= surviveMin && neighbors.r <= surviveMax), self.r);
+
+            // Calculate ambient occlusion by blurring the 3D buffer value using averaging over time
+            color = vec4(next, mix(neighbors.r, neighbors.g, 0.99) / 27.0, 0.0, 0.0);
         }
-    )).link();
+    )).linkAsync();
 
     // Display shader
     displayShader.vertexShader(glsl(
@@ -103,30 +415,12 @@ void setup() {
             // 3D Texture coordinate
             coord = (offset + vertex) / size;
         }
-    )).fragmentShader(glsl(
-        uniform sampler3D data;
-        in vec3 position;
-        in vec3 coord;
-        out vec4 color;
-        void main() {
-            // Calculate surface normal
-            vec3 normal = normalize(cross(dFdx(position), dFdy(position)));
-
-            // Calculate ambient occlusion
-            vec2 value = texture(data, coord).rg;
-            float smallScale = clamp(1.5 - value.r, 0.0, 1.0);
-            float largeScale = clamp(1.5 - 3.0 * value.g, 0.0, 1.0);
-            color = vec4(smallScale * largeScale);
-
-            // No ambient occlusion on boundary fragments
-            vec3 boundary = coord + normal * 0.001;
-            if (boundary != clamp(boundary, 0.0, 1.0)) color = vec4(1.0);
-
-            // Add some color
-            vec3 light = normalize(vec3(1.0, 3.0, 2.0));
-            color *= mix(vec4(0.4, 0.5, 0.6, 0.0), vec4(0.6, 0.65, 0.7, 0.0), 0.5 + 0.5 * dot(light, normal));
-        }
-    )).link();
+    )).fragmentShader(displayFragmentSource).linkAsync();
+
+    if (bricksSupported) {
+        setupBricks();
+        setupMesh();
+    }
 
     // Vertices
     for (int i = 0; i < 8; i++) cubeVertices << vec3(!!(i & 1), !!(i & 2), !!(i & 4));
@@ -146,6 +440,8 @@ void setup() {
     // Vertex array layout
     cubeLayout.create(displayShader, cubeVertices, cubeIndices).attribute<float>("vertex", 3).check();
     quadLayout.create(updateShader, quadVertices).attribute<float>("vertex", 2).check();
+
+    setRule(life.rule);
 }
 
 void draw() {
@@ -156,38 +452,158 @@ void draw() {
 
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Render the volume using instanced cubes
-    displayShader.use();
-    displayShader.uniform("matrix", matrix);
-    textureA.bind();
-    cubeLayout.drawInstanced(textureA.width * textureA.height * textureA.depth, GL_QUADS);
-    textureA.unbind();
-    displayShader.unuse();
+    // Render the volume using the mesh if there is one, or instanced cubes
+    if (bricksSupported) {
+        meshDisplayShader.use();
+        meshDisplayShader.uniform("matrix", matrix);
+        textureA.bind();
+        meshFaces.bindBase(1);
+        meshLayout.multiDrawIndirect(meshCommands.id, meshCommands.size() / 4, 0, GL_QUADS);
+        textureA.unbind();
+        meshDisplayShader.unuse();
+    } else {
+        displayShader.use();
+        displayShader.uniform("matrix", matrix);
+        textureA.bind();
+        cubeLayout.drawInstanced(textureA.width * textureA.height * textureA.depth, GL_QUADS);
+        textureA.unbind();
+        displayShader.unuse();
+    }
 
-    glutSwapBuffers();
+    if (!headless.context) glutSwapBuffers();
 }
 
-void update() {
-    const int step = 8;
+// The update shader also blurs the live cells into the green channel over
+// time for ambient occlusion, which the CPU update does here separately with
+// three passes of a 3-wide box filter. This must run before the red channel
+// is replaced with the next step.
+void blurOcclusion(std::vector<unsigned char> &data, int size) {
+    int count = size * size * size;
+    std::vector<float> a(count), b(count);
+    for (int i = 0; i < count; i++) a[i] = (data[i * 2] > 127) * 0.01f + data[i * 2 + 1] / 255.0f * 0.99f;
+
+    int strides[3] = { 1, size, size * size };
+    for (int axis = 0; axis < 3; axis++) {
+        int stride = strides[axis];
+        for (int i = 0; i < count; i++) {
+            int coord = i / stride % size;
+            int below = coord > 0 ? i - stride : i + (size - 1) * stride;
+            int above = coord < size - 1 ? i + stride : i - (size - 1) * stride;
+            b[i] = a[below] + a[i] + a[above];
+        }
+        a.swap(b);
+    }
 
-    // Update a single step
+    // The neighbor count doesn't include the cell itself
+    for (int i = 0; i < count; i++) data[i * 2 + 1] = (a[i] - 0.01f * (data[i * 2] > 127)) / 27 * 255 + 0.5f;
+}
+
+void updateWithCPU() {
+    blurOcclusion(cpuData, life.size);
+    life.step();
+    life.store(cpuData.data(), 2);
+    textureA.uploadAsync(GL_RG, GL_UNSIGNED_BYTE, cpuData.data());
+}
+
+void updateWithGPU() {
+    // Update a single step, all slices in one draw
     updateShader.use();
     updateShader.uniformFloat("depth", textureA.depth);
     textureA.bind();
-    for (int z = 0; z < textureA.depth; z += step) {
-        for (int attachment = 0; attachment < step; attachment++) {
-            fbo.attachColor(textureB, attachment, z + attachment);
-        }
-        fbo.check();
-
-        updateShader.uniformFloat("startZ", z);
-        fbo.bind();
-        quadLayout.draw(GL_TRIANGLE_STRIP);
-        fbo.unbind();
-    }
+    fbo.attachLayered(textureB).check().bind();
+    quadLayout.drawInstanced(textureA.depth, GL_TRIANGLE_STRIP);
+    fbo.unbind();
     textureA.unbind();
     updateShader.unuse();
     textureA.swapWith(textureB);
+}
+
+// Only the bricks in the active list are updated. A skipped brick and its
+// neighbors didn't change last step, so it won't change this step either, and
+// textureB already holds the same cells as textureA from two steps ago.
+void updateWithBricks() {
+    int bricks = textureA.width / brickSize;
+    int zero = 0;
+    changedBricks.bind();
+    glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32I, GL_RED_INTEGER, GL_INT, &zero);
+    changedBricks.unbind();
+
+    brickUpdateShader.use();
+    textureA.bind();
+    textureB.bindImage(0, GL_WRITE_ONLY);
+    activeBricks.bindBase(0);
+    changedBricks.bindBase(1);
+    brickUpdateShader.dispatchIndirect(activeBricks.id);
+    textureA.unbind();
+    brickUpdateShader.unuse();
+    memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    // Rebuild the list for the next step
+    activeBricks.data[0] = 0;
+    activeBricks.uploadRange(0, 1);
+    brickListShader.use();
+    brickListShader.uniformInt("bricks", bricks);
+    brickListShader.dispatch((bricks * bricks * bricks + 63) / 64);
+    brickListShader.unuse();
+
+    // printBrickCounts() reads the list's count back with glGetBufferSubData()
+    memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+    textureA.swapWith(textureB);
+}
+
+// Rebuild the faces of every brick, or just the ones in the active list of
+// the brick update. That list has every brick next to one that changed, which
+// covers the faces on the sides of the changed bricks too.
+void updateMesh(bool allBricks) {
+    int bricks = textureA.width / brickSize;
+    meshBuildShader.use();
+    meshBuildShader.uniformInt("allBricks", allBricks);
+    textureA.bind();
+    meshFaces.bindBase(1);
+    meshCommands.bindBase(2);
+    if (allBricks) {
+        meshBuildShader.dispatch(bricks * bricks * bricks);
+    } else {
+        activeBricks.bindBase(0);
+        meshBuildShader.dispatchIndirect(activeBricks.id);
+    }
+    textureA.unbind();
+    meshBuildShader.unuse();
+
+    // printBrickCounts() reads the commands back with glGetBufferSubData()
+    memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+// Read back the number of active bricks and the number of faces in the mesh,
+// which stalls until the last step is done
+void printBrickCounts() {
+    int bricks = textureA.width / brickSize;
+    if (updateMode == BrickUpdate) {
+        unsigned int count = 0;
+        activeBricks.bind();
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(count), &count);
+        activeBricks.unbind();
+        printf("%u of %d bricks active\n", count, bricks * bricks * bricks);
+    }
+
+    std::vector<unsigned int> commands(meshCommands.size());
+    meshCommands.bind();
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, commands.size() * sizeof(unsigned int), commands.data());
+    meshCommands.unbind();
+    long long faces = 0;
+    for (size_t i = 0; i < commands.size(); i += 4) faces += commands[i] / 4;
+    printf("%lld faces in the mesh\n", faces);
+}
+
+void update() {
+    if (updateMode == CPUUpdate) updateWithCPU();
+    else if (updateMode == BrickUpdate) updateWithBricks();
+    else updateWithGPU();
+    if (bricksSupported) {
+        updateMesh(rebuildWholeMesh || updateMode != BrickUpdate);
+        rebuildWholeMesh = false;
+    }
 
     // Transition from first person to third person and back
     cameraTransition = firstPerson * 0.1 + cameraTransition * 0.9;
@@ -228,6 +644,12 @@ void keydown(unsigned char key, int, int) {
     case 27: exit(0); break;
     case ' ': randomizeTextures(); break;
     case 'c': firstPerson = !firstPerson; break;
+    case 'u': setUpdateMode(updateMode == CPUUpdate ? FragmentUpdate : CPUUpdate); break;
+    case 'b': setUpdateMode(updateMode == BrickUpdate ? FragmentUpdate : BrickUpdate); break;
+    case 'r':
+        setRule(strcmp(life.rule.name, cloudRule.name) ? cloudRule : repeatingRule);
+        randomizeTextures();
+        break;
     case 'w': keyUp = true; break;
     case 'a': keyLeft = true; break;
     case 's': keyDown = true; break;
@@ -247,11 +669,96 @@ void keyup(unsigned char key, int, int) {
 void resize(int w, int h) {
     width = w;
     height = h;
-    glViewport(0, 0, w, h);
+    glState.setViewport(0, 0, w, h);
+}
+
+// Run the CPU update alone on a bigger grid and print how fast it is
+void benchmark(int size) {
+    life.resize(size);
+    life.randomize();
+    int steps = 0;
+    double seconds = 0;
+    while (steps < 3 || seconds < 2) {
+        life.step();
+        seconds += life.seconds;
+        steps++;
+    }
+    printf("%d^3 cells, %s rule, %d threads: %d steps in %.3f seconds (%.3g cell updates/sec)\n",
+        size, life.rule.name, threadCount(), steps, seconds, (double)size * size * size * steps / seconds);
+}
+
+// Run the GPU and CPU updates side by side and count the cells where they
+// disagree, which should be none since both count neighbors exactly
+bool validate(int steps) {
+    setUpdateMode(CPUUpdate);
+    long long mismatches = 0;
+    std::vector<unsigned char> gpuData(cpuData.size());
+    for (int i = 0; i < steps; i++) {
+        updateWithGPU();
+        life.step();
+        textureA.bind();
+        glGetTexImage(GL_TEXTURE_3D, 0, GL_RG, GL_UNSIGNED_BYTE, gpuData.data());
+        textureA.unbind();
+        for (size_t j = 0; j < gpuData.size(); j += 2) {
+            int x = j / 2 % life.size, y = j / 2 / life.size % life.size, z = j / 2 / life.size / life.size;
+            mismatches += (gpuData[j] > 127) != life.get(x, y, z);
+        }
+    }
+    printf("%d steps of the %s rule: %lld cells differ, %lld alive\n", steps, life.rule.name, mismatches, life.population());
+    return mismatches == 0;
 }
 
 int main(int argc, char *argv[]) {
     enum { WIDTH = 800, HEIGHT = 600 };
+    int headlessSteps = 0;
+    int validateSteps = 0;
+    int benchmarkSize = 0;
+    Update startMode = FragmentUpdate;
+    for (int i = 1; i < argc; i++) {
+        // Run a fixed number of steps without a window using "--headless <steps>"
+        if (!strcmp(argv[i], "--headless") && i + 1 < argc) headlessSteps = atoi(argv[++i]);
+
+        // Start with the update on the CPU
+        else if (!strcmp(argv[i], "--cpu")) startMode = CPUUpdate;
+
+        // Start with the update that skips stable bricks
+        else if (!strcmp(argv[i], "--bricks")) startMode = BrickUpdate;
+
+        // Use the "clouds" (default) or "repeating" rule set
+        else if (!strcmp(argv[i], "--rule") && i + 1 < argc) life.rule = strcmp(argv[++i], repeatingRule.name) ? cloudRule : repeatingRule;
+
+        // Use this many threads for the CPU update instead of one per core
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) setThreadCount(atoi(argv[++i]));
+
+        // Compare the CPU update against the GPU for a number of steps and exit
+        else if (!strcmp(argv[i], "--validate") && i + 1 < argc) validateSteps = atoi(argv[++i]);
+
+        // Time the CPU update on a size * size * size grid and exit
+        else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) benchmarkSize = std::max(1, atoi(argv[++i]));
+    }
+
+    if (benchmarkSize) {
+        benchmark(benchmarkSize);
+        return 0;
+    }
+
+    if (validateSteps) {
+        headless.create(WIDTH, HEIGHT);
+        setup();
+        return validate(validateSteps) ? 0 : 1;
+    }
+
+    if (headlessSteps) {
+        headless.create(WIDTH, HEIGHT);
+        setup();
+        resize(WIDTH, HEIGHT);
+        setUpdateMode(startMode);
+        double seconds = headless.run(update, headlessSteps);
+        printf("%d steps in %.3f seconds (%.1f steps/sec)\n", headlessSteps, seconds, headlessSteps / seconds);
+        if (bricksSupported) printBrickCounts();
+        return 0;
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
     glutCreateWindow("cs195v - life");
@@ -265,6 +772,7 @@ int main(int argc, char *argv[]) {
     glutMouseFunc(mousedown);
     setup();
     resize(WIDTH, HEIGHT);
+    setUpdateMode(startMode);
     glutMainLoop();
     return 0;
 }
@@ -1,16 +1,67 @@
 #include <GL/glut.h>
+#include <string.h>
 #include "gl4.h"
+#include "terrain.h"
+
+HeadlessContext headless;
 
 float width = 800, height = 600;
 float angleX = 0, angleY = 0;
 vec3 eye;
 
+// Camera constants shared by both programs, uploaded once per frame
+struct Camera {
+    mat4 matrix;
+    mat4 invMatrix;
+    vec3 eye;
+    float padding;
+};
+std140Offset(Camera, invMatrix, 64);
+std140Offset(Camera, eye, 128);
+
 Shader terrainShader, fogShader;
+UniformBlock<Camera> camera;
 float maxTessLevel = 64;
 
 Buffer<vec3> gridVertices;
 VAO gridLayout;
 
+// With OpenGL 4.3 a compute shader tests the bounding box of every patch
+// against the frustum first and drops the ones outside. Each work group of 64
+// patches writes the indices of the ones that pass to its own range of
+// visiblePatches and their count to its own draw command, and the whole list
+// is drawn with one multiDrawIndirect() call. There are two sets of commands
+// so the counts from the last frame can be read back without waiting on this
+// one.
+const int cullGroupSize = 64;
+bool cullingSupported = false;
+bool culling = true;
+Shader cullShader;
+Buffer<unsigned int> visiblePatches;
+Buffer<unsigned int> cullCommands[2];
+VAO culledLayout;
+int cullFrame = 0;
+int visiblePatchCount = 0;
+
+// With OpenGL 4.3 the terrain height and crease factor are read from a
+// clipmap around the eye instead of evaluating the noise for every vertex and
+// pixel. Each level is a window of 1024x1024 texels centered on the eye with
+// texels twice as far apart as the level before, and is stored toroidally, so
+// when the eye moves only the strips of texels that came into view are filled
+// in. terrainMapOrigin is the first texel of the window of each level.
+const int terrainMapSize = 1024;
+const int terrainMapLevels = 6;
+const float terrainMapSpacing = 1.0f / 512;
+bool terrainMapSupported = false;
+bool terrainMapValid = false;
+bool exactTerrain = false;
+Shader terrainMapShader;
+Texture terrainMap;
+int terrainMapOrigin[terrainMapLevels][2];
+
+// The terrain evaluated on the CPU, for --benchmark and --validate
+Heightmap heightmap;
+
 Buffer<vec2> quadVertices;
 VAO quadLayout;
 
@@ -18,9 +69,137 @@ FBO fbo;
 Texture colorTexture;
 Texture positionTexture;
 
+// The block that struct Camera is uploaded to, for every shader that needs
+// the camera
+const char *cameraBlock = glslSource(
+    layout(std140, row_major) uniform Camera {
+        mat4 matrix;
+        mat4 invMatrix;
+        vec3 eye;
+    };
+);
+
+// Ian McEwan's 2D simplex noise and the terrain made from it, shared by the
+// shaders that evaluate the terrain directly and the one that fills the
+// clipmap
+const char *noiseSource = glslSource(
+    //
+    // Description : Array and textureless GLSL 2D simplex noise function.
+    //      Author : Ian McEwan, Ashima Arts.
+    //  Maintainer : ijm
+    //     Lastmod : 20110822 (ijm)
+    //     License : Copyright (C) 2011 Ashima Arts. All rights reserved.
+    //               Distributed under the MIT License. See LICENSE file.
+    //               https://github.com/ashima/webgl-noise
+    //
+
+    vec3 mod289(vec3 x) {
+      return x - floor(x * (1.0 / 289.0)) * 289.0;
+    }
+
+    vec2 mod289(vec2 x) {
+      return x - floor(x * (1.0 / 289.0)) * 289.0;
+    }
+
+    vec3 permute(vec3 x) {
+      return mod289(((x*34.0)+1.0)*x);
+    }
+
+    float snoise(vec2 v)
+      {
+      const vec4 C = vec4(0.211324865405187,  // (3.0-sqrt(3.0))/6.0
+                          0.366025403784439,  // 0.5*(sqrt(3.0)-1.0)
+                         -0.577350269189626,  // -1.0 + 2.0 * C.x
+                          0.024390243902439); // 1.0 / 41.0
+    // First corner
+      vec2 i  = floor(v + dot(v, C.yy) );
+      vec2 x0 = v -   i + dot(i, C.xx);
+
+    // Other corners
+      vec2 i1;
+      //i1.x = step( x0.y, x0.x ); // x0.x > x0.y ? 1.0 : 0.0
+      //i1.y = 1.0 - i1.x;
+      i1 = (x0.x > x0.y) ? vec2(1.0, 0.0) : vec2(0.0, 1.0);
+      // x0 = x0 - 0.0 + 0.0 * C.xx ;
+      // x1 = x0 - i1 + 1.0 * C.xx ;
+      // x2 = x0 - 1.0 + 2.0 * C.xx ;
+      vec4 x12 = x0.xyxy + C.xxzz;
+      x12.xy -= i1;
+
+    // Permutations
+      i = mod289(i); // Avoid truncation effects in permutation
+      vec3 p = permute( permute( i.y + vec3(0.0, i1.y, 1.0 ))
+            + i.x + vec3(0.0, i1.x, 1.0 ));
+
+      vec3 m = max(0.5 - vec3(dot(x0,x0), dot(x12.xy,x12.xy), dot(x12.zw,x12.zw)), 0.0);
+      m = m*m ;
+      m = m*m ;
+
+    // Gradients: 41 points uniformly over a line, mapped onto a diamond.
+    // The ring size 17*17 = 289 is close to a multiple of 41 (41*7 = 287)
+
+      vec3 x = 2.0 * fract(p * C.www) - 1.0;
+      vec3 h = abs(x) - 0.5;
+      vec3 ox = floor(x + 0.5);
+      vec3 a0 = x - ox;
+
+    // Normalise gradients implicitly by scaling m
+    // Approximation of: m *= inversesqrt( a0*a0 + h*h );
+      m *= 1.79284291400159 - 0.85373472095314 * ( a0*a0 + h*h );
+
+    // Compute final noise value at P
+      vec3 g;
+      g.x  = a0.x  * x0.x  + h.x  * x0.y;
+      g.yz = a0.yz * x12.xz + h.yz * x12.yw;
+      return 130.0 * dot(m, g);
+    }
+
+    // Return the terrain height and the "ambient occlusion" factor.
+    vec2 terrain(vec2 coord) {
+        float height = 0.0;
+        float weight = 0.5;
+        float minValue = 1.0;
+        vec2 offset = vec2(0.0);
+        coord *= 0.25;
+        for (int i = 0; i < 7; i++) {
+            float value = abs(snoise(coord + offset));
+            minValue = min(value, minValue);
+            height += value * weight;
+            offset += vec2(7.434387, 1.4567845);
+            coord *= 2.0;
+            weight *= 0.5;
+        }
+        return vec2(height * height * height, minValue);
+    }
+);
+
+// Look up the terrain height and "ambient occlusion" factor at a point, from
+// the clipmap or straight from the noise. Needs eye from the Camera block and
+// terrain() from noiseSource.
+const char *terrainMapSource = glslSource(
+    uniform sampler3D terrainMap;
+    uniform bool exactTerrain;
+
+    // Layer i of terrainMap has texels 2^i / 512 apart. It repeats, so a
+    // point maps to the same texel wherever the window around the eye is.
+    vec2 terrainLevel(vec2 point, float level) {
+        float spacing = exp2(level) / 512.0;
+        return textureLod(terrainMap, vec3(point / (spacing * 1024.0) + 0.5 / 1024.0, (level + 0.5) / 6.0), 0.0).xy;
+    }
+
+    // Blend the two levels that fit the distance from the eye. Level i
+    // reaches 2^i out from the eye but is only used up to 70% of that.
+    vec2 terrainAt(vec2 point) {
+        if (exactTerrain) return terrain(point);
+        vec2 d = abs(point - eye.xz);
+        float lod = clamp(log2(max(max(d.x, d.y), 1e-6)) + 1.5, 0.0, 5.0);
+        float level = floor(lod);
+        return mix(terrainLevel(point, level), terrainLevel(point, min(level + 1.0, 5.0)), lod - level);
+    }
+);
+
 void setup() {
-    terrainShader.vertexShader(glsl(
-        uniform vec3 eye;
+    terrainShader.vertexShader((std::string("#version 400\n") + cameraBlock + glslSource(
         in vec3 vertex;
         out vec3 vPosition;
         out float distance;
@@ -28,9 +207,7 @@ void setup() {
             vPosition = vertex;
             distance = length(vPosition - eye);
         }
-    )).tessControlShader(glsl(
-        uniform mat4 matrix;
-        uniform vec3 eye;
+    )).c_str()).tessControlShader((std::string("#version 400\n") + cameraBlock + glslSource(
         uniform float maxTessLevel;
         layout(vertices=4) out;
         in vec3 vPosition[];
@@ -95,101 +272,11 @@ void setup() {
                 }
             }
         }
-    )).tessEvalShader(glsl(
+    )).c_str()).tessEvalShader((std::string("#version 400\n") + cameraBlock + glslSource(
         layout(quads, fractional_even_spacing) in;
         in vec3 tcPosition[];
         out vec3 point;
-        uniform mat4 matrix;
-
-        //
-        // Description : Array and textureless GLSL 2D simplex noise function.
-        //      Author : Ian McEwan, Ashima Arts.
-        //  Maintainer : ijm
-        //     Lastmod : 20110822 (ijm)
-        //     License : Copyright (C) 2011 Ashima Arts. All rights reserved.
-        //               Distributed under the MIT License. See LICENSE file.
-        //               https://github.com/ashima/webgl-noise
-        //
-
-        vec3 mod289(vec3 x) {
-          return x - floor(x * (1.0 / 289.0)) * 289.0;
-        }
-
-        vec2 mod289(vec2 x) {
-          return x - floor(x * (1.0 / 289.0)) * 289.0;
-        }
-
-        vec3 permute(vec3 x) {
-          return mod289(((x*34.0)+1.0)*x);
-        }
-
-        float snoise(vec2 v)
-          {
-          const vec4 C = vec4(0.211324865405187,  // (3.0-sqrt(3.0))/6.0
-                              0.366025403784439,  // 0.5*(sqrt(3.0)-1.0)
-                             -0.577350269189626,  // -1.0 + 2.0 * C.x
-                              0.024390243902439); // 1.0 / 41.0
-        // First corner
-          vec2 i  = floor(v + dot(v, C.yy) );
-          vec2 x0 = v -   i + dot(i, C.xx);
-
-        // Other corners
-          vec2 i1;
-          //i1.x = step( x0.y, x0.x ); // x0.x > x0.y ? 1.0 : 0.0
-          //i1.y = 1.0 - i1.x;
-          i1 = (x0.x > x0.y) ? vec2(1.0, 0.0) : vec2(0.0, 1.0);
-          // x0 = x0 - 0.0 + 0.0 * C.xx ;
-          // x1 = x0 - i1 + 1.0 * C.xx ;
-          // x2 = x0 - 1.0 + 2.0 * C.xx ;
-          vec4 x12 = x0.xyxy + C.xxzz;
-          x12.xy -= i1;
-
-        // Permutations
-          i = mod289(i); // Avoid truncation effects in permutation
-          vec3 p = permute( permute( i.y + vec3(0.0, i1.y, 1.0 ))
-                + i.x + vec3(0.0, i1.x, 1.0 ));
-
-          vec3 m = max(0.5 - vec3(dot(x0,x0), dot(x12.xy,x12.xy), dot(x12.zw,x12.zw)), 0.0);
-          m = m*m ;
-          m = m*m ;
-
-        // Gradients: 41 points uniformly over a line, mapped onto a diamond.
-        // The ring size 17*17 = 289 is close to a multiple of 41 (41*7 = 287)
-
-          vec3 x = 2.0 * fract(p * C.www) - 1.0;
-          vec3 h = abs(x) - 0.5;
-          vec3 ox = floor(x + 0.5);
-          vec3 a0 = x - ox;
-
-        // Normalise gradients implicitly by scaling m
-        // Approximation of: m *= inversesqrt( a0*a0 + h*h );
-          m *= 1.79284291400159 - 0.85373472095314 * ( a0*a0 + h*h );
-
-        // Compute final noise value at P
-          vec3 g;
-          g.x  = a0.x  * x0.x  + h.x  * x0.y;
-          g.yz = a0.yz * x12.xz + h.yz * x12.yw;
-          return 130.0 * dot(m, g);
-        }
-
-        // Return all octaves directly because they are used to calculate
-        // the diffuse color in the fragment shader. Calculating diffuse
-        // color in the tess eval shader leads to horrible interpolation
-        // because the abs() value doesn't interpolate across the origin.
-        float terrain(vec2 coord) {
-            float height = 0.0;
-            float weight = 0.5;
-            vec2 offset = vec2(0.0);
-            coord *= 0.25;
-            for (int i = 0; i < 7; i++) {
-                height += abs(snoise(coord + offset)) * weight;
-                offset += vec2(7.434387, 1.4567845);
-                coord *= 2.0;
-                weight *= 0.5;
-            }
-            return height * height * height;
-        }
-
+    ) + noiseSource + terrainMapSource + glslSource(
         void main() {
             // Bilinear interpolation
             vec3 p01 = mix(tcPosition[0], tcPosition[1], gl_TessCoord.x);
@@ -197,12 +284,11 @@ void setup() {
             point = mix(p01, p23, gl_TessCoord.y);
 
             // Compute vertex height
-            point.y = terrain(point.xz);
+            point.y = terrainAt(point.xz).x;
         }
-    )).geometryShader(glsl(
+    )).c_str()).geometryShader((std::string("#version 400\n") + cameraBlock + glslSource(
         layout(triangles) in;
         layout(triangle_strip, max_vertices = 3) out;
-        uniform mat4 matrix;
         in vec3 point[];
         out vec3 p;
         out vec3 baryCoord;
@@ -224,99 +310,10 @@ void setup() {
 
             EndPrimitive();
         }
-    )).fragmentShader(glsl(
+    )).c_str()).fragmentShader((std::string("#version 400\n") + cameraBlock + glslSource(
         // We need high precision for normal calculation via derivatives
         precision highp float;
-
-        //
-        // Description : Array and textureless GLSL 2D simplex noise function.
-        //      Author : Ian McEwan, Ashima Arts.
-        //  Maintainer : ijm
-        //     Lastmod : 20110822 (ijm)
-        //     License : Copyright (C) 2011 Ashima Arts. All rights reserved.
-        //               Distributed under the MIT License. See LICENSE file.
-        //               https://github.com/ashima/webgl-noise
-        //
-
-        vec3 mod289(vec3 x) {
-          return x - floor(x * (1.0 / 289.0)) * 289.0;
-        }
-
-        vec2 mod289(vec2 x) {
-          return x - floor(x * (1.0 / 289.0)) * 289.0;
-        }
-
-        vec3 permute(vec3 x) {
-          return mod289(((x*34.0)+1.0)*x);
-        }
-
-        float snoise(vec2 v)
-          {
-          const vec4 C = vec4(0.211324865405187,  // (3.0-sqrt(3.0))/6.0
-                              0.366025403784439,  // 0.5*(sqrt(3.0)-1.0)
-                             -0.577350269189626,  // -1.0 + 2.0 * C.x
-                              0.024390243902439); // 1.0 / 41.0
-        // First corner
-          vec2 i  = floor(v + dot(v, C.yy) );
-          vec2 x0 = v -   i + dot(i, C.xx);
-
-        // Other corners
-          vec2 i1;
-          //i1.x = step( x0.y, x0.x ); // x0.x > x0.y ? 1.0 : 0.0
-          //i1.y = 1.0 - i1.x;
-          i1 = (x0.x > x0.y) ? vec2(1.0, 0.0) : vec2(0.0, 1.0);
-          // x0 = x0 - 0.0 + 0.0 * C.xx ;
-          // x1 = x0 - i1 + 1.0 * C.xx ;
-          // x2 = x0 - 1.0 + 2.0 * C.xx ;
-          vec4 x12 = x0.xyxy + C.xxzz;
-          x12.xy -= i1;
-
-        // Permutations
-          i = mod289(i); // Avoid truncation effects in permutation
-          vec3 p = permute( permute( i.y + vec3(0.0, i1.y, 1.0 ))
-                + i.x + vec3(0.0, i1.x, 1.0 ));
-
-          vec3 m = max(0.5 - vec3(dot(x0,x0), dot(x12.xy,x12.xy), dot(x12.zw,x12.zw)), 0.0);
-          m = m*m ;
-          m = m*m ;
-
-        // Gradients: 41 points uniformly over a line, mapped onto a diamond.
-        // The ring size 17*17 = 289 is close to a multiple of 41 (41*7 = 287)
-
-          vec3 x = 2.0 * fract(p * C.www) - 1.0;
-          vec3 h = abs(x) - 0.5;
-          vec3 ox = floor(x + 0.5);
-          vec3 a0 = x - ox;
-
-        // Normalise gradients implicitly by scaling m
-        // Approximation of: m *= inversesqrt( a0*a0 + h*h );
-          m *= 1.79284291400159 - 0.85373472095314 * ( a0*a0 + h*h );
-
-        // Compute final noise value at P
-          vec3 g;
-          g.x  = a0.x  * x0.x  + h.x  * x0.y;
-          g.yz = a0.yz * x12.xz + h.yz * x12.yw;
-          return 130.0 * dot(m, g);
-        }
-
-        // Return the terrain height and the "ambient occlusion" factor.
-        vec2 terrain(vec2 coord) {
-            float height = 0.0;
-            float weight = 0.5;
-            float minValue = 1.0;
-            vec2 offset = vec2(0.0);
-            coord *= 0.25;
-            for (int i = 0; i < 7; i++) {
-                float value = abs(snoise(coord + offset));
-                minValue = min(value, minValue);
-                height += value * weight;
-                offset += vec2(7.434387, 1.4567845);
-                coord *= 2.0;
-                weight *= 0.5;
-            }
-            return vec2(height * height * height, minValue);
-        }
-
+    ) + noiseSource + terrainMapSource + glslSource(
         uniform float wireframe;
         in vec3 p;
         in vec3 baryCoord;
@@ -325,7 +322,7 @@ void setup() {
 
         void main() {
             // Calculate terrain height and ambient occlusion simultaneously
-            vec2 tuple = terrain(p.xz);
+            vec2 tuple = terrainAt(p.xz);
             position = vec3(p.x, tuple.x, p.z);
 
             // Calculate the normal using the value of position in adjacent pixels
@@ -341,10 +338,9 @@ void setup() {
             vec3 g = smoothstep(vec3(0.0), fwidth(baryCoord * 0.875), abs(fract(baryCoord - 0.5) - 0.5));
             color.a = mix(1.0, 0.5 + 0.5 * min(min(g.x, g.y), g.z), wireframe);
         }
-    )).link();
+    )).c_str()).linkAsync();
 
-    fogShader.vertexShader(glsl(
-        uniform mat4 invMatrix;
+    fogShader.vertexShader((std::string("#version 400\n") + cameraBlock + glslSource(
         in vec2 vertex;
         out vec3 ray;
         out vec2 coord;
@@ -357,8 +353,7 @@ void setup() {
             vec4 near = invMatrix * vec4(gl_Position.xy, 0.5, 1.0);
             ray = normalize(far.xyz / far.w - near.xyz / near.w);
         }
-    )).fragmentShader(glsl(
-        uniform vec3 eye;
+    )).c_str()).fragmentShader((std::string("#version 400\n") + cameraBlock + glslSource(
         uniform sampler2D colorTexture;
         uniform sampler2D positionTexture;
         in vec2 coord;
@@ -394,13 +389,94 @@ void setup() {
             // Apply wireframe after fog
             color = vec4(mix(color.rgb, vec3(0.8, 0.85, 1.0), weight) * color.a, 1.0);
         }
-    )).link();
+    )).c_str()).linkAsync();
+
+    camera.attach(terrainShader, "Camera");
+    camera.attach(fogShader, "Camera");
+
+    terrainShader.use();
+    terrainShader.uniformInt("terrainMap", 0);
+    terrainShader.unuse();
+
+    // Fill a rectangle of texels of one level of the clipmap, where the
+    // region is in texels from the origin of the world
+    terrainMapShader.computeShader((std::string("#version 430\n") + noiseSource + glslSource(
+        layout(local_size_x = 8, local_size_y = 8) in;
+        layout(rg32f, binding = 0) writeonly uniform image3D terrainMap;
+        uniform int regionX;
+        uniform int regionZ;
+        uniform int regionWidth;
+        uniform int regionHeight;
+        uniform int level;
+        void main() {
+            ivec2 offset = ivec2(gl_GlobalInvocationID.xy);
+            if (offset.x >= regionWidth || offset.y >= regionHeight) return;
+            ivec2 texel = ivec2(regionX, regionZ) + offset;
+            vec2 tuple = terrain(vec2(texel) * (exp2(float(level)) / 512.0));
+            imageStore(terrainMap, ivec3(texel & 1023, level), vec4(tuple, 0.0, 0.0));
+        }
+    )).c_str()).linkAsync();
 
     fogShader.use();
     fogShader.uniformInt("colorTexture", 0);
     fogShader.uniformInt("positionTexture", 1);
     fogShader.unuse();
 
+    // Test the box around each patch, from the grid up to the highest the
+    // terrain can reach, against the planes of the frustum in clip space. A
+    // patch is only culled if all 8 corners are outside the same plane. The
+    // box is padded a little so rounding can't drop a patch that shows.
+    cullShader.computeShader((std::string("#version 430\n") + cameraBlock + glslSource(
+        layout(local_size_x = 64) in;
+        layout(std430, binding = 0) readonly buffer Vertices { float vertices[]; };
+        layout(std430, binding = 1) writeonly buffer Patches { uint patches[]; };
+        layout(std430, binding = 2) writeonly buffer Commands { uint commands[]; };
+        shared uint indexCount;
+        uniform int patchCount;
+        const float maxHeight = 1.0;
+        const float padding = 0.01;
+        vec3 vertex(uint i) {
+            return vec3(vertices[i * 3u], vertices[i * 3u + 1u], vertices[i * 3u + 2u]);
+        }
+        void main() {
+            if (gl_LocalInvocationIndex == 0u) indexCount = 0u;
+            barrier();
+
+            uint index = gl_GlobalInvocationID.x;
+            if (index < uint(patchCount)) {
+                // Wrap patch to always be centered around the eye, like the
+                // tess control shader does
+                vec3 v0 = vertex(index * 4u);
+                vec3 delta = (v0 - eye) * 0.03125;
+                delta.xz -= floor(delta.xz + 0.5);
+                delta = delta / 0.03125 + eye - v0;
+
+                // The vertices go (x, z), (x, z + 1), (x + 1, z), (x + 1, z + 1)
+                uint outside = 63u;
+                for (uint i = 0u; i < 8u; i++) {
+                    vec3 p = vertex(index * 4u + (i & 3u)) + delta;
+                    p.x += (i & 2u) != 0u ? padding : -padding;
+                    p.z += (i & 1u) != 0u ? padding : -padding;
+                    p.y += i < 4u ? -padding : maxHeight + padding;
+                    vec4 t = matrix * vec4(p, 1.0);
+                    outside &=
+                        uint(t.x < -t.w) | uint(t.x > t.w) << 1 |
+                        uint(t.y < -t.w) << 2 | uint(t.y > t.w) << 3 |
+                        uint(t.z < -t.w) << 4 | uint(t.z > t.w) << 5;
+                }
+
+                if (outside == 0u) {
+                    uint first = gl_WorkGroupID.x * 256u + atomicAdd(indexCount, 4u);
+                    for (uint i = 0u; i < 4u; i++) patches[first + i] = index * 4u + i;
+                }
+            }
+
+            barrier();
+            if (gl_LocalInvocationIndex == 0u) commands[gl_WorkGroupID.x * 5u] = indexCount;
+        }
+    )).c_str()).linkAsync();
+    camera.attach(cullShader, "Camera");
+
     const int size = 128;
     const float scale = 0.125;
     for (int z = -size; z < size; z++) {
@@ -414,6 +490,26 @@ void setup() {
     gridVertices.upload();
     gridLayout.create(terrainShader, gridVertices).attribute<float>("vertex", 3).check();
 
+    // The draw command of each work group is { index count, 1 instance,
+    // first index of its range, base vertex, base instance }, where the cull
+    // shader only writes the count
+    cullingSupported = hasVersion(4, 3);
+    if (cullingSupported) {
+        int groups = gridVertices.size() / 4 / cullGroupSize;
+        visiblePatches.data.assign(gridVertices.size(), 0);
+        visiblePatches.upload(GL_ELEMENT_ARRAY_BUFFER, GL_DYNAMIC_COPY);
+        for (int i = 0; i < 2; i++) {
+            for (int j = 0; j < groups; j++) cullCommands[i] << 0 << 1 << j * cullGroupSize * 4 << 0 << 0;
+            cullCommands[i].upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+        }
+        culledLayout.create(terrainShader, gridVertices, visiblePatches).attribute<float>("vertex", 3).check();
+    }
+
+    terrainMapSupported = hasVersion(4, 3);
+    if (terrainMapSupported) {
+        terrainMap.create(terrainMapSize, terrainMapSize, terrainMapLevels, GL_RG32F, GL_RG, GL_FLOAT, GL_LINEAR, GL_REPEAT);
+    }
+
     // Vertices
     quadVertices << vec2(0, 0) << vec2(1, 0) << vec2(0, 1) << vec2(1, 1);
     quadVertices.upload();
@@ -426,6 +522,86 @@ bool forward = false;
 bool backward = false;
 bool wireframe = false;
 
+// Cull the patches into visiblePatches and the commands for this frame. The
+// grid vertices and the index list are bound as shader storage directly since
+// their own targets are the vertex and index ones.
+void cullPatches() {
+    int patchCount = gridVertices.size() / 4;
+    cullShader.use();
+    cullShader.uniformInt("patchCount", patchCount);
+    glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gridVertices.id);
+    glState.bindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visiblePatches.id);
+    cullCommands[cullFrame].bindBase(2);
+    cullShader.dispatch((patchCount + cullGroupSize - 1) / cullGroupSize);
+    cullShader.unuse();
+
+    // updateCullCounts() reads the commands back with glGetBufferSubData()
+    memoryBarrier(GL_COMMAND_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+// Add up the counts in the last frame's commands, which are usually done by
+// now, and show them in the window title
+void updateCullCounts() {
+    Buffer<unsigned int> &commands = cullCommands[cullFrame ^ 1];
+    std::vector<unsigned int> data(commands.size());
+    commands.bind();
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, data.size() * sizeof(unsigned int), data.data());
+    commands.unbind();
+    visiblePatchCount = 0;
+    for (size_t i = 0; i < data.size(); i += 5) visiblePatchCount += data[i] / 4;
+
+    if (!headless.context) {
+        char title[64];
+        int patchCount = gridVertices.size() / 4;
+        snprintf(title, sizeof(title), "Example (%d visible, %d culled)", visiblePatchCount, patchCount - visiblePatchCount);
+        glutSetWindowTitle(title);
+    }
+}
+
+void fillTerrainMap(int level, int x, int z, int width, int height) {
+    terrainMapShader.uniformInt("regionX", x);
+    terrainMapShader.uniformInt("regionZ", z);
+    terrainMapShader.uniformInt("regionWidth", width);
+    terrainMapShader.uniformInt("regionHeight", height);
+    terrainMapShader.uniformInt("level", level);
+    terrainMapShader.dispatch((width + 7) / 8, (height + 7) / 8);
+}
+
+// Move the window of each level of the clipmap to the eye and fill in the
+// texels that came into view, which is a strip along one or two sides unless
+// the eye jumped further than the window is wide
+void updateTerrainMap() {
+    bool changed = false;
+    for (int level = 0; level < terrainMapLevels; level++) {
+        float spacing = terrainMapSpacing * (1 << level);
+        int x = (int)floorf(eye.x / spacing) - terrainMapSize / 2;
+        int z = (int)floorf(eye.z / spacing) - terrainMapSize / 2;
+        int *origin = terrainMapOrigin[level];
+        if (terrainMapValid && x == origin[0] && z == origin[1]) continue;
+
+        if (!changed) {
+            terrainMapShader.use();
+            terrainMap.bindImage(0, GL_WRITE_ONLY);
+            changed = true;
+        }
+        int dx = x - origin[0], dz = z - origin[1];
+        if (!terrainMapValid || abs(dx) >= terrainMapSize || abs(dz) >= terrainMapSize) {
+            fillTerrainMap(level, x, z, terrainMapSize, terrainMapSize);
+        } else {
+            if (dx) fillTerrainMap(level, dx > 0 ? origin[0] + terrainMapSize : x, z, abs(dx), terrainMapSize);
+            if (dz) fillTerrainMap(level, x, dz > 0 ? origin[1] + terrainMapSize : z, terrainMapSize, abs(dz));
+        }
+        origin[0] = x;
+        origin[1] = z;
+    }
+    terrainMapValid = true;
+
+    if (changed) {
+        terrainMapShader.unuse();
+        memoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+}
+
 void draw() {
     // Set up the camera
     mat4 matrix;
@@ -433,6 +609,12 @@ void draw() {
     matrix.perspective(45, width / height, 0.001, 100);
     modelview.rotateX(angleX).rotateY(angleY).translate(-eye);
     matrix *= modelview;
+    camera.data.matrix = matrix;
+    camera.data.invMatrix = mat4(matrix).invert();
+    camera.data.eye = eye;
+    camera.upload();
+    if (cullingSupported && culling) cullPatches();
+    if (terrainMapSupported && !exactTerrain) updateTerrainMap();
 
     fbo.bind();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -440,17 +622,17 @@ void draw() {
     terrainShader.use();
     terrainShader.uniformFloat("maxTessLevel", maxTessLevel);
     terrainShader.uniformFloat("wireframe", wireframe);
-    terrainShader.uniform("matrix", matrix);
-    terrainShader.uniform("eye", eye);
+    terrainShader.uniformInt("exactTerrain", exactTerrain || !terrainMapSupported);
+    terrainMap.bind(0);
     glPatchParameteri(GL_PATCH_VERTICES, 4);
-    gridLayout.draw(GL_PATCHES);
+    if (cullingSupported && culling) culledLayout.multiDrawIndirect(cullCommands[cullFrame].id, cullCommands[cullFrame].size() / 5, 0, GL_PATCHES);
+    else gridLayout.draw(GL_PATCHES);
+    terrainMap.unbind(0);
     terrainShader.unuse();
     glDisable(GL_DEPTH_TEST);
     fbo.unbind();
 
     fogShader.use();
-    fogShader.uniform("invMatrix", matrix.invert());
-    fogShader.uniform("eye", eye);
     colorTexture.bind(0);
     positionTexture.bind(1);
     quadLayout.draw(GL_TRIANGLE_STRIP);
@@ -458,7 +640,12 @@ void draw() {
     colorTexture.unbind(0);
     fogShader.unuse();
 
-    glutSwapBuffers();
+    if (cullingSupported && culling) {
+        updateCullCounts();
+        cullFrame ^= 1;
+    }
+
+    if (!headless.context) glutSwapBuffers();
 }
 
 // For calculating mouse deltas
@@ -480,6 +667,8 @@ void mousedown(int, int, int x, int y) {
 void keydown(unsigned char key, int, int) {
     if (key == 27) exit(0);
     if (key == '\t') wireframe = !wireframe;
+    if (key == 'c') culling = !culling;
+    if (key == 'n') exactTerrain = !exactTerrain;
     if (key == '=') maxTessLevel *= 1.1;
     if (key == '-') maxTessLevel /= 1.1;
     if (maxTessLevel < 2) maxTessLevel = 2;
@@ -532,14 +721,130 @@ void update() {
 void resize(int w, int h) {
     width = w;
     height = h;
-    glViewport(0, 0, w, h);
+    glState.setViewport(0, 0, w, h);
 
     colorTexture.create(w, h, 1, GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE, GL_NEAREST, GL_CLAMP_TO_EDGE);
     positionTexture.create(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
     fbo.attachColor(colorTexture, 0).attachColor(positionTexture, 1).check();
 }
 
+// Time filling a size x size heightmap on the CPU
+void benchmark(int size) {
+    heightmap.resize(size, size);
+    int runs = 0;
+    double seconds = 0;
+    while (runs < 3 || seconds < 2) {
+        heightmap.generate();
+        seconds += heightmap.seconds;
+        runs++;
+    }
+    printf("%dx%d samples (%s, %d threads): %d runs in %.3f seconds (%.3g samples/sec)\n",
+        size, size, simdName(heightmap.level), threadCount(), runs, seconds, (double)size * size * runs / seconds);
+}
+
+// Fill the clipmap around the starting eye on the GPU and every layer of it
+// again on the CPU, and compare them. Rounding differences grow with the
+// size of the coordinates, to a few 1e-4 in the crease factor at the edge of
+// the last layer.
+bool validate() {
+    if (!terrainMapSupported) {
+        printf("validating the terrain needs OpenGL 4.3\n");
+        return false;
+    }
+    updateTerrainMap();
+    std::vector<vec2> gpuData(terrainMapSize * terrainMapSize * terrainMapLevels);
+    terrainMap.bind();
+    glGetTexImage(GL_TEXTURE_3D, 0, GL_RG, GL_FLOAT, gpuData.data());
+    terrainMap.unbind();
+
+    // Texel (x, z) of a layer is at the same point on both, since the
+    // spacing is a power of two
+    float heightError = 0, creaseError = 0;
+    double seconds = 0;
+    heightmap.resize(terrainMapSize, terrainMapSize);
+    for (int level = 0; level < terrainMapLevels; level++) {
+        const int *origin = terrainMapOrigin[level];
+        heightmap.spacing = terrainMapSpacing * (1 << level);
+        heightmap.origin = vec2(origin[0], origin[1]) * heightmap.spacing;
+        heightmap.generate();
+        seconds += heightmap.seconds;
+        for (int z = 0; z < terrainMapSize; z++) {
+            for (int x = 0; x < terrainMapSize; x++) {
+                int texel = ((origin[0] + x) & (terrainMapSize - 1)) + ((origin[1] + z) & (terrainMapSize - 1)) * terrainMapSize;
+                const vec2 &gpu = gpuData[level * terrainMapSize * terrainMapSize + texel];
+                int i = heightmap.index(x, z);
+                heightError = fmaxf(heightError, fabsf(gpu.x - heightmap.heights[i]));
+                creaseError = fmaxf(creaseError, fabsf(gpu.y - heightmap.creases[i]));
+            }
+        }
+    }
+    int samples = terrainMapSize * terrainMapSize * terrainMapLevels;
+    printf("%d samples (%s, %d threads, %.3g samples/sec): largest difference %.3g in height, %.3g in crease\n",
+        samples, simdName(heightmap.level), threadCount(), samples / seconds, heightError, creaseError);
+    return heightError < 1.0e-3f && creaseError < 1.0e-3f;
+}
+
 int main(int argc, char *argv[]) {
+    int headlessSteps = 0;
+    int benchmarkSize = 0;
+    bool validateTerrain = false;
+    for (int i = 1; i < argc; i++) {
+        // Run a fixed number of steps without a window using "--headless <steps>"
+        if (!strcmp(argv[i], "--headless") && i + 1 < argc) headlessSteps = atoi(argv[++i]);
+
+        // Reuse compiled shaders from an earlier run
+        else if (!strcmp(argv[i], "--shader-cache") && i + 1 < argc) Shader::cacheDirectory = argv[++i];
+
+        // Draw every patch instead of culling them first
+        else if (!strcmp(argv[i], "--no-cull")) culling = false;
+
+        // Evaluate the noise for every vertex and pixel instead of reading the
+        // clipmap
+        else if (!strcmp(argv[i], "--exact-terrain")) exactTerrain = true;
+
+        // Use "scalar", "avx2", or "avx512" for the CPU terrain instead of the
+        // best one this CPU supports
+        else if (!strcmp(argv[i], "--simd") && i + 1 < argc) {
+            const char *name = argv[++i];
+            SIMDLevel level = !strcmp(name, "avx512") ? SIMDAVX512 : !strcmp(name, "avx2") ? SIMDAVX2 : SIMDScalar;
+            if (level > heightmap.level) printf("this CPU doesn't support %s, using %s\n", name, simdName(heightmap.level));
+            else heightmap.level = level;
+        }
+
+        // Use this many threads for the CPU terrain instead of one per core
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) setThreadCount(atoi(argv[++i]));
+
+        // Time the CPU terrain on a size x size grid and exit
+        else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) benchmarkSize = std::max(1, atoi(argv[++i]));
+
+        // Compare the CPU terrain against the clipmap and exit
+        else if (!strcmp(argv[i], "--validate")) validateTerrain = true;
+    }
+
+    if (benchmarkSize) {
+        benchmark(benchmarkSize);
+        return 0;
+    }
+
+    if (validateTerrain) {
+        headless.create(width, height);
+        setup();
+        return validate() ? 0 : 1;
+    }
+
+    if (headlessSteps) {
+        headless.create(width, height);
+        setup();
+        resize(width, height);
+        double seconds = headless.run(update, headlessSteps);
+        printf("%d steps in %.3f seconds (%.1f steps/sec)\n", headlessSteps, seconds, headlessSteps / seconds);
+        if (cullingSupported && culling) {
+            int patchCount = gridVertices.size() / 4;
+            printf("%d of %d patches visible (%d culled)\n", visiblePatchCount, patchCount, patchCount - visiblePatchCount);
+        }
+        return 0;
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutCreateWindow("Example");
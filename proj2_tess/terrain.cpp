@@ -0,0 +1,71 @@
+#include "terrain.h"
+
+namespace scalar {
+    typedef FloatScalar Float;
+    #include "terrainnoise.h"
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+SIMD_BEGIN_AVX2
+namespace avx2 {
+    typedef FloatAVX2 Float;
+    #include "terrainnoise.h"
+}
+SIMD_END
+
+SIMD_BEGIN_AVX512
+namespace avx512 {
+    typedef FloatAVX512 Float;
+    #include "terrainnoise.h"
+}
+SIMD_END
+
+#endif
+
+// Tiles are square so each one is a decent amount of work even when the
+// grid is only a few rows deep
+static const int tileSize = 64;
+
+vec2 terrain(vec2 point) {
+    FloatScalar height, crease;
+    scalar::sampleTerrain(point.x, point.y, height, crease);
+    return vec2(height.v, crease.v);
+}
+
+void Heightmap::resize(int width, int depth) {
+    this->width = width;
+    this->depth = depth;
+    heights.assign((size_t)width * depth, 0);
+    creases.assign(heights.size(), 0);
+}
+
+void Heightmap::generate() {
+    double start = currentTime();
+
+    void (*kernel)(Heightmap &, int, int, int, int) = scalar::generateTile;
+#if defined(__x86_64__) || defined(__i386__)
+    if (level == SIMDAVX2) kernel = avx2::generateTile;
+    if (level == SIMDAVX512) kernel = avx512::generateTile;
+#endif
+    int tilesX = (width + tileSize - 1) / tileSize;
+    int tilesZ = (depth + tileSize - 1) / tileSize;
+    parallelFor(0, tilesX * tilesZ, 1, [&](int begin, int end) {
+        for (int tile = begin; tile < end; tile++) {
+            int x = tile % tilesX * tileSize, z = tile / tilesX * tileSize;
+            kernel(*this, x, z, std::min(x + tileSize, width), std::min(z + tileSize, depth));
+        }
+    });
+    seconds = currentTime() - start;
+}
+
+float Heightmap::height(float x, float z) const {
+    float fx = fminf(fmaxf((x - origin.x) / spacing, 0), width - 1);
+    float fz = fminf(fmaxf((z - origin.y) / spacing, 0), depth - 1);
+    int x0 = std::min((int)fx, width - 2), z0 = std::min((int)fz, depth - 2);
+    float tx = fx - x0, tz = fz - z0;
+    const float *row = &heights[index(x0, z0)];
+    float front = row[0] + (row[1] - row[0]) * tx;
+    float back = row[width] + (row[width + 1] - row[width]) * tx;
+    return front + (back - front) * tz;
+}
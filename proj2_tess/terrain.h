@@ -0,0 +1,57 @@
+#ifndef TERRAIN_H
+#define TERRAIN_H
+
+#include "gl4.h"
+#include "simd.h"
+
+// The height and crease factor of the terrain at a point on the ground, the
+// same as terrain() in the shaders: seven octaves of Ian McEwan's 2D simplex
+// noise with an absolute value around each one. The height is also the y of
+// the ground at that point.
+vec2 terrain(vec2 point);
+
+// A grid of terrain samples made on the CPU, for collision queries, baking
+// heightmaps offline, and checking the shaders. Sample (x, z) is at
+// origin + vec2(x, z) * spacing, and the noise is evaluated for a row of as
+// many samples as the CPU has lanes at once (AVX-512, AVX2, or one at a
+// time), so filling the grid gives the same values as calling terrain() on
+// each point up to rounding.
+//
+// Usage:
+//
+//     Heightmap map;
+//     map.resize(1024, 1024);
+//     map.origin = vec2(-1, -1);
+//     map.generate();
+//     float y = map.height(point.x, point.z);
+//
+// Work is spread over threads using parallelFor(), one tile of the grid each.
+struct Heightmap {
+    int width;
+    int depth;
+    vec2 origin;
+    float spacing;
+    SIMDLevel level;
+
+    // Indexed by index(x, z)
+    std::vector<float> heights;
+    std::vector<float> creases;
+    double seconds;
+
+    Heightmap() : width(), depth(), spacing(1.0f / 512), level(simdLevel()), seconds() {}
+
+    // Make the grid width samples along x and depth along z
+    void resize(int width, int depth);
+
+    // Evaluate the terrain at every sample
+    void generate();
+
+    // The height at a point on the ground, interpolated between the four
+    // samples around it and clamped to the edges of the grid, which must be
+    // at least 2x2
+    float height(float x, float z) const;
+
+    int index(int x, int z) const { return z * width + x; }
+};
+
+#endif // TERRAIN_H
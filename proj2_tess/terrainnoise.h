@@ -0,0 +1,104 @@
+// The terrain noise, which terrain.cpp includes once per instruction set
+// with Float set to one of the types in simd.h. There's no include guard on
+// purpose. Each lane evaluates the noise at a different point, and the steps
+// are the ones in noiseSource in main.cpp in the same order so the results
+// match the shaders up to rounding.
+
+static inline Float mod289(Float x) {
+    return x - floor(x * (1.0f / 289.0f)) * 289.0f;
+}
+
+static inline Float permute(Float x) {
+    return mod289((x * 34.0f + 1.0f) * x);
+}
+
+// The contribution of one corner of the simplex, where p is its permuted
+// index and (x, y) is the point relative to the corner
+static inline Float corner(Float p, Float x, Float y) {
+    Float m = max(0.5f - (x * x + y * y), 0.0f);
+    m = m * m;
+    m = m * m;
+
+    // Gradients: 41 points uniformly over a line, mapped onto a diamond
+    Float scaled = p * 0.024390243902439f;
+    Float gradient = 2.0f * (scaled - floor(scaled)) - 1.0f;
+    Float h = abs(gradient) - 0.5f;
+    Float a0 = gradient - floor(gradient + 0.5f);
+
+    // Normalize the gradient implicitly by scaling m
+    m = m * (1.79284291400159f - 0.85373472095314f * (a0 * a0 + h * h));
+    return m * (a0 * x + h * y);
+}
+
+static inline Float snoise(Float vx, Float vy) {
+    const float Cx = 0.211324865405187f;
+    const float Cy = 0.366025403784439f;
+    const float Cz = -0.577350269189626f;
+
+    // First corner
+    Float skew = vx * Cy + vy * Cy;
+    Float ix = floor(vx + skew), iy = floor(vy + skew);
+    Float unskew = ix * Cx + iy * Cx;
+    Float x0 = vx - ix + unskew, y0 = vy - iy + unskew;
+
+    // Other corners
+    Float::Mask lower = y0 < x0;
+    Float i1x = select(lower, 1.0f, 0.0f), i1y = select(lower, 0.0f, 1.0f);
+    Float x1 = x0 + Cx - i1x, y1 = y0 + Cx - i1y;
+    Float x2 = x0 + Cz, y2 = y0 + Cz;
+
+    // Permutations
+    ix = mod289(ix);
+    iy = mod289(iy);
+    Float p0 = permute(permute(iy) + ix);
+    Float p1 = permute(permute(iy + i1y) + ix + i1x);
+    Float p2 = permute(permute(iy + 1.0f) + ix + 1.0f);
+
+    return 130.0f * (corner(p0, x0, y0) + corner(p1, x1, y1) + corner(p2, x2, y2));
+}
+
+static inline void sampleTerrain(Float x, Float z, Float &height, Float &crease) {
+    Float sum = 0.0f, minValue = 1.0f;
+    float weight = 0.5f, offsetX = 0, offsetZ = 0;
+    x = x * 0.25f;
+    z = z * 0.25f;
+    for (int i = 0; i < 7; i++) {
+        Float value = abs(snoise(x + offsetX, z + offsetZ));
+        minValue = min(value, minValue);
+        sum += value * weight;
+        offsetX += 7.434387f;
+        offsetZ += 1.4567845f;
+        x = x * 2.0f;
+        z = z * 2.0f;
+        weight *= 0.5f;
+    }
+    height = sum * sum * sum;
+    crease = minValue;
+}
+
+// Fill the samples [x0, x1) x [z0, z1) of the grid a row of lanes at a time,
+// going through a buffer for the last lanes of a row that don't fit
+static void generateTile(Heightmap &map, int x0, int z0, int x1, int z1) {
+    float heights[Float::Width], creases[Float::Width];
+    for (int z = z0; z < z1; z++) {
+        Float pointZ = map.origin.y + z * map.spacing;
+        for (int x = x0; x < x1; x += Float::Width) {
+            Float pointX = map.origin.x + ((float)x + Float::lanes()) * map.spacing;
+            Float height, crease;
+            sampleTerrain(pointX, pointZ, height, crease);
+
+            int i = map.index(x, z);
+            if (x + Float::Width <= x1) {
+                height.store(&map.heights[i]);
+                crease.store(&map.creases[i]);
+            } else {
+                height.store(heights);
+                crease.store(creases);
+                for (int k = 0; k < x1 - x; k++) {
+                    map.heights[i + k] = heights[k];
+                    map.creases[i + k] = creases[k];
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#include "barneshut.h"
+
+// Bits per axis in a Morton code, which is also the deepest level of the tree
+static const int Levels = 21;
+
+// Spread the low 21 bits of v out so there are two zero bits between each
+static unsigned long long spreadBits(unsigned long long v) {
+    v &= 0x1FFFFF;
+    v = (v | v << 32) & 0x1F00000000FFFFULL;
+    v = (v | v << 16) & 0x1F0000FF0000FFULL;
+    v = (v | v << 8) & 0x100F00F00F00F00FULL;
+    v = (v | v << 4) & 0x10C30C30C30C30C3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+}
+
+struct CodeOrder {
+    const unsigned long long *codes;
+    bool operator () (int a, int b) const { return codes[a] < codes[b]; }
+};
+
+// Insertion sort, which takes close to linear time on the order from the
+// last build since bodies don't move far in one step. An order that is far
+// from sorted (the first build, or after a reset) would take quadratic time,
+// so it gives up and uses std::sort once it has moved 8 elements per body.
+static void sortNearlySorted(std::vector<int> &order, const CodeOrder &byCode) {
+    size_t moves = 0, limit = order.size() * 8;
+    for (size_t i = 1; i < order.size(); i++) {
+        int value = order[i];
+        size_t j = i;
+        while (j > 0 && byCode(value, order[j - 1])) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = value;
+        moves += i - j;
+        if (moves > limit) {
+            std::sort(order.begin(), order.end(), byCode);
+            return;
+        }
+    }
+}
+
+void BarnesHut::build(const vec4 *positions, int count) {
+    double start = currentTime();
+
+    // Find a cube around all bodies
+    vec3 low(positions[0].x, positions[0].y, positions[0].z), high = low;
+    for (int i = 1; i < count; i++) {
+        const vec4 &p = positions[i];
+        low = vec3(fminf(low.x, p.x), fminf(low.y, p.y), fminf(low.z, p.z));
+        high = vec3(fmaxf(high.x, p.x), fmaxf(high.y, p.y), fmaxf(high.z, p.z));
+    }
+    float size = fmaxf(fmaxf(high.x - low.x, high.y - low.y), fmaxf(high.z - low.z, 1.0e-6)) * 1.0001;
+
+    // Sort the bodies along a Morton curve so every cell of the octree is a
+    // contiguous range
+    codes.resize(count);
+    float scale = (1 << Levels) / size;
+    parallelFor(0, count, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const vec4 &p = positions[i];
+            codes[i] = spreadBits((p.x - low.x) * scale) << 2 | spreadBits((p.y - low.y) * scale) << 1 | spreadBits((p.z - low.z) * scale);
+        }
+    });
+    if ((int)order.size() != count) {
+        order.resize(count);
+        for (int i = 0; i < count; i++) order[i] = i;
+    }
+    CodeOrder byCode = { codes.data() };
+    sortNearlySorted(order, byCode);
+    sorted.resize(count);
+    for (int i = 0; i < count; i++) sorted[i] = positions[order[i]];
+
+    nodes.clear();
+    buildNode(0, count, 0, low, size);
+    buildSeconds = currentTime() - start;
+}
+
+int BarnesHut::buildNode(int begin, int end, int level, const vec3 &origin, float size) {
+    int index = nodes.size();
+    nodes.push_back(Node());
+    nodes[index].size = size;
+    nodes[index].begin = begin;
+    nodes[index].end = end;
+    nodes[index].leaf = end - begin <= leafSize || level == Levels;
+
+    vec3 center;
+    float mass = 0;
+    if (nodes[index].leaf) {
+        for (int i = begin; i < end; i++) center += vec3(sorted[i].x, sorted[i].y, sorted[i].z);
+        mass = end - begin;
+    } else {
+        // The bodies in each octant are consecutive, so split the range at the
+        // first body whose three bits at this level are at least each octant
+        int shift = 3 * (Levels - 1 - level);
+        float half = size / 2;
+        for (int octant = 0, first = begin; octant < 8 && first < end; octant++) {
+            int last = first;
+            while (last < end && (int)(codes[order[last]] >> shift & 7) == octant) last++;
+            if (last == first) continue;
+            vec3 childOrigin = origin + vec3(octant & 4 ? half : 0, octant & 2 ? half : 0, octant & 1 ? half : 0);
+            int child = buildNode(first, last, level + 1, childOrigin, half);
+            center += nodes[child].center * nodes[child].mass;
+            mass += nodes[child].mass;
+            first = last;
+        }
+    }
+
+    nodes[index].center = center / mass;
+    nodes[index].mass = mass;
+    nodes[index].next = nodes.size();
+    return index;
+}
+
+vec3 BarnesHut::acceleration(const vec3 &position) const {
+    vec3 acceleration;
+    float thetaSquared = theta * theta;
+    for (int i = 0; i < (int)nodes.size();) {
+        const Node &node = nodes[i];
+        vec3 dir = node.center - position;
+        float distanceSquared = dot(dir, dir);
+
+        if (node.size * node.size < thetaSquared * distanceSquared) {
+            // Far enough away to treat the whole cell as one body
+            acceleration += dir * (node.mass / powf(distanceSquared + softening(), 1.5));
+            i = node.next;
+        } else if (node.leaf) {
+            for (int j = node.begin; j < node.end; j++) {
+                vec3 dir = vec3(sorted[j].x, sorted[j].y, sorted[j].z) - position;
+                acceleration += dir / powf(dot(dir, dir) + softening(), 1.5);
+            }
+            i = node.next;
+        } else {
+            i++;
+        }
+    }
+    return acceleration;
+}
+
+void BarnesHut::step(const vec4 *prev, const vec4 *curr, vec4 *next, int count) {
+    build(curr, count);
+
+    // Walk in sorted order so nearby bodies, which visit mostly the same
+    // nodes, are handled by the same thread
+    double start = currentTime();
+    parallelFor(0, count, 256, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int body = order[i];
+            vec3 c(curr[body].x, curr[body].y, curr[body].z);
+            vec3 p(prev[body].x, prev[body].y, prev[body].z);
+            next[body] = vec4(2 * c - p + acceleration(c) * strength(), 1);
+        }
+    });
+    walkSeconds = currentTime() - start;
+}
@@ -0,0 +1,61 @@
+#ifndef BARNESHUT_H
+#define BARNESHUT_H
+
+#include "gl4.h"
+
+// A CPU Barnes-Hut solver for the same gravity and Verlet step as the update
+// shaders in main.cpp. Each step sorts the bodies along a Morton curve and
+// builds an octree over them. Walking the octree for each body treats any
+// cell that looks smaller than theta (its size divided by its distance) as a
+// single body at its center of mass. This makes a step O(n log n) instead of
+// O(n^2), and theta trades accuracy for speed (0 is exact).
+//
+// Usage:
+//
+//     BarnesHut solver;
+//     solver.theta = 0.5;
+//     solver.step(prev, curr, next, count);
+//
+// Work is spread over threads using parallelFor().
+struct BarnesHut {
+    // The nodes are stored in depth-first order so the walk doesn't need a
+    // stack: descending goes to the next node and skipping a subtree goes to
+    // next. Leaves hold the sorted bodies [begin, end).
+    struct Node {
+        vec3 center;
+        float mass;
+        float size;
+        int begin, end;
+        int next;
+        bool leaf;
+    };
+
+    float theta;
+    int leafSize;
+    std::vector<Node> nodes;
+    std::vector<unsigned long long> codes;
+    std::vector<int> order;
+    std::vector<vec4> sorted;
+    double buildSeconds, walkSeconds;
+
+    BarnesHut() : theta(0.5), leafSize(8), buildSeconds(), walkSeconds() {}
+
+    // Sort the positions and build the octree over them. The sort starts
+    // from the order of the previous build and uses insertion sort, which is
+    // fast on it since bodies don't move far in one step.
+    void build(const vec4 *positions, int count);
+
+    // The acceleration at a point due to every body in the last build
+    vec3 acceleration(const vec3 &position) const;
+
+    // next = 2 * curr - prev + acceleration for every body
+    void step(const vec4 *prev, const vec4 *curr, vec4 *next, int count);
+
+    // The constants in the update shaders
+    static float softening() { return 0.01; }
+    static float strength() { return 0.0000001; }
+
+    int buildNode(int begin, int end, int level, const vec3 &origin, float size);
+};
+
+#endif // BARNESHUT_H
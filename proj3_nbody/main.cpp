@@ -1,5 +1,9 @@
 #include <GL/glut.h>
+#include <string.h>
 #include "gl4.h"
+#include "barneshut.h"
+
+HeadlessContext headless;
 
 enum PostProcess {
     None,
@@ -8,10 +12,21 @@ enum PostProcess {
     PostProcessCount
 };
 
-const int bufferWidth = 128;
-const int bufferHeight = 128;
+int bufferWidth = 128;
+int bufferHeight = 128;
+
+// Bodies per work group in the compute shader, which must match local_size_x
+const int tileSize = 256;
+
+enum Update {
+    FragmentUpdate,
+    ComputeUpdate,
+    BarnesHutUpdate
+};
 
 bool paused = false;
+bool computeSupported = false;
+Update updateMode = FragmentUpdate;
 PostProcess postProcess = None;
 float width = 800, height = 600;
 float angleX = 0, angleY = 0, zoomZ = 10;
@@ -22,6 +37,7 @@ VAO pointLayout;
 VAO quadLayout;
 
 Shader updateShader;
+Shader computeUpdateShader;
 Shader drawShader;
 FBO fbo;
 
@@ -29,6 +45,21 @@ Texture prevPositions;
 Texture currPositions;
 Texture nextPositions;
 
+// The compute path keeps the positions in shader storage buffers and rotates
+// through them instead of swapping textures. Only the current positions are
+// copied into currPositions each step (after the old ones become
+// prevPositions) because drawing reads positions from textures.
+Buffer<vec4> bodies[3];
+int bodyIndex = 0;
+
+// The Barnes-Hut path steps copies of the positions on the CPU and writes
+// the current ones straight into a stream buffer each step, with how far each
+// body moved in w, instead of going through the textures
+BarnesHut solver;
+std::vector<vec4> cpuPrev, cpuCurr, cpuNext;
+StreamBuffer<vec4> streamedBodies;
+VAO streamedLayout;
+Shader streamedDrawShader;
 Texture renderTarget;
 Texture accumulationTexture;
 Texture bokehScratchA;
@@ -38,12 +69,24 @@ Shader accumulationShader;
 Shader bokehFirstPass;
 Shader bokehSecondPass;
 
+// Write the Barnes-Hut positions for drawing
+void streamBodies() {
+    vec4 *data = streamedBodies.begin();
+    parallelFor(0, cpuCurr.size(), 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            const vec4 &prev = cpuPrev[i], &curr = cpuCurr[i];
+            data[i] = vec4(curr.x, curr.y, curr.z, length(vec3(curr.x - prev.x, curr.y - prev.y, curr.z - prev.z)));
+        }
+    });
+    streamedBodies.end(cpuCurr.size());
+}
+
 inline float frand() {
     return (float)rand() / (float)RAND_MAX;
 }
 
 void reset() {
-    std::vector<vec3> points;
+    std::vector<vec4> points;
     float offset = frand() * 100;
     for (int i = 0; i < bufferWidth * bufferHeight; i++) {
         float t = 20 * (offset + (float)i / (float)(bufferWidth * bufferHeight));
@@ -53,14 +96,77 @@ void reset() {
         matrix.rotateX(t * 5).rotateY(t * 147).rotateZ(t * 71);
         vec4 vertex = matrix * vec4(0, 0, 1, 0);
         vertex.x = i & 1 ? vertex.x + 1 : -1 - vertex.x;
-        points.push_back(vec3(vertex.x, vertex.y, vertex.z) * 4);
+        points.push_back(vec4(vertex.x * 4, vertex.y * 4, vertex.z * 4, 1));
+    }
+
+    prevPositions.allocate(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+    currPositions.allocate(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+    nextPositions.allocate(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+    cpuPrev = cpuCurr = cpuNext = points;
+    if (updateMode == BarnesHutUpdate) streamBodies();
+
+    if (computeSupported) {
+        for (int i = 0; i < 3; i++) {
+            bodies[i].data = points;
+            bodies[i].markDirty(0, points.size());
+            bodies[i].upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+        }
     }
+}
 
-    prevPositions.create(bufferWidth, bufferHeight, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
-    currPositions.create(bufferWidth, bufferHeight, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
-    nextPositions.create(bufferWidth, bufferHeight, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+// Copy the positions from the textures into the shader storage buffers when
+// switching from the fragment shader path to the compute path
+void copyTexturesToBodies() {
+    const Texture *textures[2] = { &prevPositions, &currPositions };
+    for (int i = 0; i < 2; i++) {
+        glState.bindBuffer(GL_PIXEL_PACK_BUFFER, bodies[(bodyIndex + i) % 3].id);
+        textures[i]->bind();
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, NULL);
+        textures[i]->unbind();
+    }
+    glState.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 }
 
+// Every update path but Barnes-Hut leaves the previous and current positions
+// in the textures, so switching paths starts from those. Barnes-Hut keeps them
+// on the CPU and copies them back into the textures when switching away.
+void setUpdateMode(Update mode) {
+    if (mode == ComputeUpdate && !computeSupported) {
+        printf("compute shaders need OpenGL 4.3, using the fragment shader\n");
+        mode = FragmentUpdate;
+    }
+    if (mode == updateMode) return;
+    if (updateMode == BarnesHutUpdate) {
+        prevPositions.uploadAsync(GL_RGBA, GL_FLOAT, cpuPrev.data());
+        currPositions.uploadAsync(GL_RGBA, GL_FLOAT, cpuCurr.data());
+    }
+    if (mode == ComputeUpdate) copyTexturesToBodies();
+    if (mode == BarnesHutUpdate) {
+        prevPositions.bind();
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, cpuPrev.data());
+        currPositions.bind();
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, cpuCurr.data());
+        currPositions.unbind();
+        streamBodies();
+    }
+    updateMode = mode;
+}
+
+// Antialiased points for both ways of drawing the bodies
+const char *drawFragmentSource = glsl(
+    uniform vec2 screenSize;
+    in vec4 position;
+    in float pointSize;
+    in vec3 color;
+    out vec4 finalColor;
+    void main() {
+        vec2 screen = (0.5 + 0.5 * position.xy / position.w) * screenSize;
+        float fade = clamp(pointSize * 0.5 - length(screen - gl_FragCoord.xy), 0.0, 1.0);
+        finalColor = vec4(color * fade, 1.0);
+    }
+);
+
 void setup() {
     glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
 
@@ -92,7 +198,42 @@ void setup() {
             }
             nextPosition = 2 * currPosition - prevPosition + acceleration * 0.0000001;
         }
-    )).link();
+    )).linkAsync();
+
+    // The same update using shader storage buffers. Each work group loads a
+    // tile of bodies into shared memory at a time so every body is read from
+    // the buffer once per work group instead of once per invocation.
+    computeSupported = hasVersion(4, 3);
+    if (computeSupported) {
+        computeUpdateShader.computeShader(glsl430(
+            layout(local_size_x = 256) in;
+            layout(std430, binding = 0) readonly buffer PrevBodies { vec4 prevBodies[]; };
+            layout(std430, binding = 1) readonly buffer CurrBodies { vec4 currBodies[]; };
+            layout(std430, binding = 2) writeonly buffer NextBodies { vec4 nextBodies[]; };
+            uniform int count;
+            shared vec4 tile[256];
+            void main() {
+                int index = int(gl_GlobalInvocationID.x);
+                int local = int(gl_LocalInvocationIndex);
+                vec3 currPosition = index < count ? currBodies[index].xyz : vec3(0.0);
+                vec3 acceleration = vec3(0.0);
+                for (int start = 0; start < count; start += 256) {
+                    // Padding past the end has zero mass so it contributes nothing
+                    int other = start + local;
+                    tile[local] = other < count ? vec4(currBodies[other].xyz, 1.0) : vec4(0.0);
+                    barrier();
+                    for (int i = 0; i < 256; i++) {
+                        vec3 dir = tile[i].xyz - currPosition;
+                        acceleration += tile[i].w * dir / pow(dot(dir, dir) + 0.01, 1.5);
+                    }
+                    barrier();
+                }
+                if (index < count) {
+                    nextBodies[index] = vec4(2 * currPosition - prevBodies[index].xyz + acceleration * 0.0000001, 1.0);
+                }
+            }
+        )).linkAsync();
+    }
 
     drawShader.vertexShader(glsl(
         uniform int bufferWidth;
@@ -119,18 +260,23 @@ void setup() {
             float t = length(currPosition - prevPosition);
             color = mix(vec3(0.5, 0.2, 1.0), vec3(1.0, 0.7, 0.2), t * 20.0);
         }
-    )).fragmentShader(glsl(
+    )).fragmentShader(drawFragmentSource).linkAsync();
+
+    streamedDrawShader.vertexShader(glsl(
+        in vec4 body;
+        uniform mat4 matrix;
+        uniform mat4 modelview;
         uniform vec2 screenSize;
-        in vec4 position;
-        in float pointSize;
-        in vec3 color;
-        out vec4 finalColor;
+        out vec4 position;
+        out float pointSize;
+        out vec3 color;
         void main() {
-            vec2 screen = (0.5 + 0.5 * position.xy / position.w) * screenSize;
-            float fade = clamp(pointSize * 0.5 - length(screen - gl_FragCoord.xy), 0.0, 1.0);
-            finalColor = vec4(color * fade, 1.0);
+            vec4 eyeSpace = modelview * vec4(body.xyz, 1.0);
+            position = gl_Position = matrix * vec4(body.xyz, 1.0);
+            pointSize = gl_PointSize = screenSize.y / length(eyeSpace) * 0.1;
+            color = mix(vec3(0.5, 0.2, 1.0), vec3(1.0, 0.7, 0.2), body.w * 20.0);
         }
-    )).link();
+    )).fragmentShader(drawFragmentSource).linkAsync();
 
     accumulationShader.vertexShader(glsl(
         in vec2 vertex;
@@ -146,7 +292,7 @@ void setup() {
         void main() {
             color = vec4(texture(renderTarget, coord).rgb, 0.01);
         }
-    )).link();
+    )).linkAsync();
 
     bokehFirstPass.vertexShader(glsl(
         in vec2 vertex;
@@ -170,7 +316,7 @@ void setup() {
             colorB = (colorA + colorB) / 66.0;
             colorA /= 33.0;
         }
-    )).link();
+    )).linkAsync();
 
     bokehSecondPass.vertexShader(glsl(
         in vec2 vertex;
@@ -193,12 +339,15 @@ void setup() {
             }
             color = pow(color / 99.0, vec4(0.5));
         }
-    )).link();
+    )).linkAsync();
 
     point << vec3();
     point.upload();
     pointLayout.create(drawShader, point).attribute<float>("vertex", 3).check();
 
+    streamedBodies.create(bufferWidth * bufferHeight);
+    streamedLayout.create(streamedDrawShader, streamedBodies).attribute<float>("body", 4).check();
+
     quad << vec2(0, 0) << vec2(1, 0) << vec2(0, 1) << vec2(1, 1);
     quad.upload();
     quadLayout.create(updateShader, quad).attribute<float>("vertex", 2).check();
@@ -219,6 +368,12 @@ void setup() {
     updateShader.uniformInt("currPositions", 1);
     updateShader.unuse();
 
+    if (computeSupported) {
+        computeUpdateShader.use();
+        computeUpdateShader.uniformInt("count", bufferWidth * bufferHeight);
+        computeUpdateShader.unuse();
+    }
+
     bokehSecondPass.use();
     bokehSecondPass.uniformInt("renderTargetA", 0);
     bokehSecondPass.uniformInt("renderTargetB", 1);
@@ -240,16 +395,25 @@ void draw() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glEnable(GL_BLEND);
     glBlendFunc(GL_ONE_MINUS_DST_COLOR, GL_ONE);
-    drawShader.use();
-    drawShader.uniform("screenSize", vec2(width, height));
-    drawShader.uniform("matrix", matrix);
-    drawShader.uniform("modelview", modelview);
-    prevPositions.bind(0);
-    currPositions.bind(1);
-    pointLayout.drawInstanced(currPositions.width * currPositions.height, GL_POINTS);
-    currPositions.unbind(1);
-    prevPositions.unbind(0);
-    drawShader.unuse();
+    if (updateMode == BarnesHutUpdate) {
+        streamedDrawShader.use();
+        streamedDrawShader.uniform("screenSize", vec2(width, height));
+        streamedDrawShader.uniform("matrix", matrix);
+        streamedDrawShader.uniform("modelview", modelview);
+        streamedLayout.draw(GL_POINTS);
+        streamedDrawShader.unuse();
+    } else {
+        drawShader.use();
+        drawShader.uniform("screenSize", vec2(width, height));
+        drawShader.uniform("matrix", matrix);
+        drawShader.uniform("modelview", modelview);
+        prevPositions.bind(0);
+        currPositions.bind(1);
+        pointLayout.drawInstanced(currPositions.width * currPositions.height, GL_POINTS);
+        currPositions.unbind(1);
+        prevPositions.unbind(0);
+        drawShader.unuse();
+    }
     glDisable(GL_BLEND);
 
     if (postProcess) {
@@ -294,7 +458,7 @@ void draw() {
         }
     }
 
-    glutSwapBuffers();
+    if (!headless.context) glutSwapBuffers();
 }
 
 // For calculating mouse deltas
@@ -320,10 +484,48 @@ void keydown(unsigned char key, int, int) {
     if (key == 'r' || key == 'R') reset();
     if (key == 'p' || key == 'P') paused = !paused;
     if (key == 'o' || key == 'O') postProcess = (PostProcess)((postProcess + 1) % PostProcessCount);
+    if (key == 'c' || key == 'C') setUpdateMode(updateMode == ComputeUpdate ? FragmentUpdate : ComputeUpdate);
+    if (key == 'b' || key == 'B') setUpdateMode(updateMode == BarnesHutUpdate ? FragmentUpdate : BarnesHutUpdate);
+}
+
+void updateWithCompute() {
+    Buffer<vec4> &prevBodies = bodies[bodyIndex];
+    Buffer<vec4> &currBodies = bodies[(bodyIndex + 1) % 3];
+    Buffer<vec4> &nextBodies = bodies[(bodyIndex + 2) % 3];
+    int count = bufferWidth * bufferHeight;
+
+    computeUpdateShader.use();
+    prevBodies.bindBase(0);
+    currBodies.bindBase(1);
+    nextBodies.bindBase(2);
+    computeUpdateShader.dispatch((count + tileSize - 1) / tileSize);
+    computeUpdateShader.unuse();
+
+    // The next step reads nextBodies as a storage buffer, and the texture
+    // update below reads it as a pixel buffer
+    memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_PIXEL_BUFFER_BARRIER_BIT);
+
+    prevPositions.swapWith(currPositions);
+    glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, nextBodies.id);
+    currPositions.update(0, 0, 0, bufferWidth, bufferHeight, 1, NULL);
+    glState.bindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    bodyIndex = (bodyIndex + 1) % 3;
+}
+
+void updateWithBarnesHut() {
+    solver.step(cpuPrev.data(), cpuCurr.data(), cpuNext.data(), cpuCurr.size());
+    cpuPrev.swap(cpuCurr);
+    cpuCurr.swap(cpuNext);
+    streamBodies();
 }
 
 void update() {
-    if (!paused) {
+    if (!paused && updateMode == ComputeUpdate) {
+        updateWithCompute();
+    } else if (!paused && updateMode == BarnesHutUpdate) {
+        updateWithBarnesHut();
+    } else if (!paused) {
         fbo.attachColor(nextPositions).check();
 
         fbo.bind();
@@ -346,11 +548,11 @@ void update() {
 void resize(int w, int h) {
     width = w;
     height = h;
-    glViewport(0, 0, w, h);
-    renderTarget.create(width, height, 1, GL_RGBA, GL_RGBA, GL_UNSIGNED_INT, GL_NEAREST, GL_CLAMP_TO_EDGE);
-    accumulationTexture.create(width, height, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
-    bokehScratchA.create(width, height, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
-    bokehScratchB.create(width, height, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    glState.setViewport(0, 0, w, h);
+    renderTarget.allocate(width, height, 1, GL_RGBA, GL_RGBA, GL_UNSIGNED_INT, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    accumulationTexture.allocate(width, height, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    bokehScratchA.allocate(width, height, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    bokehScratchB.allocate(width, height, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
 
     fbo.attachColor(accumulationTexture).check();
     fbo.bind();
@@ -358,7 +560,113 @@ void resize(int w, int h) {
     fbo.unbind();
 }
 
+// The acceleration on body from every body, in double precision
+vec3 directSum(const std::vector<vec4> &positions, int body) {
+    double x = 0, y = 0, z = 0;
+    const vec4 &p = positions[body];
+    for (size_t i = 0; i < positions.size(); i++) {
+        double dx = positions[i].x - p.x, dy = positions[i].y - p.y, dz = positions[i].z - p.z;
+        double scale = 1 / pow(dx * dx + dy * dy + dz * dz + BarnesHut::softening(), 1.5);
+        x += dx * scale;
+        y += dy * scale;
+        z += dz * scale;
+    }
+    return vec3(x, y, z);
+}
+
+// Time the direct sum shaders and Barnes-Hut at several opening angles, and
+// measure the Barnes-Hut error against an exact direct sum for a sample of
+// the bodies
+void benchmark() {
+    int count = bufferWidth * bufferHeight;
+    printf("%d bodies, %d threads\n", count, threadCount());
+
+    const char *names[2] = { "fragment shader", "compute shader" };
+    for (int mode = FragmentUpdate; mode <= ComputeUpdate; mode++) {
+        if (mode == ComputeUpdate && !computeSupported) continue;
+        setUpdateMode(Update(mode));
+        headless.run(update, 1);
+        double seconds = headless.run(update, 3) / 3;
+        printf("%s direct sum: %.3f ms/step (%.3g interactions/sec)\n", names[mode], seconds * 1000, (double)count * count / seconds);
+    }
+
+    // The error of each sampled body relative to its exact acceleration
+    reset();
+    const int samples = std::min(count, 1000);
+    std::vector<vec3> exact(samples);
+    parallelFor(0, samples, 1, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) exact[i] = directSum(cpuCurr, (long long)i * count / samples);
+    });
+
+    printf("%8s %10s %10s %12s %12s %12s\n", "theta", "build ms", "walk ms", "steps/sec", "rms error", "max error");
+    float thetas[] = { 0.25, 0.5, 0.75, 1.0 };
+    for (size_t t = 0; t < sizeof(thetas) / sizeof(*thetas); t++) {
+        solver.theta = thetas[t];
+        double build = 1e9, walk = 1e9;
+        for (int i = 0; i < 3; i++) {
+            solver.step(cpuPrev.data(), cpuCurr.data(), cpuNext.data(), count);
+            build = std::min(build, solver.buildSeconds);
+            walk = std::min(walk, solver.walkSeconds);
+        }
+
+        double sumSquared = 0, worst = 0;
+        for (int i = 0; i < samples; i++) {
+            const vec4 &p = cpuCurr[(long long)i * count / samples];
+            vec3 error = solver.acceleration(vec3(p.x, p.y, p.z)) - exact[i];
+            double relative = length(error) / std::max(length(exact[i]), 1.0e-20f);
+            sumSquared += relative * relative;
+            worst = std::max(worst, relative);
+        }
+        printf("%8.2f %10.3f %10.3f %12.2f %12.3g %12.3g\n", thetas[t], build * 1000, walk * 1000,
+            1 / (build + walk), sqrt(sumSquared / samples), worst);
+    }
+}
+
 int main(int argc, char *argv[]) {
+    int headlessSteps = 0;
+    bool benchmarkMode = false;
+    Update startMode = FragmentUpdate;
+    for (int i = 1; i < argc; i++) {
+        // Run a fixed number of steps without a window using "--headless <steps>"
+        if (!strcmp(argv[i], "--headless") && i + 1 < argc) headlessSteps = atoi(argv[++i]);
+
+        // Simulate size * size bodies instead of 128 * 128
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc) bufferWidth = bufferHeight = std::max(1, atoi(argv[++i]));
+
+        // Start with the compute shader update instead of the fragment shader
+        else if (!strcmp(argv[i], "--compute")) startMode = ComputeUpdate;
+
+        // Start with the Barnes-Hut update on the CPU
+        else if (!strcmp(argv[i], "--barnes-hut")) startMode = BarnesHutUpdate;
+
+        // The Barnes-Hut opening angle, smaller is more accurate
+        else if (!strcmp(argv[i], "--theta") && i + 1 < argc) solver.theta = atof(argv[++i]);
+
+        // Use this many threads for the CPU work instead of one per core
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) setThreadCount(atoi(argv[++i]));
+
+        // Compare Barnes-Hut against the direct sum and exit
+        else if (!strcmp(argv[i], "--benchmark")) benchmarkMode = true;
+    }
+
+    if (benchmarkMode) {
+        headless.create(width, height);
+        setup();
+        resize(width, height);
+        benchmark();
+        return 0;
+    }
+
+    if (headlessSteps) {
+        headless.create(width, height);
+        setup();
+        resize(width, height);
+        setUpdateMode(startMode);
+        double seconds = headless.run(update, headlessSteps);
+        printf("%d steps in %.3f seconds (%.1f steps/sec)\n", headlessSteps, seconds, headlessSteps / seconds);
+        return 0;
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutCreateWindow("Example");
@@ -371,6 +679,7 @@ int main(int argc, char *argv[]) {
     glutIdleFunc(update);
     setup();
     resize(width, height);
+    setUpdateMode(startMode);
     glutMainLoop();
     return 0;
 }
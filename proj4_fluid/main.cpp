@@ -1,15 +1,39 @@
 #include <GL/glut.h>
+#include <ctype.h>
+#include <string.h>
 #include "gl4.h"
+#include "sph.h"
 
-const int bufferWidth = 128;
-const int bufferHeight = 128;
-const vec3 gridSize = vec3(0.5);
+HeadlessContext headless;
+
+int bufferWidth = 128;
+int bufferHeight = 128;
+vec3 gridSize = vec3(0.5);
+
+// The grid cells are as wide as maxRadius in the update shaders, so every
+// neighbor of a particle is in one of the 27 cells around it
+const float cellSize = 0.01;
+
+enum Update {
+    PairsUpdate,
+    GridUpdate,
+    CPUUpdate
+};
 
 bool paused = false;
+bool gridSupported = false;
+Update updateMode = PairsUpdate;
 float accumulation = 0;
 float width = 800, height = 600;
 float angleX = -45, angleY = 45, zoomZ = length(gridSize) * 1.5;
 
+// Simulate size * size particles in a box that grows to keep the same density
+void setSize(int size) {
+    bufferWidth = bufferHeight = size;
+    gridSize = vec3(0.5 * cbrtf(bufferWidth * bufferHeight / (128.0 * 128.0)));
+    zoomZ = length(gridSize) * 1.5;
+}
+
 Buffer<vec3> point;
 Buffer<vec2> quad;
 VAO pointLayout;
@@ -17,12 +41,46 @@ VAO quadLayout;
 
 Shader updateShader;
 Shader drawShader;
+
+// Camera constants for drawShader, uploaded once per frame
+struct Camera {
+    mat4 projection;
+    mat4 modelview;
+    vec2 screenSize;
+    float padding[2];
+};
+std140Offset(Camera, modelview, 64);
+std140Offset(Camera, screenSize, 128);
+
+UniformBlock<Camera> camera;
+
+// The grid update sorts the particles by grid cell every step, finds where
+// each cell starts and ends in the sorted order, and then only visits the
+// particles in neighboring cells
+Shader hashShader;
+Shader sortBlocksShader;
+Shader sortMergeShader;
+Shader cellRangesShader;
+Shader gridUpdateShader;
+Buffer<unsigned int> particleKeys;
+Buffer<int> cellStart;
+Buffer<int> cellEnd;
+Buffer<vec4> sortedPrevPositions;
+Buffer<vec4> sortedCurrPositions;
+int cells[3];
+int sortCount;
+
+// The same update on the CPU
+SPH sph;
 FBO bufferFBO;
 FBO screenFBO;
 
 Texture prevPositions;
 Texture currPositions;
 Texture nextPositions;
+Readback positionReadback;
+char pendingKey;
+const char *tracePath;
 
 Texture positionDiffuseTexture;
 Texture normalTexture;
@@ -45,7 +103,8 @@ enum Scene {
     SceneCount
 };
 
-void reset(Scene scene) {
+// The starting positions of the particles in a scene
+std::vector<vec4> scenePoints(Scene scene) {
     std::vector<vec4> points;
     for (int i = 0; i < bufferWidth * bufferHeight; i++) {
         vec4 point;
@@ -68,221 +127,555 @@ void reset(Scene scene) {
             point = vec4(frand() * 0.5, frand() * 0.1 + 0.9, frand() * 0.5, 0);
             break;
         default:
-            return;
+            return points;
         }
         point = point * vec4(gridSize, 1);
         point.w = 10000000;
         points.push_back(point);
     }
+    return points;
+}
 
-    prevPositions.create(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
-    currPositions.create(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
-    nextPositions.create(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+void reset(Scene scene) {
+    std::vector<vec4> points = scenePoints(scene);
+    if (points.empty()) return;
+    prevPositions.allocate(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+    currPositions.allocate(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+    nextPositions.allocate(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, points.data());
+    sph.collideWithObjects = scene == Top;
+    if (updateMode == CPUUpdate) sph.setPositions(points.data(), points.data(), points.size());
 
     updateShader.use();
     updateShader.uniformInt("collideWithObjects", scene == Top);
     updateShader.unuse();
+    if (gridSupported) {
+        gridUpdateShader.use();
+        gridUpdateShader.uniformInt("collideWithObjects", scene == Top);
+        gridUpdateShader.unuse();
+    }
 
     accumulation = 0;
 }
 
-void setup() {
-    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+// The block that struct Camera is uploaded to, for the draw shaders
+const char *cameraBlock = glslSource(
+    layout(std140, row_major) uniform Camera {
+        mat4 projection;
+        mat4 modelview;
+        vec2 screenSize;
+    };
+);
 
-    updateShader.vertexShader(glsl(
-        in vec2 vertex;
-        out vec2 coord;
-        void main() {
-            coord = vertex;
-            gl_Position = vec4(vertex * 2.0 - 1.0, 0.0, 1.0);
-        }
-    )).fragmentShader(glsl(
-        precision highp float;
-        uniform bool collideWithObjects;
-        uniform vec3 gridSize;
-        uniform sampler2D prevPositions;
-        uniform sampler2D currPositions;
-        uniform int bufferWidth;
-        uniform int bufferHeight;
-        in vec2 coord;
-        out vec4 nextPosition;
+// The SPH constants, smoothing kernels, and collision handling shared by the
+// brute force and grid update shaders. Sums collects the contributions of the
+// neighbors of a particle and integrate() turns them into its next position.
+const char *sphSource = glslSource(
+    uniform bool collideWithObjects;
+    uniform vec3 gridSize;
 
-        const float pi = 3.14159265;
+    const float pi = 3.14159265;
 
-        // The mass of an individual particle (affects mass density)
-        const float particleMass = 1.0;
+    // The mass of an individual particle (affects mass density)
+    const float particleMass = 1.0;
 
-        // Particles will only affect other particles up to this distance
-        const float maxRadius = 0.01;
+    // Particles will only affect other particles up to this distance
+    const float maxRadius = 0.01;
 
-        // Controls how viscous the fluid is
-        const float viscosityCoefficient = 10.0;
+    // Controls how viscous the fluid is
+    const float viscosityCoefficient = 10.0;
 
-        // A gas constant that depends on the temperature
-        const float pressureConstant = 5.0e-6;
+    // A gas constant that depends on the temperature
+    const float pressureConstant = 5.0e-6;
 
-        // Rest density is a fake constant introduced by SPH for numerical stability
-        const float restDensity = 1.0e-3;
+    // Rest density is a fake constant introduced by SPH for numerical stability
+    const float restDensity = 1.0e-3;
 
-        // The initial downward acceleration
-        const float gravity = 9.8e-5;
+    // The initial downward acceleration
+    const float gravity = 9.8e-5;
 
-        // Controls for surface tension
-        const float surfaceTensionConstant = 2.0e-2;
-        const float normalThreshold = 1000.0;
+    // Controls for surface tension
+    const float surfaceTensionConstant = 2.0e-2;
+    const float normalThreshold = 1000.0;
+
+    // Assumes 0 <= radius <= maxRadius
+    float massDensityKernel(float radius) {
+        return 315.0 / (64.0 * pi * pow(maxRadius, 9.0)) * pow(pow(maxRadius, 2.0) - pow(radius, 2.0), 3.0);
+    }
+    float pressureKernel(float radius) {
+        return -45.0 / (pi * pow(maxRadius, 6.0)) * pow(maxRadius - radius, 2.0);
+    }
+    float viscosityKernel(float radius) {
+        return 45.0 / (pi * pow(maxRadius, 6.0)) * (maxRadius - radius);
+    }
+    float normalKernel(float radius) {
+        return -945.0 / (32.0 * pi * pow(maxRadius, 9.0)) * radius * pow(pow(maxRadius, 2.0) - pow(radius, 2.0), 2.0);
+    }
+    float surfaceTensionKernel(float radius) {
+        return -945.0 / (32.0 * pi * pow(maxRadius, 9.0)) * (pow(maxRadius, 2.0) - pow(radius, 2.0)) * (3.0 * pow(maxRadius, 2.0) - 7.0 * pow(radius, 2.0));
+    }
 
-        // Assumes 0 <= radius <= maxRadius
-        float massDensityKernel(float radius) {
-            return 315.0 / (64.0 * pi * pow(maxRadius, 9.0)) * pow(pow(maxRadius, 2.0) - pow(radius, 2.0), 3.0);
+    // Define the environment
+    const float elasticity = 0.5;
+
+    vec3 pushOutOfCylinder(vec3 oldPoint, vec3 newPoint, vec3 center, float radius, float height) {
+        if (newPoint.y >= center.y && newPoint.y <= center.y + height) {
+            vec2 delta = newPoint.xz - center.xz;
+            if (length(delta) <= radius) {
+                if (oldPoint.y <= center.y) {
+                    newPoint.y = min(center.y, oldPoint.y - abs(newPoint.y - oldPoint.y) * elasticity);
+                } else if (oldPoint.y >= center.y + height) {
+                    newPoint.y = max(center.y + height, oldPoint.y + abs(newPoint.y - oldPoint.y) * elasticity);
+                } else {
+                    vec3 normal = normalize(vec3(delta, 0.0).xzy);
+                    newPoint = oldPoint + reflect(newPoint - oldPoint, normal) * elasticity;
+                    newPoint.xz = center.xz + normal.xz * radius;
+                }
+            }
         }
-        float pressureKernel(float radius) {
-            return -45.0 / (pi * pow(maxRadius, 6.0)) * pow(maxRadius - radius, 2.0);
+        return newPoint;
+    }
+
+    vec3 pushOutOfBox(vec3 oldPoint, vec3 newPoint, vec3 minCoord, vec3 maxCoord) {
+        vec3 clamped = clamp(newPoint, minCoord, maxCoord);
+        if (clamped == newPoint) {
+            vec3 delta = (oldPoint - minCoord) / (maxCoord - minCoord) - 0.5;
+            vec3 choice = abs(delta);
+            float largest = max(max(choice.x, choice.y), choice.z);
+            if (choice.x == largest) {
+                newPoint.x = oldPoint.x + (oldPoint.x - newPoint.x) * elasticity;
+                newPoint.x = (delta.x > 0) ? max(newPoint.x, maxCoord.x) : min(newPoint.x, minCoord.x);
+            } else if (choice.y == largest) {
+                newPoint.y = oldPoint.y + (oldPoint.y - newPoint.y) * elasticity;
+                newPoint.y = (delta.y > 0) ? max(newPoint.y, maxCoord.y) : min(newPoint.y, minCoord.y);
+            } else {
+                newPoint.z = oldPoint.z + (oldPoint.z - newPoint.z) * elasticity;
+                newPoint.z = (delta.z > 0) ? max(newPoint.z, maxCoord.z) : min(newPoint.z, minCoord.z);
+            }
         }
-        float viscosityKernel(float radius) {
-            return 45.0 / (pi * pow(maxRadius, 6.0)) * (maxRadius - radius);
+        return newPoint;
+    }
+
+    struct Sums {
+        float massDensity;
+        float surfaceTensionMagnitude;
+        vec3 normal;
+        vec3 pressureForce;
+        vec3 viscosityForce;
+    };
+
+    // Assumes length(currPairPosition.xyz - currPosition.xyz) < maxRadius
+    void addPair(inout Sums sums, vec4 prevPosition, vec4 currPosition, vec4 prevPairPosition, vec4 currPairPosition) {
+        vec3 delta = currPairPosition.xyz - currPosition.xyz;
+        float distance = length(delta);
+        sums.massDensity += particleMass * massDensityKernel(distance);
+        if (currPosition != currPairPosition) {
+            vec3 unitDelta = delta / (distance + 0.000000001);
+            float scale = particleMass / currPairPosition.w;
+
+            // Compute pressure
+            float meanPressure = pressureConstant * (currPosition.w + currPairPosition.w - 2.0 * restDensity) / 2.0;
+            sums.pressureForce += scale * meanPressure * unitDelta * pressureKernel(distance);
+
+            // Compute viscosity
+            vec3 velocityDelta = currPairPosition.xyz - prevPairPosition.xyz - currPosition.xyz + prevPosition.xyz;
+            sums.viscosityForce += scale * viscosityCoefficient * velocityDelta * viscosityKernel(distance);
+
+            // Compute surface tension
+            sums.normal += scale * unitDelta * normalKernel(distance);
+            sums.surfaceTensionMagnitude += scale * surfaceTensionKernel(distance);
         }
-        float normalKernel(float radius) {
-            return -945.0 / (32.0 * pi * pow(maxRadius, 9.0)) * radius * pow(pow(maxRadius, 2.0) - pow(radius, 2.0), 2.0);
+    }
+
+    // Format is (x, y, z, massDensity)
+    vec4 integrate(Sums sums, vec4 prevPosition, vec4 currPosition) {
+        // Acceleration is initially due to gravity
+        vec3 force = vec3(0.0, -currPosition.w * gravity, 0.0);
+        force += sums.pressureForce;
+        force += sums.viscosityForce;
+        if (dot(sums.normal, sums.normal) > normalThreshold) {
+            force -= surfaceTensionConstant * sums.surfaceTensionMagnitude * normalize(sums.normal);
         }
-        float surfaceTensionKernel(float radius) {
-            return -945.0 / (32.0 * pi * pow(maxRadius, 9.0)) * (pow(maxRadius, 2.0) - pow(radius, 2.0)) * (3.0 * pow(maxRadius, 2.0) - 7.0 * pow(radius, 2.0));
+
+        // Move the point by the velocity. Division by zero (massDensity) is
+        // avoided since the neighbors always include the particle itself.
+        vec4 nextPosition;
+        nextPosition.xyz = 2 * currPosition.xyz - prevPosition.xyz + force / sums.massDensity;
+        nextPosition.w = sums.massDensity;
+
+        // Start off with the new position
+        vec3 oldPosition = currPosition.xyz / gridSize;
+        vec3 newPosition = nextPosition.xyz / gridSize;
+        vec3 velocity = newPosition - oldPosition;
+
+        // Bounce off the walls of the box
+        vec3 clamped = clamp(newPosition, 0.0, 1.0);
+        if (clamped.x != newPosition.x) velocity.x = -velocity.x * elasticity;
+        if (clamped.y != newPosition.y) velocity.y = -velocity.y * elasticity;
+        if (clamped.z != newPosition.z) velocity.z = -velocity.z * elasticity;
+
+        // Update the velocity
+        newPosition = oldPosition + velocity;
+
+        // Make sure we stay outside the objects in the box
+        if (collideWithObjects) {
+            newPosition = pushOutOfCylinder(oldPosition, newPosition, vec3(0.5, -1, 0.5), 0.25, 3);
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.8, 0.5), vec3(0.5, 1, 2));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.7, -1), vec3(0.5, 0.9, 0.5));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.6, -1), vec3(2, 0.8, 0.5));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.5, 0.5), vec3(2, 0.7, 2));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.4, 0.5), vec3(0.5, 0.6, 2));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.3, -1), vec3(0.5, 0.5, 0.5));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.2, -1), vec3(2, 0.4, 0.5));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, -1, 0.5), vec3(2, 0.3, 2));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, -1, 0.5), vec3(0.5, 0.2, 2));
+            newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, -1, -1), vec3(0.5, 0.1, 0.5));
         }
 
-        // Define the environment
-        const float elasticity = 0.5;
+        // Make sure we stay inside the box
+        nextPosition.xyz = clamp(newPosition, 0.0, 1.0) * gridSize;
+        return nextPosition;
+    }
+);
+
+// Each work group handles 256 keys, which must match local_size_x below
+const int sortBlockSize = 256;
 
-        vec3 pushOutOfCylinder(vec3 oldPoint, vec3 newPoint, vec3 center, float radius, float height) {
-            if (newPoint.y >= center.y && newPoint.y <= center.y + height) {
-                vec2 delta = newPoint.xz - center.xz;
-                if (length(delta) <= radius) {
-                    if (oldPoint.y <= center.y) {
-                        newPoint.y = min(center.y, oldPoint.y - abs(newPoint.y - oldPoint.y) * elasticity);
-                    } else if (oldPoint.y >= center.y + height) {
-                        newPoint.y = max(center.y + height, oldPoint.y + abs(newPoint.y - oldPoint.y) * elasticity);
-                    } else {
-                        vec3 normal = normalize(vec3(delta, 0.0).xzy);
-                        newPoint = oldPoint + reflect(newPoint - oldPoint, normal) * elasticity;
-                        newPoint.xz = center.xz + normal.xz * radius;
+void setupGrid() {
+    // The key of a particle is (cell, particle index). Keys past the end
+    // sort last.
+    hashShader.computeShader(glsl430(
+        layout(local_size_x = 256) in;
+        layout(std430, binding = 0) writeonly buffer Keys { uvec2 keys[]; };
+        uniform sampler2D currPositions;
+        uniform int bufferWidth;
+        uniform int count;
+        uniform ivec3 cells;
+        uniform float cellSize;
+        void main() {
+            int index = int(gl_GlobalInvocationID.x);
+            uint cell = 0xFFFFFFFFu;
+            if (index < count) {
+                vec3 position = texelFetch(currPositions, ivec2(index % bufferWidth, index / bufferWidth), 0).xyz;
+                ivec3 coord = clamp(ivec3(position / cellSize), ivec3(0), cells - 1);
+                cell = uint((coord.z * cells.y + coord.y) * cells.x + coord.x);
+            }
+            keys[index] = uvec2(cell, uint(index));
+        }
+    )).linkAsync();
+
+    // Bitonic sort steps that stay within a block of 256 keys are done in
+    // shared memory. With stage == 0 this sorts each block from scratch,
+    // otherwise it finishes the merge of the given stage.
+    sortBlocksShader.computeShader(glsl430(
+        layout(local_size_x = 256) in;
+        layout(std430, binding = 0) buffer Keys { uvec2 keys[]; };
+        uniform int stage;
+        shared uvec2 block[256];
+        void compareAndSwap(int local, int distance, int size) {
+            int partner = local ^ distance;
+            if (partner > local) {
+                bool ascending = ((int(gl_WorkGroupID.x) * 256 + local) & size) == 0;
+                uvec2 a = block[local];
+                uvec2 b = block[partner];
+                if ((a.x > b.x) == ascending) {
+                    block[local] = b;
+                    block[partner] = a;
+                }
+            }
+        }
+        void main() {
+            int local = int(gl_LocalInvocationIndex);
+            block[local] = keys[gl_GlobalInvocationID.x];
+            barrier();
+            if (stage == 0) {
+                for (int size = 2; size <= 256; size *= 2) {
+                    for (int distance = size / 2; distance > 0; distance /= 2) {
+                        compareAndSwap(local, distance, size);
+                        barrier();
                     }
                 }
+            } else {
+                for (int distance = 128; distance > 0; distance /= 2) {
+                    compareAndSwap(local, distance, stage);
+                    barrier();
+                }
             }
-            return newPoint;
-        }
-
-        vec3 pushOutOfBox(vec3 oldPoint, vec3 newPoint, vec3 minCoord, vec3 maxCoord) {
-            vec3 clamped = clamp(newPoint, minCoord, maxCoord);
-            if (clamped == newPoint) {
-                vec3 delta = (oldPoint - minCoord) / (maxCoord - minCoord) - 0.5;
-                vec3 choice = abs(delta);
-                float largest = max(max(choice.x, choice.y), choice.z);
-                if (choice.x == largest) {
-                    newPoint.x = oldPoint.x + (oldPoint.x - newPoint.x) * elasticity;
-                    newPoint.x = (delta.x > 0) ? max(newPoint.x, maxCoord.x) : min(newPoint.x, minCoord.x);
-                } else if (choice.y == largest) {
-                    newPoint.y = oldPoint.y + (oldPoint.y - newPoint.y) * elasticity;
-                    newPoint.y = (delta.y > 0) ? max(newPoint.y, maxCoord.y) : min(newPoint.y, minCoord.y);
-                } else {
-                    newPoint.z = oldPoint.z + (oldPoint.z - newPoint.z) * elasticity;
-                    newPoint.z = (delta.z > 0) ? max(newPoint.z, maxCoord.z) : min(newPoint.z, minCoord.z);
+            keys[gl_GlobalInvocationID.x] = block[local];
+        }
+    )).linkAsync();
+
+    // A single bitonic sort step between keys at least 256 apart
+    sortMergeShader.computeShader(glsl430(
+        layout(local_size_x = 256) in;
+        layout(std430, binding = 0) buffer Keys { uvec2 keys[]; };
+        uniform int stage;
+        uniform int distance;
+        void main() {
+            int index = int(gl_GlobalInvocationID.x);
+            int partner = index ^ distance;
+            if (partner > index) {
+                bool ascending = (index & stage) == 0;
+                uvec2 a = keys[index];
+                uvec2 b = keys[partner];
+                if ((a.x > b.x) == ascending) {
+                    keys[index] = b;
+                    keys[partner] = a;
                 }
             }
-            return newPoint;
         }
+    )).linkAsync();
+
+    // Record where each cell starts and ends in the sorted keys and copy the
+    // particles into sorted order so neighbors are next to each other in memory
+    cellRangesShader.computeShader(glsl430(
+        layout(local_size_x = 256) in;
+        layout(std430, binding = 0) readonly buffer Keys { uvec2 keys[]; };
+        layout(std430, binding = 1) writeonly buffer CellStart { int cellStart[]; };
+        layout(std430, binding = 2) writeonly buffer CellEnd { int cellEnd[]; };
+        layout(std430, binding = 3) writeonly buffer SortedPrevPositions { vec4 sortedPrevPositions[]; };
+        layout(std430, binding = 4) writeonly buffer SortedCurrPositions { vec4 sortedCurrPositions[]; };
+        uniform sampler2D prevPositions;
+        uniform sampler2D currPositions;
+        uniform int bufferWidth;
+        uniform int count;
+        void main() {
+            int index = int(gl_GlobalInvocationID.x);
+            if (index >= count) return;
+            uint cell = keys[index].x;
+            if (index == 0 || keys[index - 1].x != cell) cellStart[cell] = index;
+            if (index == count - 1 || keys[index + 1].x != cell) cellEnd[cell] = index + 1;
+            int particle = int(keys[index].y);
+            ivec2 coord = ivec2(particle % bufferWidth, particle / bufferWidth);
+            sortedPrevPositions[index] = texelFetch(prevPositions, coord, 0);
+            sortedCurrPositions[index] = texelFetch(currPositions, coord, 0);
+        }
+    )).linkAsync();
+
+    gridUpdateShader.computeShader((std::string("#version 430\n") + sphSource + glslSource(
+        layout(local_size_x = 256) in;
+        layout(std430, binding = 0) readonly buffer Keys { uvec2 keys[]; };
+        layout(std430, binding = 1) readonly buffer CellStart { int cellStart[]; };
+        layout(std430, binding = 2) readonly buffer CellEnd { int cellEnd[]; };
+        layout(std430, binding = 3) readonly buffer SortedPrevPositions { vec4 sortedPrevPositions[]; };
+        layout(std430, binding = 4) readonly buffer SortedCurrPositions { vec4 sortedCurrPositions[]; };
+        layout(rgba32f, binding = 0) writeonly uniform image2D nextPositions;
+        uniform int bufferWidth;
+        uniform int count;
+        uniform ivec3 cells;
+        uniform float cellSize;
+        void main() {
+            int index = int(gl_GlobalInvocationID.x);
+            if (index >= count) return;
+            vec4 prevPosition = sortedPrevPositions[index];
+            vec4 currPosition = sortedCurrPositions[index];
+
+            // Calculate contributions from the particles in neighboring cells
+            Sums sums = Sums(0.0, 0.0, vec3(0.0), vec3(0.0), vec3(0.0));
+            ivec3 center = clamp(ivec3(currPosition.xyz / cellSize), ivec3(0), cells - 1);
+            ivec3 low = max(center - 1, ivec3(0));
+            ivec3 high = min(center + 1, cells - 1);
+            for (int z = low.z; z <= high.z; z++) {
+                for (int y = low.y; y <= high.y; y++) {
+                    int row = (z * cells.y + y) * cells.x;
+                    for (int x = low.x; x <= high.x; x++) {
+                        int start = cellStart[row + x];
+                        if (start < 0) continue;
+                        int end = cellEnd[row + x];
+                        for (int pair = start; pair < end; pair++) {
+                            vec4 currPairPosition = sortedCurrPositions[pair];
+                            if (length(currPairPosition.xyz - currPosition.xyz) < maxRadius) {
+                                addPair(sums, prevPosition, currPosition, sortedPrevPositions[pair], currPairPosition);
+                            }
+                        }
+                    }
+                }
+            }
+
+            int particle = int(keys[index].y);
+            imageStore(nextPositions, ivec2(particle % bufferWidth, particle / bufferWidth), integrate(sums, prevPosition, currPosition));
+        }
+    )).c_str()).linkAsync();
+}
+
+// Size the grid buffers for the current particle count and grid size
+void resizeGrid() {
+    int count = bufferWidth * bufferHeight;
+    for (int i = 0; i < 3; i++) cells[i] = std::max(1, (int)ceilf(gridSize.xyz[i] / cellSize));
+    for (sortCount = sortBlockSize; sortCount < count; sortCount *= 2) {}
+
+    particleKeys.data.resize(sortCount * 2);
+    particleKeys.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+    cellStart.data.resize(cells[0] * cells[1] * cells[2]);
+    cellStart.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+    cellEnd.data.resize(cellStart.size());
+    cellEnd.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+    sortedPrevPositions.data.resize(count);
+    sortedPrevPositions.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+    sortedCurrPositions.data.resize(count);
+    sortedCurrPositions.upload(GL_SHADER_STORAGE_BUFFER, GL_DYNAMIC_COPY);
+
+    Shader *shaders[3] = { &hashShader, &cellRangesShader, &gridUpdateShader };
+    for (int i = 0; i < 3; i++) {
+        shaders[i]->use();
+        shaders[i]->uniformInt("bufferWidth", bufferWidth);
+        shaders[i]->uniformInt("count", count);
+        shaders[i]->unuse();
+    }
+    hashShader.use();
+    hashShader.uniformInt("currPositions", 1);
+    glUniform3i(hashShader.uniform("cells"), cells[0], cells[1], cells[2]);
+    hashShader.uniformFloat("cellSize", cellSize);
+    hashShader.unuse();
+    cellRangesShader.use();
+    cellRangesShader.uniformInt("prevPositions", 0);
+    cellRangesShader.uniformInt("currPositions", 1);
+    cellRangesShader.unuse();
+    gridUpdateShader.use();
+    gridUpdateShader.uniform("gridSize", gridSize);
+    glUniform3i(gridUpdateShader.uniform("cells"), cells[0], cells[1], cells[2]);
+    gridUpdateShader.uniformFloat("cellSize", cellSize);
+    gridUpdateShader.unuse();
+}
+
+void updateWithGrid() {
+    int count = bufferWidth * bufferHeight;
+    int sortGroups = sortCount / sortBlockSize;
+    int groups = (count + sortBlockSize - 1) / sortBlockSize;
+    prevPositions.bind(0);
+    currPositions.bind(1);
+    particleKeys.bindBase(0);
+
+    {
+        GL4_PROFILE("hash");
+        hashShader.use();
+        hashShader.dispatch(sortGroups);
+        memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    {
+        GL4_PROFILE("sort");
+        sortBlocksShader.use();
+        sortBlocksShader.uniformInt("stage", 0);
+        sortBlocksShader.dispatch(sortGroups);
+        memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        for (int stage = sortBlockSize * 2; stage <= sortCount; stage *= 2) {
+            sortMergeShader.use();
+            sortMergeShader.uniformInt("stage", stage);
+            for (int distance = stage / 2; distance >= sortBlockSize; distance /= 2) {
+                sortMergeShader.uniformInt("distance", distance);
+                sortMergeShader.dispatch(sortGroups);
+                memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            }
+            sortBlocksShader.use();
+            sortBlocksShader.uniformInt("stage", stage);
+            sortBlocksShader.dispatch(sortGroups);
+            memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        }
+    }
+
+    {
+        GL4_PROFILE("cells");
+        int empty = -1;
+        cellStart.bind();
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32I, GL_RED_INTEGER, GL_INT, &empty);
+        cellStart.bindBase(1);
+        cellEnd.bindBase(2);
+        sortedPrevPositions.bindBase(3);
+        sortedCurrPositions.bindBase(4);
+        cellRangesShader.use();
+        cellRangesShader.dispatch(groups);
+        memoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    }
+
+    {
+        GL4_PROFILE("forces");
+        gridUpdateShader.use();
+        nextPositions.bindImage(0, GL_WRITE_ONLY);
+        gridUpdateShader.dispatch(groups);
+        gridUpdateShader.unuse();
+        memoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+    }
+
+    currPositions.unbind(1);
+    prevPositions.unbind(0);
+}
+
+void updateWithCPU() {
+    sph.step();
+    std::vector<vec4> data(sph.count);
+    sph.getPositions(NULL, data.data());
+    prevPositions.swapWith(currPositions);
+    currPositions.uploadAsync(GL_RGBA, GL_FLOAT, data.data());
+}
+
+void readPositions(Texture &texture, std::vector<vec4> &data) {
+    data.resize(texture.width * texture.height);
+    texture.bind();
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, data.data());
+    texture.unbind();
+}
+
+// Copy the positions out of the textures when switching to the CPU, since
+// the other updates only keep them on the GPU
+void setUpdateMode(Update mode) {
+    if (mode == GridUpdate && !gridSupported) {
+        printf("the grid update needs OpenGL 4.3\n");
+        return;
+    }
+    if (mode == CPUUpdate && updateMode != CPUUpdate) {
+        std::vector<vec4> prev, curr;
+        readPositions(prevPositions, prev);
+        readPositions(currPositions, curr);
+        sph.setPositions(prev.data(), curr.data(), curr.size());
+    }
+    updateMode = mode;
+}
+
+void setup() {
+    glEnable(GL_VERTEX_PROGRAM_POINT_SIZE);
+
+    updateShader.vertexShader(glsl(
+        in vec2 vertex;
+        out vec2 coord;
+        void main() {
+            coord = vertex;
+            gl_Position = vec4(vertex * 2.0 - 1.0, 0.0, 1.0);
+        }
+    )).fragmentShader((std::string("#version 400\n") + sphSource + glslSource(
+        precision highp float;
+        uniform sampler2D prevPositions;
+        uniform sampler2D currPositions;
+        uniform int bufferWidth;
+        uniform int bufferHeight;
+        in vec2 coord;
+        out vec4 nextPosition;
 
         void main() {
-            // Format is (x, y, z, massDensity)
             vec4 prevPosition = texture(prevPositions, coord);
             vec4 currPosition = texture(currPositions, coord);
 
-            // Acceleration is initially due to gravity
-            vec3 force = vec3(0.0, -currPosition.w * gravity, 0.0);
-
             // Calculate contributions from all pairs of particles
-            float massDensity = 0.0;
-            float surfaceTensionMagnitude = 0.0;
-            vec3 normal = vec3(0.0);
-            vec3 pressureForce = vec3(0.0);
-            vec3 viscosityForce = vec3(0.0);
+            Sums sums = Sums(0.0, 0.0, vec3(0.0), vec3(0.0), vec3(0.0));
             for (int x = 0; x < bufferWidth; x++) {
                 for (int y = 0; y < bufferHeight; y++) {
                     vec4 currPairPosition = texelFetch(currPositions, ivec2(x, y), 0);
-                    vec3 delta = currPairPosition.xyz - currPosition.xyz;
-                    float distance = length(delta);
-                    if (distance < maxRadius) {
-                        massDensity += particleMass * massDensityKernel(distance);
-                        if (currPosition != currPairPosition) {
-                            vec3 unitDelta = delta / (distance + 0.000000001);
-                            float scale = particleMass / currPairPosition.w;
-
-                            // Compute pressure
-                            float meanPressure = pressureConstant * (currPosition.w + currPairPosition.w - 2.0 * restDensity) / 2.0;
-                            pressureForce += scale * meanPressure * unitDelta * pressureKernel(distance);
-
-                            // Compute viscosity
-                            vec4 prevPairPosition = texelFetch(prevPositions, ivec2(x, y), 0);
-                            vec3 velocityDelta = currPairPosition.xyz - prevPairPosition.xyz - currPosition.xyz + prevPosition.xyz;
-                            viscosityForce += scale * viscosityCoefficient * velocityDelta * viscosityKernel(distance);
-
-                            // Compute surface tension
-                            normal += scale * unitDelta * normalKernel(distance);
-                            surfaceTensionMagnitude += scale * surfaceTensionKernel(distance);
-                        }
+                    if (length(currPairPosition.xyz - currPosition.xyz) < maxRadius) {
+                        vec4 prevPairPosition = texelFetch(prevPositions, ivec2(x, y), 0);
+                        addPair(sums, prevPosition, currPosition, prevPairPosition, currPairPosition);
                     }
                 }
             }
-            force += pressureForce;
-            force += viscosityForce;
-            if (dot(normal, normal) > normalThreshold) {
-                force -= surfaceTensionConstant * surfaceTensionMagnitude * normalize(normal);
-            }
-
-            // Move the point by the velocity. Division by zero (massDensity) is
-            // avoided since the above loop calculates the non-zero contribution
-            // from the current listener on itself.
-            nextPosition.xyz = 2 * currPosition.xyz - prevPosition.xyz + force / massDensity;
-            nextPosition.w = massDensity;
-
-            // Start off with the new position
-            vec3 oldPosition = currPosition.xyz / gridSize;
-            vec3 newPosition = nextPosition.xyz / gridSize;
-            vec3 velocity = newPosition - oldPosition;
-
-            // Bounce off the walls of the box
-            vec3 clamped = clamp(newPosition, 0.0, 1.0);
-            if (clamped.x != newPosition.x) velocity.x = -velocity.x * elasticity;
-            if (clamped.y != newPosition.y) velocity.y = -velocity.y * elasticity;
-            if (clamped.z != newPosition.z) velocity.z = -velocity.z * elasticity;
-
-            // Update the velocity
-            newPosition = oldPosition + velocity;
-
-            // Make sure we stay outside the objects in the box
-            if (collideWithObjects) {
-                newPosition = pushOutOfCylinder(oldPosition, newPosition, vec3(0.5, -1, 0.5), 0.25, 3);
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.8, 0.5), vec3(0.5, 1, 2));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.7, -1), vec3(0.5, 0.9, 0.5));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.6, -1), vec3(2, 0.8, 0.5));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.5, 0.5), vec3(2, 0.7, 2));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.4, 0.5), vec3(0.5, 0.6, 2));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.3, -1), vec3(0.5, 0.5, 0.5));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.2, -1), vec3(2, 0.4, 0.5));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, -1, 0.5), vec3(2, 0.3, 2));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, -1, 0.5), vec3(0.5, 0.2, 2));
-                newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, -1, -1), vec3(0.5, 0.1, 0.5));
-            }
-
-            // Make sure we stay inside the box
-            nextPosition.xyz = clamp(newPosition, 0.0, 1.0) * gridSize;
+            nextPosition = integrate(sums, prevPosition, currPosition);
         }
-    )).link();
+    )).c_str()).linkAsync();
 
-    drawShader.vertexShader(glsl(
+    gridSupported = hasVersion(4, 3);
+    if (gridSupported) setupGrid();
+
+    drawShader.vertexShader((std::string("#version 400\n") + cameraBlock + glslSource(
         uniform int bufferWidth;
         uniform int bufferHeight;
         uniform sampler2D currPositions;
-        uniform mat4 projection;
-        uniform mat4 modelview;
-        uniform vec2 screenSize;
         out vec4 position;
         out vec4 eyeSpace;
         out float pointSize;
@@ -297,10 +690,7 @@ void setup() {
             position = gl_Position = projection * modelview * vec4(currPosition, 1.0);
             pointSize = gl_PointSize = screenSize.y / -eyeSpace.z * radius;
         }
-    )).fragmentShader(glsl(
-        uniform vec2 screenSize;
-        uniform mat4 projection;
-        uniform mat4 modelview;
+    )).c_str()).fragmentShader((std::string("#version 400\n") + cameraBlock + glslSource(
         in vec4 position;
         in vec4 eyeSpace;
         in float pointSize;
@@ -320,7 +710,7 @@ void setup() {
             normal = eyeSpaceNormal;
             gl_FragDepth = clipSpacePos.z / clipSpacePos.w;
         }
-    )).link();
+    )).c_str()).linkAsync();
 
     ssaoShader.vertexShader(glsl(
         in vec2 vertex;
@@ -386,7 +776,7 @@ void setup() {
                 color = (color + old * accumulation) / (accumulation + 1);
             }
         }
-    )).link();
+    )).linkAsync();
 
     textureMappingShader.vertexShader(glsl(
         in vec2 vertex;
@@ -402,7 +792,7 @@ void setup() {
         void main() {
             color = texture(data, coord);
         }
-    )).link();
+    )).linkAsync();
 
     point << vec3();
     point.upload();
@@ -414,11 +804,13 @@ void setup() {
 
     reset(Top);
 
+    camera.attach(drawShader, "Camera");
     drawShader.use();
     drawShader.uniformInt("bufferWidth", bufferWidth);
     drawShader.uniformInt("bufferHeight", bufferHeight);
     drawShader.unuse();
 
+    sph.gridSize = gridSize;
     updateShader.use();
     updateShader.uniform("gridSize", gridSize);
     updateShader.uniformInt("bufferWidth", bufferWidth);
@@ -433,28 +825,31 @@ void setup() {
     ssaoShader.uniformInt("normalTexture", 1);
     ssaoShader.uniformInt("accumulationTexture", 2);
     ssaoShader.unuse();
+
+    if (gridSupported) resizeGrid();
 }
 
 void draw() {
     // Set up the camera
-    mat4 projection, modelview;
-    projection.perspective(45, width / height, 0.01, 1000);
-    modelview.translate(0, 0, -zoomZ).rotateX(angleX).rotateY(angleY).translate(-gridSize * vec3(0.5, 0.25, 0.5));
-
-    screenFBO.attachColor(positionDiffuseTexture, 0).attachColor(normalTexture, 1).check();
-    screenFBO.bind();
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_DEPTH_TEST);
-    drawShader.use();
-    drawShader.uniform("screenSize", vec2(width, height));
-    drawShader.uniform("projection", projection);
-    drawShader.uniform("modelview", modelview);
-    currPositions.bind();
-    pointLayout.drawInstanced(currPositions.width * currPositions.height, GL_POINTS);
-    currPositions.unbind();
-    drawShader.unuse();
-    glDisable(GL_DEPTH_TEST);
-    screenFBO.detachColor(1).unbind();
+    camera.data.projection = mat4().perspective(45, width / height, 0.01, 1000);
+    camera.data.modelview = mat4().translate(0, 0, -zoomZ).rotateX(angleX).rotateY(angleY).translate(-gridSize * vec3(0.5, 0.25, 0.5));
+    camera.data.screenSize = vec2(width, height);
+    camera.upload();
+
+    {
+        GL4_PROFILE("gbuffer");
+        screenFBO.attachColor(positionDiffuseTexture, 0).attachColor(normalTexture, 1).check();
+        screenFBO.bind();
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glEnable(GL_DEPTH_TEST);
+        drawShader.use();
+        currPositions.bind();
+        pointLayout.drawInstanced(currPositions.width * currPositions.height, GL_POINTS);
+        currPositions.unbind();
+        drawShader.unuse();
+        glDisable(GL_DEPTH_TEST);
+        screenFBO.detachColor(1).unbind();
+    }
 
     if (paused) {
         screenFBO.attachColor(accumulationTextureA).check();
@@ -463,22 +858,26 @@ void draw() {
     }
 
     static float frame = 0;
-    ssaoShader.use();
-    ssaoShader.uniformFloat("accumulation", accumulation++);
-    ssaoShader.uniformInt("paused", paused);
-    ssaoShader.uniformFloat("frame", frame++);
-    positionDiffuseTexture.bind(0);
-    normalTexture.bind(1);
-    quadLayout.draw(GL_TRIANGLE_STRIP);
-    normalTexture.unbind(1);
-    positionDiffuseTexture.unbind(0);
-    ssaoShader.unuse();
+    {
+        GL4_PROFILE("ssao");
+        ssaoShader.use();
+        ssaoShader.uniformFloat("accumulation", accumulation++);
+        ssaoShader.uniformInt("paused", paused);
+        ssaoShader.uniformFloat("frame", frame++);
+        positionDiffuseTexture.bind(0);
+        normalTexture.bind(1);
+        quadLayout.draw(GL_TRIANGLE_STRIP);
+        normalTexture.unbind(1);
+        positionDiffuseTexture.unbind(0);
+        ssaoShader.unuse();
+    }
 
     if (paused) {
         accumulationTextureB.unbind(2);
         screenFBO.unbind();
         accumulationTextureA.swapWith(accumulationTextureB);
 
+        GL4_PROFILE("accumulate");
         textureMappingShader.use();
         accumulationTextureA.bind();
         quadLayout.draw(GL_TRIANGLE_STRIP);
@@ -486,7 +885,7 @@ void draw() {
         textureMappingShader.unuse();
     }
 
-    glutSwapBuffers();
+    if (!headless.context) glutSwapBuffers();
 }
 
 // For calculating mouse deltas
@@ -510,15 +909,16 @@ void mousedown(int button, int, int x, int y) {
 }
 
 void keydown(unsigned char key, int, int) {
-    if (key == 27) exit(0);
+    if (key == 27) {
+        if (tracePath) glProfiler.writeTrace(tracePath);
+        exit(0);
+    }
     if (key >= '1' && key <= '1' + SceneCount) reset(Scene(key - '1'));
 
-    if (key == 'k' || key == 'K') {
-        std::vector<vec4> data(bufferWidth * bufferHeight);
-        currPositions.bind();
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &data[0]);
-        currPositions.unbind();
-        prevPositions.create(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, data.data());
+    if (key == 'k' || key == 'K' || key == 'u' || key == 'U' || key == 'e' || key == 'E') {
+        // The positions are modified on the CPU once they arrive in update()
+        currPositions.readbackAsync(positionReadback, GL_RGBA, GL_FLOAT);
+        pendingKey = tolower(key);
     }
 
     if (key == 'p' || key == 'P') {
@@ -526,11 +926,22 @@ void keydown(unsigned char key, int, int) {
         accumulation = 0;
     }
 
-    if (key == 'u' || key == 'U') {
-        std::vector<vec4> data(bufferWidth * bufferHeight);
-        currPositions.bind();
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &data[0]);
-        currPositions.unbind();
+    if (key == 'g' || key == 'G') setUpdateMode(updateMode == GridUpdate ? PairsUpdate : GridUpdate);
+    if (key == 'c' || key == 'C') setUpdateMode(updateMode == CPUUpdate ? PairsUpdate : CPUUpdate);
+}
+
+// Finishes a 'K', 'U', or 'E' action once its position snapshot has arrived.
+// The snapshot is restored as the current positions so the velocity change
+// is relative to the positions it was computed from.
+void applyReadback() {
+    if (!positionReadback.pending() || !positionReadback.ready()) return;
+
+    std::vector<vec4> data;
+    positionReadback.read(data);
+    currPositions.uploadAsync(GL_RGBA, GL_FLOAT, data.data());
+    if (updateMode == CPUUpdate) sph.setPositions(data.data(), data.data(), data.size());
+
+    if (pendingKey == 'u') {
         float angle = frand() * M_PI * 2;
         vec2 dir = vec2(cos(angle), sin(angle)) * 0.005;
         for (size_t i = 0; i < data.size(); i++) {
@@ -538,14 +949,9 @@ void keydown(unsigned char key, int, int) {
             v.x += dir.x;
             v.z += dir.y;
         }
-        prevPositions.create(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, data.data());
     }
 
-    if (key == 'e' || key == 'E') {
-        std::vector<vec4> data(bufferWidth * bufferHeight);
-        currPositions.bind();
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, &data[0]);
-        currPositions.unbind();
+    if (pendingKey == 'e') {
         for (size_t i = 0; i < data.size(); i++) {
             vec4 &v = data[i];
             float theta = frand() * M_PI * 2;
@@ -555,44 +961,216 @@ void keydown(unsigned char key, int, int) {
             v.y += dir.y;
             v.z += dir.z;
         }
-        prevPositions.create(bufferWidth, bufferHeight, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, data.data());
+    }
+
+    prevPositions.uploadAsync(GL_RGBA, GL_FLOAT, data.data());
+    if (updateMode == CPUUpdate) {
+        for (size_t i = 0; i < data.size(); i++) {
+            for (int k = 0; k < 4; k++) sph.prev[k][i] = data[i].xyzw[k];
+        }
     }
 }
 
-void update() {
-    if (!paused) {
-        bufferFBO.attachColor(nextPositions).check();
-        bufferFBO.bind();
-        updateShader.use();
-        prevPositions.bind(0);
-        currPositions.bind(1);
-        quadLayout.draw(GL_TRIANGLE_STRIP);
-        currPositions.unbind(1);
-        prevPositions.unbind(0);
-        updateShader.unuse();
-        bufferFBO.unbind();
+// Advance the simulation by one step with the current update mode
+void step() {
+    if (updateMode == CPUUpdate) {
+        updateWithCPU();
+    } else {
+        if (updateMode == GridUpdate) {
+            updateWithGrid();
+        } else {
+            bufferFBO.attachColor(nextPositions).check();
+            bufferFBO.bind();
+            updateShader.use();
+            prevPositions.bind(0);
+            currPositions.bind(1);
+            quadLayout.draw(GL_TRIANGLE_STRIP);
+            currPositions.unbind(1);
+            prevPositions.unbind(0);
+            updateShader.unuse();
+            bufferFBO.unbind();
+        }
 
         prevPositions.swapWith(currPositions);
         currPositions.swapWith(nextPositions);
     }
+}
+
+void update() {
+    glProfiler.beginFrame();
+    applyReadback();
+
+    if (!paused) {
+        GL4_PROFILE("update");
+        step();
+    }
 
     draw();
+    glProfiler.endFrame();
+
+    // Print the profile every 100 frames when profiling in a window
+    if (glProfiler.enabled && !headless.context && glProfiler.frameNumber % 100 == 0) glProfiler.report();
 }
 
 void resize(int w, int h) {
     width = w;
     height = h;
-    glViewport(0, 0, w, h);
+    glState.setViewport(0, 0, w, h);
 
     std::vector<float> zero(w * h * 3);
-    positionDiffuseTexture.create(w, h, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
-    normalTexture.create(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
-    accumulationTextureA.create(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, zero.data());
-    accumulationTextureB.create(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, zero.data());
+    positionDiffuseTexture.allocate(w, h, 1, GL_RGBA32F, GL_RGBA, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    normalTexture.allocate(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE);
+    accumulationTextureA.allocate(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, zero.data());
+    accumulationTextureB.allocate(w, h, 1, GL_RGB32F, GL_RGB, GL_FLOAT, GL_NEAREST, GL_CLAMP_TO_EDGE, zero.data());
     accumulation = 0;
 }
 
+// Run the GPU and CPU updates side by side and print the largest difference
+// between them. Both start every step from the GPU positions so differences
+// in rounding don't build up over the run. A particle right on the surface
+// of a wall or object can still land on different sides of it, so instead of
+// failing on any large difference this fails if more than a few particles
+// per step differ by more than rounding would explain.
+bool validate(int steps) {
+    const float tolerance = 1.0e-5;
+    Update gpuMode = gridSupported ? GridUpdate : PairsUpdate;
+    std::vector<vec4> prev, curr, gpu, cpu(bufferWidth * bufferHeight);
+    float positionError = 0, densityError = 0;
+    int outliers = 0;
+    double gpuSeconds = 0, cpuSeconds = 0;
+
+    for (int i = 0; i < steps; i++) {
+        readPositions(prevPositions, prev);
+        readPositions(currPositions, curr);
+        sph.setPositions(prev.data(), curr.data(), curr.size());
+
+        double start = currentTime();
+        updateMode = gpuMode;
+        step();
+        readPositions(currPositions, gpu);
+        gpuSeconds += currentTime() - start;
+
+        sph.step();
+        cpuSeconds += sph.seconds;
+        sph.getPositions(NULL, cpu.data());
+
+        for (size_t j = 0; j < cpu.size(); j++) {
+            float error = length(vec3(cpu[j].x - gpu[j].x, cpu[j].y - gpu[j].y, cpu[j].z - gpu[j].z)) / length(gridSize);
+            if (error > tolerance) outliers++;
+            positionError = std::max(positionError, error);
+            densityError = std::max(densityError, fabsf(cpu[j].w - gpu[j].w) / gpu[j].w);
+        }
+    }
+
+    printf("%s update: %.1f steps/sec\n", gridSupported ? "GPU grid" : "GPU pairs", steps / gpuSeconds);
+    printf("CPU update (%s, %d threads): %.1f steps/sec\n", simdName(sph.level), threadCount(), steps / cpuSeconds);
+    printf("largest position difference: %g of the box size (%d differences over %g)\n", positionError, outliers, tolerance);
+    printf("largest density difference: %g relative\n", densityError);
+    return outliers <= steps * (long long)cpu.size() / 10000 && densityError < tolerance * 10;
+}
+
+// Time the CPU update alone on size * size particles falling from the top
+// scene. This never creates a context, so it also runs without a GPU.
+void benchmark(int size) {
+    setSize(size);
+    std::vector<vec4> points = scenePoints(Top);
+    sph.gridSize = gridSize;
+    sph.collideWithObjects = true;
+    sph.setPositions(points.data(), points.data(), points.size());
+    int steps = 0;
+    double seconds = 0;
+    while (steps < 3 || seconds < 2) {
+        sph.step();
+        seconds += sph.seconds;
+        steps++;
+    }
+    printf("%d particles, %s, %d threads: %d steps in %.3f seconds (%.1f steps/sec)\n",
+        sph.count, simdName(sph.level), threadCount(), steps, seconds, steps / seconds);
+}
+
 int main(int argc, char *argv[]) {
+    int headlessSteps = 0;
+    int validateSteps = 0;
+    int benchmarkSize = 0;
+    Update startMode = PairsUpdate;
+    for (int i = 1; i < argc; i++) {
+        // Run a fixed number of steps without a window using "--headless <steps>"
+        if (!strcmp(argv[i], "--headless") && i + 1 < argc) headlessSteps = atoi(argv[++i]);
+
+        // Leave objects bound after use instead of unbinding them
+        else if (!strcmp(argv[i], "--skip-unbinds")) glState.skipUnbinds = true;
+
+        // Simulate size * size particles instead of 128 * 128, in a box that
+        // grows to keep the same density
+        else if (!strcmp(argv[i], "--size") && i + 1 < argc) setSize(std::max(1, atoi(argv[++i])));
+
+        // Start with the grid update instead of visiting every pair
+        else if (!strcmp(argv[i], "--grid")) startMode = GridUpdate;
+
+        // Start with the update on the CPU
+        else if (!strcmp(argv[i], "--cpu")) startMode = CPUUpdate;
+
+        // Use "scalar", "avx2", or "avx512" for the CPU update instead of the
+        // best one this CPU supports
+        else if (!strcmp(argv[i], "--simd") && i + 1 < argc) {
+            const char *name = argv[++i];
+            SIMDLevel level = !strcmp(name, "avx512") ? SIMDAVX512 : !strcmp(name, "avx2") ? SIMDAVX2 : SIMDScalar;
+            if (level > sph.level) printf("this CPU doesn't support %s, using %s\n", name, simdName(sph.level));
+            else sph.level = level;
+        }
+
+        // Use this many threads for the CPU update instead of one per core
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) setThreadCount(atoi(argv[++i]));
+
+        // Compare the CPU update against the GPU for a number of steps and exit
+        else if (!strcmp(argv[i], "--validate") && i + 1 < argc) validateSteps = atoi(argv[++i]);
+
+        // Time the CPU update on size * size particles and exit
+        else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) benchmarkSize = std::max(1, atoi(argv[++i]));
+
+        // Time each pass on the CPU and GPU and print the results
+        else if (!strcmp(argv[i], "--profile")) glProfiler.enabled = true;
+
+        // Also add a scope around every draw call and framebuffer bind
+        else if (!strcmp(argv[i], "--profile-draws")) glProfiler.enabled = glProfiler.autoScopes = true;
+
+        // Profile and write every frame to a Chrome trace file on exit
+        else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            glProfiler.enabled = glProfiler.tracing = true;
+            tracePath = argv[++i];
+        }
+    }
+
+    if (benchmarkSize) {
+        benchmark(benchmarkSize);
+        return 0;
+    }
+
+    if (validateSteps) {
+        headless.create(width, height);
+        setup();
+        resize(width, height);
+        return validate(validateSteps) ? 0 : 1;
+    }
+
+    if (headlessSteps) {
+        headless.create(width, height);
+        setup();
+        resize(width, height);
+        setUpdateMode(startMode);
+        glState.resetCounters();
+        double seconds = headless.run(update, headlessSteps);
+        printf("%d steps in %.3f seconds (%.1f steps/sec)\n", headlessSteps, seconds, headlessSteps / seconds);
+        if (updateMode == CPUUpdate) printf("CPU update used %s with %d threads\n", simdName(sph.level), threadCount());
+        printf("%u state changes issued, %u elided\n", glState.issued, glState.elided);
+        if (glProfiler.enabled) {
+            glProfiler.flush();
+            glProfiler.report();
+        }
+        if (tracePath) glProfiler.writeTrace(tracePath);
+        return 0;
+    }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutCreateWindow("Example");
@@ -605,6 +1183,7 @@ int main(int argc, char *argv[]) {
     glutIdleFunc(update);
     setup();
     resize(width, height);
+    setUpdateMode(startMode);
     glutMainLoop();
     return 0;
 }
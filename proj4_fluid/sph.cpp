@@ -0,0 +1,208 @@
+#include "sph.h"
+
+// The constants in the update shaders
+static const float pi = 3.14159265;
+static const float particleMass = 1.0;
+static const float maxRadius = 0.01;
+static const float viscosityCoefficient = 10.0;
+static const float pressureConstant = 5.0e-6;
+static const float restDensity = 1.0e-3;
+static const float gravity = 9.8e-5;
+static const float surfaceTensionConstant = 2.0e-2;
+static const float normalThreshold = 1000.0;
+static const float elasticity = 0.5;
+
+// The constant factors of the smoothing kernels. The surface tension kernel
+// has the same factor as the normal kernel.
+static const float massDensityScale = 315.0 / (64.0 * pi * pow(maxRadius, 9.0));
+static const float pressureScale = -45.0 / (pi * pow(maxRadius, 6.0));
+static const float viscosityScale = 45.0 / (pi * pow(maxRadius, 6.0));
+static const float normalScale = -945.0 / (32.0 * pi * pow(maxRadius, 9.0));
+
+namespace scalar {
+    typedef FloatScalar Float;
+    #include "sphforces.h"
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+SIMD_BEGIN_AVX2
+namespace avx2 {
+    typedef FloatAVX2 Float;
+    #include "sphforces.h"
+}
+SIMD_END
+
+SIMD_BEGIN_AVX512
+namespace avx512 {
+    typedef FloatAVX512 Float;
+    #include "sphforces.h"
+}
+SIMD_END
+
+#endif
+
+void SPH::setPositions(const vec4 *prevPositions, const vec4 *currPositions, int count) {
+    this->count = count;
+    for (int k = 0; k < 4; k++) {
+        prev[k].resize(count);
+        curr[k].resize(count);
+        next[k].resize(count);
+    }
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < 4; k++) {
+            prev[k][i] = prevPositions[i].xyzw[k];
+            curr[k][i] = currPositions[i].xyzw[k];
+        }
+    }
+}
+
+void SPH::getPositions(vec4 *prevPositions, vec4 *currPositions) const {
+    for (int i = 0; i < count; i++) {
+        if (prevPositions) prevPositions[i] = vec4(prev[0][i], prev[1][i], prev[2][i], prev[3][i]);
+        if (currPositions) currPositions[i] = position(i);
+    }
+}
+
+void SPH::sort() {
+    for (int k = 0; k < 3; k++) cells[k] = std::max(1, (int)ceilf(gridSize.xyz[k] / cellSize()));
+    int cellCount = cells[0] * cells[1] * cells[2];
+
+    cellOf.resize(count);
+    parallelFor(0, count, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            int coord[3];
+            for (int k = 0; k < 3; k++) coord[k] = std::min(std::max((int)(curr[k][i] / cellSize()), 0), cells[k] - 1);
+            cellOf[i] = (coord[2] * cells[1] + coord[1]) * cells[0] + coord[0];
+        }
+    });
+
+    // Counting sort, which keeps particles in the same cell in index order
+    cellStart.assign(cellCount + 1, 0);
+    for (int i = 0; i < count; i++) cellStart[cellOf[i] + 1]++;
+    for (int c = 0; c < cellCount; c++) cellStart[c + 1] += cellStart[c];
+    order.resize(count);
+    std::vector<int> offset(cellStart.begin(), cellStart.end() - 1);
+    for (int i = 0; i < count; i++) order[offset[cellOf[i]]++] = i;
+
+    // Sixteen floats of padding covers the widest load
+    for (int k = 0; k < 4; k++) {
+        sortedPrev[k].resize(count + 16);
+        sortedCurr[k].resize(count + 16);
+    }
+    parallelFor(0, count, 4096, [&](int begin, int end) {
+        for (int i = begin; i < end; i++) {
+            for (int k = 0; k < 4; k++) {
+                sortedPrev[k][i] = prev[k][order[i]];
+                sortedCurr[k][i] = curr[k][order[i]];
+            }
+        }
+    });
+}
+
+void SPH::step() {
+    double start = currentTime();
+    sort();
+
+    // Sorted order keeps the particles handled by each thread close together
+    void (*kernel)(SPH &, int, int) = scalar::forces;
+#if defined(__x86_64__) || defined(__i386__)
+    if (level == SIMDAVX2) kernel = avx2::forces;
+    if (level == SIMDAVX512) kernel = avx512::forces;
+#endif
+    parallelFor(0, count, 256, [&](int begin, int end) {
+        kernel(*this, begin, end);
+    });
+
+    for (int k = 0; k < 4; k++) {
+        prev[k].swap(curr[k]);
+        curr[k].swap(next[k]);
+    }
+    seconds = currentTime() - start;
+}
+
+static float clamp(float x, float low, float high) {
+    return fminf(fmaxf(x, low), high);
+}
+
+static vec3 pushOutOfCylinder(const vec3 &oldPoint, vec3 newPoint, const vec3 &center, float radius, float height) {
+    if (newPoint.y >= center.y && newPoint.y <= center.y + height) {
+        vec2 delta = vec2(newPoint.x - center.x, newPoint.z - center.z);
+        if (length(delta) <= radius) {
+            if (oldPoint.y <= center.y) {
+                newPoint.y = fminf(center.y, oldPoint.y - fabsf(newPoint.y - oldPoint.y) * elasticity);
+            } else if (oldPoint.y >= center.y + height) {
+                newPoint.y = fmaxf(center.y + height, oldPoint.y + fabsf(newPoint.y - oldPoint.y) * elasticity);
+            } else {
+                vec3 normal = normalized(vec3(delta.x, 0, delta.y));
+                vec3 incident = newPoint - oldPoint;
+                newPoint = oldPoint + (incident - normal * (2 * dot(normal, incident))) * elasticity;
+                newPoint.x = center.x + normal.x * radius;
+                newPoint.z = center.z + normal.z * radius;
+            }
+        }
+    }
+    return newPoint;
+}
+
+static vec3 pushOutOfBox(const vec3 &oldPoint, vec3 newPoint, const vec3 &minCoord, const vec3 &maxCoord) {
+    for (int k = 0; k < 3; k++) {
+        if (clamp(newPoint.xyz[k], minCoord.xyz[k], maxCoord.xyz[k]) != newPoint.xyz[k]) return newPoint;
+    }
+
+    // Push out through the face nearest to where the point came from
+    vec3 delta = (oldPoint - minCoord) / (maxCoord - minCoord) - 0.5;
+    vec3 choice(fabsf(delta.x), fabsf(delta.y), fabsf(delta.z));
+    float largest = fmaxf(fmaxf(choice.x, choice.y), choice.z);
+    int k = choice.x == largest ? 0 : choice.y == largest ? 1 : 2;
+    newPoint.xyz[k] = oldPoint.xyz[k] + (oldPoint.xyz[k] - newPoint.xyz[k]) * elasticity;
+    newPoint.xyz[k] = delta.xyz[k] > 0 ? fmaxf(newPoint.xyz[k], maxCoord.xyz[k]) : fminf(newPoint.xyz[k], minCoord.xyz[k]);
+    return newPoint;
+}
+
+vec4 SPH::integrate(int i, const float sums[11]) const {
+    vec3 prevPosition(sortedPrev[0][i], sortedPrev[1][i], sortedPrev[2][i]);
+    vec3 currPosition(sortedCurr[0][i], sortedCurr[1][i], sortedCurr[2][i]);
+    float massDensity = sums[0];
+    float surfaceTensionMagnitude = sums[1];
+    vec3 normal(sums[2], sums[3], sums[4]);
+
+    // Acceleration is initially due to gravity
+    vec3 force(0, -sortedCurr[3][i] * gravity, 0);
+    force += vec3(sums[5], sums[6], sums[7]);
+    force += vec3(sums[8], sums[9], sums[10]);
+    if (dot(normal, normal) > normalThreshold) {
+        force -= normalized(normal) * (surfaceTensionConstant * surfaceTensionMagnitude);
+    }
+
+    // Move the point by the velocity
+    vec3 nextPosition = 2 * currPosition - prevPosition + force / massDensity;
+    vec3 oldPosition = currPosition / gridSize;
+    vec3 newPosition = nextPosition / gridSize;
+    vec3 velocity = newPosition - oldPosition;
+
+    // Bounce off the walls of the box
+    for (int k = 0; k < 3; k++) {
+        if (clamp(newPosition.xyz[k], 0, 1) != newPosition.xyz[k]) velocity.xyz[k] = -velocity.xyz[k] * elasticity;
+    }
+    newPosition = oldPosition + velocity;
+
+    // Make sure we stay outside the objects in the box
+    if (collideWithObjects) {
+        newPosition = pushOutOfCylinder(oldPosition, newPosition, vec3(0.5, -1, 0.5), 0.25, 3);
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.8, 0.5), vec3(0.5, 1, 2));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.7, -1), vec3(0.5, 0.9, 0.5));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.6, -1), vec3(2, 0.8, 0.5));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.5, 0.5), vec3(2, 0.7, 2));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.4, 0.5), vec3(0.5, 0.6, 2));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, 0.3, -1), vec3(0.5, 0.5, 0.5));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, 0.2, -1), vec3(2, 0.4, 0.5));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(0.5, -1, 0.5), vec3(2, 0.3, 2));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, -1, 0.5), vec3(0.5, 0.2, 2));
+        newPosition = pushOutOfBox(oldPosition, newPosition, vec3(-1, -1, -1), vec3(0.5, 0.1, 0.5));
+    }
+
+    // Make sure we stay inside the box
+    for (int k = 0; k < 3; k++) newPosition.xyz[k] = clamp(newPosition.xyz[k], 0, 1);
+    return vec4(newPosition * gridSize, massDensity);
+}
@@ -0,0 +1,64 @@
+#ifndef SPH_H
+#define SPH_H
+
+#include "gl4.h"
+#include "simd.h"
+
+// A CPU version of the SPH update shaders in main.cpp, for checking them and
+// for running without a GPU. Positions are kept as separate x, y, z, and w
+// (mass density) arrays so the neighbor loop can load several particles into
+// one SIMD register. Each step sorts the particles into a grid of cells as
+// wide as the kernel radius with a counting sort and then sums the forces
+// from the 27 cells around each particle, using as many lanes as the CPU has
+// (AVX-512, AVX2, or one at a time).
+//
+// Usage:
+//
+//     SPH sph;
+//     sph.gridSize = gridSize;
+//     sph.setPositions(prev, curr, count);
+//     sph.step();
+//     sph.getPositions(prev, curr);
+//
+// Work is spread over threads using parallelFor().
+struct SPH {
+    int count;
+    vec3 gridSize;
+    bool collideWithObjects;
+    SIMDLevel level;
+    int cells[3];
+
+    // Indexed by particle, and then by x, y, z, w
+    std::vector<float> prev[4], curr[4], next[4];
+
+    // The same data sorted by cell, padded with zeros so the last lanes of
+    // a load never read past the end
+    std::vector<float> sortedPrev[4], sortedCurr[4];
+
+    // The particles in cell c are sorted[cellStart[c]] to sorted[cellStart[c + 1]]
+    std::vector<int> cellStart;
+    std::vector<int> cellOf;
+    std::vector<int> order;
+    double seconds;
+
+    SPH() : count(), gridSize(0.5), collideWithObjects(), level(simdLevel()), seconds() { cells[0] = cells[1] = cells[2] = 0; }
+
+    void setPositions(const vec4 *prevPositions, const vec4 *currPositions, int count);
+    void getPositions(vec4 *prevPositions, vec4 *currPositions) const;
+    vec4 position(int i) const { return vec4(curr[0][i], curr[1][i], curr[2][i], curr[3][i]); }
+
+    // Compute the next positions and make them the current ones
+    void step();
+
+    // Sort the particles by cell
+    void sort();
+
+    // The next position of each particle given the sums over its neighbors,
+    // which is integrate() in the update shaders
+    vec4 integrate(int sorted, const float sums[11]) const;
+
+    // The constants in the update shaders
+    static float cellSize() { return 0.01; }
+};
+
+#endif // SPH_H
@@ -0,0 +1,92 @@
+// The SPH neighbor loop, which sph.cpp includes once per instruction set
+// with Float set to one of the types in simd.h. There's no include guard on
+// purpose. Each iteration of the inner loop handles Float::Width particles
+// of one cell, and lanes that are past the end of the cell or too far away
+// are masked out with select() instead of multiplied by zero so the garbage
+// in them can't turn into NaNs.
+static void forces(SPH &sph, int begin, int end) {
+    typedef Float::Mask Mask;
+    const float *prevX = sph.sortedPrev[0].data(), *prevY = sph.sortedPrev[1].data(), *prevZ = sph.sortedPrev[2].data();
+    const float *currX = sph.sortedCurr[0].data(), *currY = sph.sortedCurr[1].data(), *currZ = sph.sortedCurr[2].data(), *currW = sph.sortedCurr[3].data();
+    const int *cells = sph.cells;
+
+    for (int i = begin; i < end; i++) {
+        Float x = currX[i], y = currY[i], z = currZ[i], w = currW[i];
+        Float velocityX = currX[i] - prevX[i], velocityY = currY[i] - prevY[i], velocityZ = currZ[i] - prevZ[i];
+        Float massDensity, surfaceTensionMagnitude;
+        Float normalX, normalY, normalZ;
+        Float pressureX, pressureY, pressureZ;
+        Float viscosityX, viscosityY, viscosityZ;
+
+        int center[3], low[3], high[3];
+        float position[3] = { currX[i], currY[i], currZ[i] };
+        for (int k = 0; k < 3; k++) {
+            center[k] = std::min(std::max((int)(position[k] / SPH::cellSize()), 0), cells[k] - 1);
+            low[k] = std::max(center[k] - 1, 0);
+            high[k] = std::min(center[k] + 1, cells[k] - 1);
+        }
+
+        for (int cz = low[2]; cz <= high[2]; cz++) {
+            for (int cy = low[1]; cy <= high[1]; cy++) {
+                // Neighboring cells in x are consecutive in the sorted order
+                int row = (cz * cells[1] + cy) * cells[0];
+                int first = sph.cellStart[row + low[0]];
+                int last = sph.cellStart[row + high[0] + 1];
+                Float lastPair = (float)last;
+
+                for (int j = first; j < last; j += Float::Width) {
+                    Float pairX = Float::load(currX + j), pairY = Float::load(currY + j), pairZ = Float::load(currZ + j), pairW = Float::load(currW + j);
+                    Float deltaX = pairX - x, deltaY = pairY - y, deltaZ = pairZ - z;
+                    Float distance = sqrt(deltaX * deltaX + deltaY * deltaY + deltaZ * deltaZ);
+                    Mask near = (Float((float)j) + Float::lanes() < lastPair) & (distance < maxRadius);
+                    if (!any(near)) continue;
+
+                    Float squared = maxRadius * maxRadius - distance * distance;
+                    Float zero;
+                    massDensity += select(near, particleMass * massDensityScale * squared * squared * squared, zero);
+
+                    // Particles at exactly the same position, including the
+                    // particle itself, only add to the density
+                    Mask other = near & ((pairX != x) | (pairY != y) | (pairZ != z) | (pairW != w));
+                    if (!any(other)) continue;
+
+                    Float scale = select(other, particleMass / pairW, zero);
+                    Float inverse = Float(1.0f) / (distance + 0.000000001f);
+                    Float unitX = deltaX * inverse, unitY = deltaY * inverse, unitZ = deltaZ * inverse;
+                    Float falloff = maxRadius - distance;
+
+                    Float meanPressure = pressureConstant * (w + pairW - 2.0f * restDensity) / 2.0f;
+                    Float pressure = select(other, scale * meanPressure * pressureScale * falloff * falloff, zero);
+                    pressureX += pressure * unitX;
+                    pressureY += pressure * unitY;
+                    pressureZ += pressure * unitZ;
+
+                    Float viscosity = select(other, scale * viscosityCoefficient * viscosityScale * falloff, zero);
+                    viscosityX += viscosity * (pairX - Float::load(prevX + j) - velocityX);
+                    viscosityY += viscosity * (pairY - Float::load(prevY + j) - velocityY);
+                    viscosityZ += viscosity * (pairZ - Float::load(prevZ + j) - velocityZ);
+
+                    Float normal = select(other, scale * normalScale * distance * squared * squared, zero);
+                    normalX += normal * unitX;
+                    normalY += normal * unitY;
+                    normalZ += normal * unitZ;
+
+                    surfaceTensionMagnitude += select(other, scale * normalScale * squared * (3.0f * maxRadius * maxRadius - 7.0f * distance * distance), zero);
+                }
+            }
+        }
+
+        float sums[11] = {
+            massDensity.sum(), surfaceTensionMagnitude.sum(),
+            normalX.sum(), normalY.sum(), normalZ.sum(),
+            pressureX.sum(), pressureY.sum(), pressureZ.sum(),
+            viscosityX.sum(), viscosityY.sum(), viscosityZ.sum(),
+        };
+        vec4 next = sph.integrate(i, sums);
+        int particle = sph.order[i];
+        sph.next[0][particle] = next.x;
+        sph.next[1][particle] = next.y;
+        sph.next[2][particle] = next.z;
+        sph.next[3][particle] = next.w;
+    }
+}
@@ -0,0 +1,302 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Wrappers around SIMD registers so CPU kernels can be written once as a
+// template and compiled for several instruction sets. Each float type has the
+// same interface: a Width, load() and store(), arithmetic, sqrt(), floor(),
+// abs(), min(), max(), comparisons that return a Mask (combined with & and |
+// and tested with any()), select() to pick lanes from two values using a
+// mask, and sum() to add the lanes together.
+//
+// The AVX2 and AVX-512 types are compiled with the GCC target pragma, so this
+// doesn't need -mavx2 or -mavx512f. Kernels using them must be compiled for
+// the same target, which is easiest by including the kernel source once per
+// instruction set between the same pragmas:
+//
+//     SIMD_BEGIN_AVX2
+//     namespace avx2 {
+//         typedef FloatAVX2 Float;
+//         #include "kernel.h"
+//     }
+//     SIMD_END
+//
+// and to only call them when simdLevel() says the CPU supports them.
+
+#include <math.h>
+
+enum SIMDLevel {
+    SIMDScalar,
+    SIMDAVX2,
+    SIMDAVX512,
+};
+
+struct FloatScalar {
+    typedef bool Mask;
+    enum { Width = 1 };
+    float v;
+
+    FloatScalar() : v() {}
+    FloatScalar(float f) : v(f) {}
+
+    static FloatScalar load(const float *p) { return *p; }
+    static FloatScalar lanes() { return 0.0f; }
+    void store(float *p) const { *p = v; }
+
+    FloatScalar operator - () const { return -v; }
+    FloatScalar &operator += (FloatScalar f) { v += f.v; return *this; }
+    float sum() const { return v; }
+};
+
+inline FloatScalar operator + (FloatScalar a, FloatScalar b) {
+    return a.v + b.v;
+}
+
+inline FloatScalar operator - (FloatScalar a, FloatScalar b) {
+    return a.v - b.v;
+}
+
+inline FloatScalar operator * (FloatScalar a, FloatScalar b) {
+    return a.v * b.v;
+}
+
+inline FloatScalar operator / (FloatScalar a, FloatScalar b) {
+    return a.v / b.v;
+}
+
+inline bool operator < (FloatScalar a, FloatScalar b) {
+    return a.v < b.v;
+}
+
+inline bool operator != (FloatScalar a, FloatScalar b) {
+    return a.v != b.v;
+}
+
+inline FloatScalar sqrt(FloatScalar f) {
+    return sqrtf(f.v);
+}
+
+inline FloatScalar floor(FloatScalar f) {
+    return floorf(f.v);
+}
+
+inline FloatScalar abs(FloatScalar f) {
+    return fabsf(f.v);
+}
+
+inline FloatScalar min(FloatScalar a, FloatScalar b) {
+    return fminf(a.v, b.v);
+}
+
+inline FloatScalar max(FloatScalar a, FloatScalar b) {
+    return fmaxf(a.v, b.v);
+}
+
+inline FloatScalar select(bool m, FloatScalar a, FloatScalar b) {
+    return m ? a : b;
+}
+
+inline bool any(bool m) {
+    return m;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+#define SIMD_BEGIN_AVX2 _Pragma("GCC push_options") _Pragma("GCC target(\"avx2,fma\")")
+#define SIMD_BEGIN_AVX512 _Pragma("GCC push_options") _Pragma("GCC target(\"avx512f,avx2,fma\")")
+#define SIMD_END _Pragma("GCC pop_options")
+
+SIMD_BEGIN_AVX2
+
+struct MaskAVX2 {
+    __m256 m;
+
+    MaskAVX2(__m256 m) : m(m) {}
+
+    MaskAVX2 operator & (MaskAVX2 b) const { return _mm256_and_ps(m, b.m); }
+    MaskAVX2 operator | (MaskAVX2 b) const { return _mm256_or_ps(m, b.m); }
+};
+
+inline bool any(MaskAVX2 b) {
+    return _mm256_movemask_ps(b.m) != 0;
+}
+
+struct FloatAVX2 {
+    typedef MaskAVX2 Mask;
+    enum { Width = 8 };
+    __m256 v;
+
+    FloatAVX2() : v(_mm256_setzero_ps()) {}
+    FloatAVX2(float f) : v(_mm256_set1_ps(f)) {}
+    FloatAVX2(__m256 v) : v(v) {}
+
+    static FloatAVX2 load(const float *p) { return _mm256_loadu_ps(p); }
+    static FloatAVX2 lanes() { return _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7); }
+    void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+    FloatAVX2 operator - () const { return _mm256_sub_ps(_mm256_setzero_ps(), v); }
+    FloatAVX2 &operator += (FloatAVX2 f) { v = _mm256_add_ps(v, f.v); return *this; }
+
+    float sum() const {
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_movehdup_ps(half));
+        return _mm_cvtss_f32(half);
+    }
+};
+
+inline FloatAVX2 operator + (FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_add_ps(a.v, b.v);
+}
+
+inline FloatAVX2 operator - (FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_sub_ps(a.v, b.v);
+}
+
+inline FloatAVX2 operator * (FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_mul_ps(a.v, b.v);
+}
+
+inline FloatAVX2 operator / (FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_div_ps(a.v, b.v);
+}
+
+inline MaskAVX2 operator < (FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);
+}
+
+inline MaskAVX2 operator != (FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_UQ);
+}
+
+inline FloatAVX2 sqrt(FloatAVX2 f) {
+    return _mm256_sqrt_ps(f.v);
+}
+
+inline FloatAVX2 floor(FloatAVX2 f) {
+    return _mm256_floor_ps(f.v);
+}
+
+inline FloatAVX2 abs(FloatAVX2 f) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), f.v);
+}
+
+inline FloatAVX2 min(FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_min_ps(a.v, b.v);
+}
+
+inline FloatAVX2 max(FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_max_ps(a.v, b.v);
+}
+
+inline FloatAVX2 select(MaskAVX2 m, FloatAVX2 a, FloatAVX2 b) {
+    return _mm256_blendv_ps(b.v, a.v, m.m);
+}
+
+SIMD_END
+
+SIMD_BEGIN_AVX512
+
+struct MaskAVX512 {
+    __mmask16 m;
+
+    MaskAVX512(__mmask16 m) : m(m) {}
+
+    MaskAVX512 operator & (MaskAVX512 b) const { return (__mmask16)(m & b.m); }
+    MaskAVX512 operator | (MaskAVX512 b) const { return (__mmask16)(m | b.m); }
+};
+
+inline bool any(MaskAVX512 b) {
+    return b.m != 0;
+}
+
+struct FloatAVX512 {
+    typedef MaskAVX512 Mask;
+    enum { Width = 16 };
+    __m512 v;
+
+    FloatAVX512() : v(_mm512_setzero_ps()) {}
+    FloatAVX512(float f) : v(_mm512_set1_ps(f)) {}
+    FloatAVX512(__m512 v) : v(v) {}
+
+    static FloatAVX512 load(const float *p) { return _mm512_loadu_ps(p); }
+    static FloatAVX512 lanes() { return _mm512_setr_ps(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15); }
+    void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+    FloatAVX512 operator - () const { return _mm512_sub_ps(_mm512_setzero_ps(), v); }
+    FloatAVX512 &operator += (FloatAVX512 f) { v = _mm512_add_ps(v, f.v); return *this; }
+    float sum() const { return _mm512_reduce_add_ps(v); }
+};
+
+inline FloatAVX512 operator + (FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_add_ps(a.v, b.v);
+}
+
+inline FloatAVX512 operator - (FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_sub_ps(a.v, b.v);
+}
+
+inline FloatAVX512 operator * (FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_mul_ps(a.v, b.v);
+}
+
+inline FloatAVX512 operator / (FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_div_ps(a.v, b.v);
+}
+
+inline MaskAVX512 operator < (FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ);
+}
+
+inline MaskAVX512 operator != (FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_cmp_ps_mask(a.v, b.v, _CMP_NEQ_UQ);
+}
+
+inline FloatAVX512 sqrt(FloatAVX512 f) {
+    return _mm512_sqrt_ps(f.v);
+}
+
+inline FloatAVX512 floor(FloatAVX512 f) {
+    return _mm512_roundscale_ps(f.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+}
+
+inline FloatAVX512 abs(FloatAVX512 f) {
+    return _mm512_abs_ps(f.v);
+}
+
+inline FloatAVX512 min(FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_min_ps(a.v, b.v);
+}
+
+inline FloatAVX512 max(FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_max_ps(a.v, b.v);
+}
+
+inline FloatAVX512 select(MaskAVX512 m, FloatAVX512 a, FloatAVX512 b) {
+    return _mm512_mask_blend_ps(m.m, b.v, a.v);
+}
+
+SIMD_END
+
+// The best instruction set this CPU supports
+inline SIMDLevel simdLevel() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SIMDAVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMDAVX2;
+    return SIMDScalar;
+}
+
+#else
+
+// The best instruction set this CPU supports
+inline SIMDLevel simdLevel() {
+    return SIMDScalar;
+}
+
+#endif
+
+inline const char *simdName(SIMDLevel level) {
+    return level == SIMDAVX512 ? "AVX-512" : level == SIMDAVX2 ? "AVX2" : "scalar";
+}
+
+#endif // SIMD_H